@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * File-backed mode (request-based only): instead of living in RAM, the device
+ * forwards its I/O to a backing file, or block device, opened with O_DIRECT -
+ * a lean loop device.
+ *
+ * Reads and writes become asynchronous direct kiocbs built straight on the
+ * request's bio_vecs (no copy); flush becomes fsync; discard and write-zeroes
+ * become fallocate(). Submission happens from a per-device workqueue, as the
+ * filesystem under the backing file may block (e.g. to read its own metadata),
+ * which ->queue_rq() must never do.
+ *
+ * With 'cache=writeback', the RAM store is kept in front of the file as a
+ * write-back cache instead, see cache.c.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include "device.h"
+
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+
+/*
+ * Both the submitter and the kiocb completion hold a reference on the command:
+ * a completion may come in before ->read_iter()/->write_iter() has returned.
+ */
+static void sblkdev_backing_put(struct sblkdev_cmd *cmd)
+{
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+
+	if (!atomic_dec_and_test(&cmd->ref))
+		return;
+
+	kfree(cmd->bvec);
+	cmd->bvec = NULL;
+	blk_mq_complete_request(rq);
+}
+
+static void sblkdev_backing_rw_complete(struct kiocb *iocb, long ret)
+{
+	struct sblkdev_cmd *cmd = container_of(iocb, struct sblkdev_cmd, iocb);
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+
+	if (req_op(rq) == REQ_OP_WRITE)
+		kiocb_end_write(iocb);
+
+	if (ret == blk_rq_bytes(rq))
+		cmd->status = BLK_STS_OK;
+	else
+		cmd->status = errno_to_blk_status(ret < 0 ? ret : -EIO);
+
+	sblkdev_backing_put(cmd);
+}
+
+static void sblkdev_backing_rw(struct sblkdev_device *dev, struct sblkdev_cmd *cmd,
+			       loff_t pos, int rw)
+{
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	struct file *file = dev->backing_file;
+	struct req_iterator rq_iter;
+	struct bio_vec *bvec, tmp;
+	struct iov_iter iter;
+	unsigned int offset;
+	int nr_bvec = 0;
+	ssize_t ret;
+
+	rq_for_each_bvec(tmp, rq, rq_iter)
+		nr_bvec++;
+
+	if (rq->bio != rq->biotail) {
+		/* A merged request: gather the bio_vecs of all its bios */
+		bvec = kmalloc_array(nr_bvec, sizeof(*bvec), GFP_NOIO);
+		if (!bvec) {
+			/* Not an I/O error: try again a little later */
+			blk_mq_requeue_request(rq, false);
+			blk_mq_delay_kick_requeue_list(rq->q, SBLKDEV_REQUEUE_DELAY_MS);
+			return;
+		}
+		cmd->bvec = bvec;
+		rq_for_each_bvec(tmp, rq, rq_iter)
+			*bvec++ = tmp;
+		bvec = cmd->bvec;
+		offset = 0;
+	} else {
+		/* A single bio: use its bio_vec array directly */
+		offset = rq->bio->bi_iter.bi_bvec_done;
+		bvec = __bvec_iter_bvec(rq->bio->bi_io_vec, rq->bio->bi_iter);
+	}
+	atomic_set(&cmd->ref, 2);
+
+	iov_iter_bvec(&iter, rw, bvec, nr_bvec, blk_rq_bytes(rq));
+	iter.iov_offset = offset;
+
+	cmd->iocb.ki_pos = pos;
+	cmd->iocb.ki_filp = file;
+	cmd->iocb.ki_complete = sblkdev_backing_rw_complete;
+	cmd->iocb.ki_flags = IOCB_DIRECT;
+	cmd->iocb.ki_ioprio = req_get_ioprio(rq);
+
+	if (rw == ITER_SOURCE) {
+		kiocb_start_write(&cmd->iocb);
+		ret = file->f_op->write_iter(&cmd->iocb, &iter);
+	} else {
+		ret = file->f_op->read_iter(&cmd->iocb, &iter);
+	}
+
+	sblkdev_backing_put(cmd);
+	if (ret != -EIOCBQUEUED)
+		sblkdev_backing_rw_complete(&cmd->iocb, ret);
+}
+
+/*
+ * sblkdev_backing_discard() - Discard or write-zeroes @rq in the backing file
+ * The blocks are deallocated unless asked to be kept allocated.
+ */
+int sblkdev_backing_discard(struct sblkdev_device *dev, struct request *rq)
+{
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	int mode = (rq->cmd_flags & REQ_NOUNMAP) ? FALLOC_FL_ZERO_RANGE :
+						   FALLOC_FL_PUNCH_HOLE;
+
+	return vfs_fallocate(dev->backing_file, mode | FALLOC_FL_KEEP_SIZE, pos,
+			     blk_rq_bytes(rq));
+}
+
+static void sblkdev_backing_work(struct work_struct *work)
+{
+	struct sblkdev_cmd *cmd = container_of(work, struct sblkdev_cmd, work);
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	struct sblkdev_device *dev = rq->q->queuedata;
+	struct file *file = dev->backing_file;
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	int ret;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		sblkdev_backing_rw(dev, cmd, pos, ITER_DEST);
+		return;
+	case REQ_OP_WRITE:
+		sblkdev_backing_rw(dev, cmd, pos, ITER_SOURCE);
+		return;
+	case REQ_OP_FLUSH:
+		ret = vfs_fsync(file, 0);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		ret = sblkdev_backing_discard(dev, rq);
+		break;
+	default:
+		ret = -EOPNOTSUPP;
+		break;
+	}
+
+	cmd->status = errno_to_blk_status(ret);
+	blk_mq_complete_request(rq);
+}
+
+/*
+ * sblkdev_backing_queue() - Hand a started request over to the backing file
+ * It's completed through blk_mq_complete_request(), i.e. ->complete().
+ */
+void sblkdev_backing_queue(struct request *rq)
+{
+	struct sblkdev_device *dev = rq->q->queuedata;
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	if (dev->cache) {
+		sblkdev_cache_queue(rq);
+		return;
+	}
+
+	INIT_WORK(&cmd->work, sblkdev_backing_work);
+	queue_work(dev->backing_wq, &cmd->work);
+}
+
+/*
+ * sblkdev_backing_open() - Set the device up over its backing file, if any
+ * A capacity of 0 takes the file's size; a larger one grows a regular file
+ * (sparsely). The logical block size follows the backing storage, as direct
+ * I/O must be aligned to it.
+ */
+int sblkdev_backing_open(struct sblkdev_device *dev, const struct sblkdev_params *params,
+			 struct queue_limits *lim)
+{
+	struct file *file;
+	struct inode *inode;
+	struct block_device *bdev;
+	loff_t size;
+	int ret;
+
+	if (!params->backing_file)
+		return 0;
+
+	file = filp_open(params->backing_file, O_RDWR | O_LARGEFILE | O_DIRECT, 0);
+	if (IS_ERR(file)) {
+		pr_err("Can't open backing file '%s' for direct I/O: %ld\n",
+		       params->backing_file, PTR_ERR(file));
+		return PTR_ERR(file);
+	}
+	inode = file_inode(file);
+
+	size = S_ISBLK(inode->i_mode) ? bdev_nr_bytes(I_BDEV(inode)) : i_size_read(inode);
+	if (!dev->capacity) {
+		dev->capacity = size >> SECTOR_SHIFT;
+	} else if (((loff_t)dev->capacity << SECTOR_SHIFT) > size) {
+		ret = -ENOSPC;
+		if (S_ISREG(inode->i_mode))
+			ret = vfs_truncate(&file->f_path, (loff_t)dev->capacity << SECTOR_SHIFT);
+		if (ret) {
+			pr_err("Backing file '%s' is smaller than the capacity\n",
+			       params->backing_file);
+			goto fail_fput;
+		}
+	}
+	if (!dev->capacity) {
+		ret = -EINVAL;
+		goto fail_fput;
+	}
+
+	bdev = S_ISBLK(inode->i_mode) ? I_BDEV(inode) : inode->i_sb->s_bdev;
+	if (bdev) {
+		lim->logical_block_size = bdev_logical_block_size(bdev);
+		lim->physical_block_size = bdev_physical_block_size(bdev);
+		lim->dma_alignment = bdev_dma_alignment(bdev);
+	}
+	/* O_DIRECT data may still sit in the backing device's cache: have flushes */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	lim->features |= BLK_FEAT_WRITE_CACHE;
+#endif
+
+	dev->backing_wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_FREEZABLE, 0,
+					  params->backing_file);
+	if (!dev->backing_wq) {
+		ret = -ENOMEM;
+		goto fail_fput;
+	}
+	dev->backing_file = file;
+	pr_info("backed by '%s', %llu sectors\n", params->backing_file, dev->capacity);
+
+	/* Write-back mode: the store caches the file, see cache.c */
+	ret = sblkdev_cache_init(dev, params, lim);
+	if (ret)
+		goto fail_destroy_wq;
+
+	return 0;
+
+fail_destroy_wq:
+	destroy_workqueue(dev->backing_wq);
+	dev->backing_wq = NULL;
+	dev->backing_file = NULL;
+fail_fput:
+	fput(file);
+	return ret;
+}
+
+void sblkdev_backing_close(struct sblkdev_device *dev)
+{
+	if (!dev->backing_file)
+		return;
+
+	/* Writes the cache back; needs the file and the workqueue */
+	sblkdev_cache_free(dev);
+	destroy_workqueue(dev->backing_wq);
+	fput(dev->backing_file);
+	dev->backing_wq = NULL;
+	dev->backing_file = NULL;
+}
+
+#endif /* CONFIG_SBLKDEV_REQUESTS_BASED */
@@ -16,6 +16,128 @@ echo "$@"
 eval "$@"
 }
 
+# runfail
+# Parameters
+#   $1 ... : params are the command to run, which must fail
+runfail()
+{
+[ $# -eq 0 ] && return
+echo "$@ (must fail)"
+if eval "$@" ; then
+	echo "${name}: '$*' should have failed"
+	exit 1
+fi
+}
+
+# skip
+# Parameters
+#   $1 : the feature this kernel (or system) can't test
+skip()
+{
+echo "${name}: $1 not supported here, skipped"
+}
+
+# cfg_set
+# Parameters
+#   $1 : the configfs device
+#   $2 : the attribute to set, as <attribute>=<value>
+cfg_set()
+{
+runcmd "echo ${2#*=} | sudo tee ${CFG}/$1/${2%%=*} >/dev/null"
+}
+
+# cfg_on
+# Parameters
+#   $1     : the device to add through configfs
+#   $2 ... : its settings, as <attribute>=<value>
+# Returns non-zero, rather than exit, when the device can't be powered on
+cfg_on()
+{
+local dev=$1 kv
+shift
+runcmd "sudo mkdir ${CFG}/${dev}" || return 1
+for kv in "$@" ; do
+	cfg_set ${dev} ${kv} || return 1
+done
+cfg_set ${dev} power=1 || return 1
+udevadm settle 2>/dev/null || sleep 1
+}
+
+# cfg_off
+# Parameters
+#   $1 : the configfs device to power off and remove
+cfg_off()
+{
+runcmd "sudo rmdir ${CFG}/$1"
+}
+
+# roundtrip
+# Parameters
+#   $1 : the block device
+#   $2 : the block size to write and read back with, e.g. 64k
+#   $3 : the number of blocks
+# Writes random data with direct I/O, reads it back and compares
+roundtrip()
+{
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=$2 count=$3 iflag=fullblock status=none"
+runcmd "sudo dd if=${WORKDIR}/in of=$1 bs=$2 count=$3 oflag=direct status=none"
+runcmd "sudo dd if=$1 of=${WORKDIR}/out bs=$2 count=$3 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+}
+
+# elapsed_ms
+# Parameters
+#   $1 ... : params are the command to run; prints how long it took, in ms
+elapsed_ms()
+{
+local t0=$(date +%s%N)
+runcmd "$@" >&2
+echo $(( ($(date +%s%N) - t0) / 1000000 ))
+}
+
+# stats
+# Parameters
+#   $1 : the device whose stats to show, when debugfs is mounted
+stats()
+{
+sudo cat ${DBG}/$1/stats 2>/dev/null || true
+}
+
+# mem_mmap
+# Parameters
+#   $1 : the mem char device
+#   $2 : the number of bytes to map
+#   $3 : r: copy them to stdout, w: fill them from stdin
+mem_mmap()
+{
+echo "mmap $1 ($3)" >&2
+sudo python3 -c "
+import mmap, os, sys
+m = mmap.mmap(os.open(sys.argv[1], os.O_RDWR), int(sys.argv[2]))
+if sys.argv[3] == 'r':
+	sys.stdout.buffer.write(m[:])
+else:
+	m[:] = sys.stdin.buffer.read(len(m))
+" "$@"
+}
+
+# cleanup
+# Removes the scratch devices and files, even when a step fails
+cleanup()
+{
+local d
+if [ -n "${PAR_COPY_KB:-}" ]; then
+	echo ${PAR_COPY_KB} | sudo tee ${PARAMS}/par_copy_kb >/dev/null
+	echo ${PAR_CHUNK_KB} | sudo tee ${PARAMS}/par_chunk_kb >/dev/null
+fi
+sudo umount ${WORKDIR}/mnt 2>/dev/null || true
+# In reverse: a snapshot (sbt14) goes before its origin (sbt13)
+for d in $(ls -dr ${CFG}/sbt* 2>/dev/null) ; do
+	sudo rmdir ${d} || true
+done
+rm -rf ${WORKDIR}
+}
+
 
 name=$(basename $0)
 DISK=sblkdev1
@@ -41,4 +163,371 @@ runcmd "sleep 3 ; sync"
 
 ls -la ${MOUNTPT}
 df -h|grep ${DISK}
+
+#--- Feature smoke tests: each adds a scratch device (sbt<n>) through configfs,
+# exercises it and removes it again.
+CFG=/sys/kernel/config/sblkdev
+DBG=/sys/kernel/debug/sblkdev
+PARAMS=/sys/module/sblkdev/parameters
+if [ ! -d ${CFG} ]; then
+	echo "${name}: ${CFG} not there, feature tests skipped
+Tip: mount -t configfs none /sys/kernel/config"
+	exit 0
+fi
+# Not on tmpfs, which only takes the backing files' O_DIRECT since 6.6
+WORKDIR=$(mktemp -d -p /var/tmp)
+trap cleanup EXIT
+
+# Control plane: power on and off, a live resize, a setting fixed while on
+test_configfs()
+{
+echo "--- configfs"
+cfg_on sbt1 capacity=65536
+runcmd "[ -b /dev/sbt1 ]"
+roundtrip /dev/sbt1 64k 16
+cfg_set sbt1 capacity=131072
+runcmd '[ $(sudo blockdev --getsz /dev/sbt1) -eq 131072 ]'
+runfail cfg_set sbt1 dedup=1
+cfg_set sbt1 power=0
+runcmd "[ ! -e /dev/sbt1 ]"
+cfg_set sbt1 power=1
+runcmd "[ -b /dev/sbt1 ]"
+cfg_off sbt1
+runcmd "[ ! -e /dev/sbt1 ]"
+}
+
+# Large I/O: requests up to max_io_kb; merging, and turning it off
+test_large_io()
+{
+echo "--- large I/O and merges"
+cfg_on sbt2 capacity=262144 max_io_kb=4096
+runcmd '[ $(cat /sys/block/sbt2/queue/max_hw_sectors_kb) -eq 4096 ]'
+roundtrip /dev/sbt2 4M 8
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt2 bs=4k count=1024 conv=fsync status=none"
+stats sbt2
+cfg_off sbt2
+cfg_on sbt2 capacity=262144 merges=0
+runcmd '[ $(cat /sys/block/sbt2/queue/nomerges) -ne 0 ]'
+roundtrip /dev/sbt2 64k 64
+cfg_off sbt2
+}
+
+# DAX: a file written through a '-o dax' mount, read back after a remount
+test_dax()
+{
+echo "--- DAX"
+if ! cfg_on sbt3 capacity=262144 dax=1 ; then
+	skip "DAX (needs CONFIG_FS_DAX, and a kernel older than 6.15)"
+	cfg_off sbt3
+	return 0
+fi
+mkdir -p ${WORKDIR}/mnt
+runcmd "sudo mkfs.ext4 -q -b 4096 /dev/sbt3"
+runcmd "sudo mount -o dax /dev/sbt3 ${WORKDIR}/mnt"
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=4 iflag=fullblock status=none"
+runcmd "sudo cp ${WORKDIR}/in ${WORKDIR}/mnt/t1"
+runcmd "sudo umount ${WORKDIR}/mnt"
+runcmd "sudo mount -o dax /dev/sbt3 ${WORKDIR}/mnt"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/mnt/t1"
+runcmd "sudo umount ${WORKDIR}/mnt"
+cfg_off sbt3
+}
+
+# NUMA placement: interleaved, then all on node 0; the stats count each node's traffic
+test_numa()
+{
+local policy
+echo "--- NUMA placement"
+for policy in interleave 0 ; do
+	cfg_on sbt4 capacity=65536 numa=${policy}
+	roundtrip /dev/sbt4 4M 8
+	if [ -d ${DBG} ]; then
+		runcmd "stats sbt4 | grep '^node0'"
+	fi
+	cfg_off sbt4
+done
+}
+
+# Parallel copy: 16 MiB requests, copied in 256 KiB shares by several CPUs
+test_par_copy()
+{
+echo "--- parallel copy"
+PAR_COPY_KB=$(cat ${PARAMS}/par_copy_kb)
+PAR_CHUNK_KB=$(cat ${PARAMS}/par_chunk_kb)
+cfg_on sbt5 capacity=262144 max_io_kb=16384
+runcmd "echo 1024 | sudo tee ${PARAMS}/par_copy_kb >/dev/null"
+runcmd "echo 256 | sudo tee ${PARAMS}/par_chunk_kb >/dev/null"
+roundtrip /dev/sbt5 16M 4
+runcmd "echo ${PAR_COPY_KB} | sudo tee ${PARAMS}/par_copy_kb >/dev/null"
+runcmd "echo ${PAR_CHUNK_KB} | sudo tee ${PARAMS}/par_chunk_kb >/dev/null"
+PAR_COPY_KB=
+cfg_off sbt5
+}
+
+# Range locks: two writers race on the same 64 KiB; a reader must never see a mix
+test_range_lock()
+{
+local i blk
+echo "--- range locks"
+cfg_on sbt6 capacity=65536
+runcmd "dd if=/dev/urandom of=${WORKDIR}/a bs=64k count=1 status=none"
+runcmd "dd if=/dev/urandom of=${WORKDIR}/b bs=64k count=1 status=none"
+runcmd "sudo dd if=${WORKDIR}/a of=/dev/sbt6 bs=64k oflag=direct status=none"
+for blk in a b ; do
+	( for i in $(seq 500) ; do
+		sudo dd if=${WORKDIR}/${blk} of=/dev/sbt6 bs=64k oflag=direct status=none
+	done ) &
+done
+for i in $(seq 200) ; do
+	sudo dd if=/dev/sbt6 of=${WORKDIR}/out bs=64k count=1 iflag=direct status=none
+	if ! cmp -s ${WORKDIR}/out ${WORKDIR}/a && ! cmp -s ${WORKDIR}/out ${WORKDIR}/b ; then
+		echo "${name}: read a torn 64 KiB block"
+		exit 1
+	fi
+done
+wait
+if [ -d ${DBG} ]; then
+	runcmd "stats sbt6 | grep '^range locks'"
+fi
+cfg_off sbt6
+}
+
+# Image: saved at power off, loaded at power on, saved live; a capacity of 0 takes its size
+test_image()
+{
+local img=${WORKDIR}/sbt7.img
+echo "--- image save/load"
+cfg_on sbt7 capacity=65536 image=${img}
+roundtrip /dev/sbt7 1M 8
+cfg_set sbt7 power=0
+runcmd "[ -f ${img} ] && [ ! -e ${img}.tmp ]"
+cfg_set sbt7 power=1
+udevadm settle 2>/dev/null || sleep 1
+runcmd "sudo dd if=/dev/sbt7 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+roundtrip /dev/sbt7 1M 8
+runcmd "echo sbt7 | sudo tee ${PARAMS}/save >/dev/null"
+runcmd "cmp -n 8388608 ${WORKDIR}/in ${img}"
+cfg_off sbt7
+cfg_on sbt7 image=${img}
+runcmd '[ $(sudo blockdev --getsz /dev/sbt7) -eq 65536 ]'
+runcmd "sudo dd if=/dev/sbt7 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+cfg_off sbt7
+}
+
+# mem char device: block writes seen through the mapping, and the other way round
+test_mem()
+{
+echo "--- mem char device"
+if ! command -v python3 >/dev/null ; then
+	skip "mmap of the mem device (needs python3)"
+	return 0
+fi
+cfg_on sbt8 capacity=65536 mem=1
+runcmd "[ -c /dev/sbt8-mem ]"
+roundtrip /dev/sbt8 1M 8
+mem_mmap /dev/sbt8-mem 8388608 r > ${WORKDIR}/out
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=8 iflag=fullblock status=none"
+mem_mmap /dev/sbt8-mem 8388608 w < ${WORKDIR}/in
+runcmd "sudo dd if=/dev/sbt8 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+cfg_off sbt8
+runcmd "[ ! -e /dev/sbt8-mem ]"
+}
+
+# Throttling: best effort I/O held to qos_mbps, real time I/O not; an overflowing limit is refused
+test_qos()
+{
+local ms
+echo "--- throttling"
+cfg_on sbt9 capacity=65536 qos_mbps=8
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=16 iflag=fullblock status=none"
+ms=$(elapsed_ms "sudo dd if=${WORKDIR}/in of=/dev/sbt9 bs=1M count=16 oflag=direct status=none")
+echo "16 MiB at 8 MiB/s, best effort: ${ms} ms"
+runcmd "[ ${ms} -ge 1500 ]"
+ms=$(elapsed_ms "sudo ionice -c 1 dd if=${WORKDIR}/in of=/dev/sbt9 bs=1M count=16 oflag=direct status=none")
+echo "16 MiB at 8 MiB/s, real time: ${ms} ms"
+runcmd "[ ${ms} -lt 1500 ]"
+runfail cfg_set sbt9 qos_mbps=18446744073709551615
+stats sbt9
+cfg_off sbt9
+}
+
+# Zoned: writes only at the write pointer, a reset rewinds it; btrfs writes its data with zone append
+test_zoned()
+{
+echo "--- zoned"
+if ! command -v blkzone >/dev/null ; then
+	skip "zoned emulation (needs blkzone)"
+	return 0
+fi
+if ! cfg_on sbt10 capacity=262144 zoned=1 zone_size_mb=16 zone_capacity_mb=8 ; then
+	skip "zoned emulation (needs CONFIG_BLK_DEV_ZONED, and 6.11 or later)"
+	cfg_off sbt10
+	return 0
+fi
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=2 iflag=fullblock status=none"
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt10 bs=1M count=1 oflag=direct status=none"
+runfail "sudo dd if=${WORKDIR}/in of=/dev/sbt10 bs=1M count=1 oflag=direct status=none"
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt10 bs=1M skip=1 seek=1 count=1 oflag=direct status=none"
+runcmd "sudo blkzone report -c 2 /dev/sbt10"
+runcmd "sudo dd if=/dev/sbt10 of=${WORKDIR}/out bs=1M count=2 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+runcmd "sudo blkzone reset -c 1 /dev/sbt10"
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt10 bs=1M count=1 oflag=direct status=none"
+cfg_off sbt10
+
+if ! command -v mkfs.btrfs >/dev/null ; then
+	skip "zone append (needs mkfs.btrfs)"
+	return 0
+fi
+cfg_on sbt10 capacity=8388608 zoned=1 zone_size_mb=64
+mkdir -p ${WORKDIR}/mnt
+if ! runcmd "sudo mkfs.btrfs -q -f -d single -m single /dev/sbt10" ||
+   ! runcmd "sudo mount /dev/sbt10 ${WORKDIR}/mnt" ; then
+	skip "zone append (needs btrfs with zoned support)"
+	cfg_off sbt10
+	return 0
+fi
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=16 iflag=fullblock status=none"
+runcmd "sudo cp ${WORKDIR}/in ${WORKDIR}/mnt/t1"
+runcmd "sudo umount ${WORKDIR}/mnt"
+runcmd "sudo mount /dev/sbt10 ${WORKDIR}/mnt"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/mnt/t1"
+runcmd "sudo umount ${WORKDIR}/mnt"
+cfg_off sbt10
+}
+
+# File-backed: a capacity of 0 takes the file's size; what's written lands in the file
+test_file()
+{
+local img=${WORKDIR}/sbt11.img
+echo "--- file-backed"
+runcmd "truncate -s 32M ${img}"
+cfg_on sbt11 file=${img}
+runcmd '[ $(sudo blockdev --getsz /dev/sbt11) -eq 65536 ]'
+roundtrip /dev/sbt11 1M 8
+runcmd "cmp -n 8388608 ${WORKDIR}/in ${img}"
+cfg_off sbt11
+runcmd "cmp -n 8388608 ${WORKDIR}/in ${img}"
+}
+
+# Compression: incompressible data, then compressible data, round trip
+test_compress()
+{
+echo "--- compression"
+if ! cfg_on sbt15 capacity=65536 compress=lz4 ; then
+	skip "compression (needs the lz4 crypto module)"
+	cfg_off sbt15
+	return 0
+fi
+roundtrip /dev/sbt15 1M 8
+runcmd "head -c 8M <(yes sblkdev) > ${WORKDIR}/in"
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt15 bs=1M count=8 oflag=direct status=none"
+runcmd "sudo dd if=/dev/sbt15 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+if [ -d ${DBG} ]; then
+	runcmd "stats sbt15 | grep '^compressed pages'"
+fi
+cfg_off sbt15
+}
+
+# Dedup: 8 MiB of one page shares it; a partial overwrite of one copy leaves the others
+test_dedup()
+{
+local i
+echo "--- dedup"
+cfg_on sbt16 capacity=65536 dedup=1
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=4k count=1 status=none"
+for i in $(seq 11) ; do
+	cat ${WORKDIR}/in ${WORKDIR}/in > ${WORKDIR}/dup
+	mv ${WORKDIR}/dup ${WORKDIR}/in
+done
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt16 bs=1M count=8 oflag=direct status=none"
+if [ -d ${DBG} ]; then
+	runcmd "stats sbt16 | grep '^shared'"
+fi
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=512 seek=9 count=1 conv=notrunc status=none"
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt16 bs=512 skip=9 seek=9 count=1 oflag=direct status=none"
+runcmd "sudo dd if=/dev/sbt16 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/in ${WORKDIR}/out"
+cfg_off sbt16
+}
+
+# Write-back cache: flushes and FUA writes reach the file at once; discards beat dirty
+# pages; rewrites racing the writeback, then power off, leave the file up to date
+test_cache()
+{
+local img=${WORKDIR}/sbt12.img i
+echo "--- write-back cache"
+runcmd "truncate -s 32M ${img}"
+cfg_on sbt12 file=${img} cache=writeback
+roundtrip /dev/sbt12 1M 8
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=8 iflag=fullblock status=none"
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt12 bs=1M count=8 oflag=direct conv=fsync status=none"
+runcmd "cmp -n 8388608 ${WORKDIR}/in ${img}"
+runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=8 iflag=fullblock status=none"
+runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt12 bs=1M count=8 oflag=direct,dsync status=none"
+runcmd "cmp -n 8388608 ${WORKDIR}/in ${img}"
+
+if command -v blkdiscard >/dev/null ; then
+	runcmd "dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=8 iflag=fullblock status=none"
+	runcmd "sudo dd if=${WORKDIR}/in of=/dev/sbt12 bs=1M count=8 oflag=direct status=none"
+	runcmd "sudo blkdiscard -o 0 -l 1M /dev/sbt12"
+	runcmd "sudo dd if=/dev/null of=/dev/sbt12 conv=notrunc,fsync status=none"
+	runcmd "cmp -n 1048576 ${img} /dev/zero"
+	runcmd "cmp -i 1048576 -n 7340032 ${WORKDIR}/in ${img}"
+	runcmd "sudo dd if=/dev/sbt12 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+	runcmd "cmp -n 1048576 ${WORKDIR}/out /dev/zero"
+	runcmd "cmp -i 1048576 ${WORKDIR}/in ${WORKDIR}/out"
+fi
+
+for i in $(seq 20) ; do
+	dd if=/dev/urandom of=${WORKDIR}/in bs=1M count=8 iflag=fullblock status=none
+	sudo dd if=${WORKDIR}/in of=/dev/sbt12 bs=1M count=8 oflag=direct status=none
+	sleep 0.05
+done
+stats sbt12
+cfg_set sbt12 power=0
+runcmd "cmp -n 8388608 ${WORKDIR}/in ${img}"
+cfg_off sbt12
+}
+
+# Snapshots: the clone keeps the data of when it was taken; its writes don't reach the origin
+test_snapshot()
+{
+echo "--- snapshots"
+cfg_on sbt13 capacity=65536
+roundtrip /dev/sbt13 1M 8
+runcmd "cp ${WORKDIR}/in ${WORKDIR}/then"
+cfg_on sbt14 snapshot=sbt13
+runcmd '[ $(sudo blockdev --getsz /dev/sbt14) -eq 65536 ]'
+roundtrip /dev/sbt13 1M 8
+runcmd "cp ${WORKDIR}/in ${WORKDIR}/now"
+runcmd "sudo dd if=/dev/sbt14 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/then ${WORKDIR}/out"
+roundtrip /dev/sbt14 64k 16
+runcmd "sudo dd if=/dev/sbt13 of=${WORKDIR}/out bs=1M count=8 iflag=direct status=none"
+runcmd "cmp ${WORKDIR}/now ${WORKDIR}/out"
+cfg_off sbt14
+cfg_off sbt13
+}
+
+test_configfs
+test_large_io
+test_dax
+test_numa
+test_par_copy
+test_range_lock
+test_image
+test_mem
+test_qos
+test_zoned
+test_file
+test_compress
+test_dedup
+test_cache
+test_snapshot
 exit 0
@@ -0,0 +1,645 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Write-back cache mode ('file=' plus 'cache=writeback'; request-based only):
+ * the RAM store sits in front of the backing file as a write-back cache.
+ *
+ * Writes are acknowledged once they're in the store; the pages they dirtied
+ * are written back to the file a little later by per-device writeback workers,
+ * each owning a contiguous share of the device. Reads are served from the
+ * store, the pages not in it yet being filled from the file first. The device
+ * has a volatile write cache with FUA: a flush writes every dirty page back
+ * and fsyncs the file; a FUA write goes through to the file before it
+ * completes. A page never leaves RAM once in it: the cache is as large as the
+ * data written or read.
+ *
+ * Two bitmaps track the pages: 'valid', the store holds the page's current
+ * data, and 'dirty', the file doesn't yet. A writer dirties a page after
+ * storing its data; a worker cleans it before copying the data out, so a
+ * write racing with its writeback just dirties the page again.
+ *
+ * Reads, writes and discards hold their range lock (see rangelock.c) while
+ * they fill and copy, as in RAM mode: overlapping ones are ordered, and a
+ * write is atomic. A hit that finds its range in use goes to the workqueue,
+ * which waits for it.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include "device.h"
+
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+
+/* Pages written back, or filled, with one backing file I/O */
+#define SBLKDEV_CACHE_BATCH		64
+/* How long a dirty page may stay in RAM only, at most */
+#define SBLKDEV_CACHE_WB_DELAY		msecs_to_jiffies(100)
+#define SBLKDEV_CACHE_WORKERS		4
+#define SBLKDEV_CACHE_LOCK_BITS		6
+
+/* Bounce pages for one backing file I/O */
+struct sblkdev_cache_buf {
+	struct page *pages[SBLKDEV_CACHE_BATCH];
+	struct bio_vec bvec[SBLKDEV_CACHE_BATCH];
+};
+
+/* A writeback worker, for the pages [first, end) */
+struct sblkdev_cache_wb {
+	struct sblkdev_cache *cache;
+	struct delayed_work dwork;
+	pgoff_t first;
+	pgoff_t end;
+	struct sblkdev_cache_buf *buf;
+};
+
+struct sblkdev_cache {
+	struct sblkdev_device *dev;
+	pgoff_t nr_pages;
+	unsigned long *valid;		/* The store has the page's data */
+	unsigned long *dirty;		/* ... and the backing file doesn't yet */
+	atomic_long_t nr_valid;
+	atomic_long_t nr_dirty;
+	/* Fills vs. the first write of a page (hashed by page index) */
+	spinlock_t locks[1 << SBLKDEV_CACHE_LOCK_BITS];
+	/*
+	 * Held for read by a worker while it writes a batch back; for write by
+	 * flush, FUA and discard, which then know that no page cleaned by a
+	 * worker is still on its way to the file.
+	 */
+	struct rw_semaphore wb_rwsem;
+	struct sblkdev_cache_buf *sync_buf;	/* Under wb_rwsem, held for write */
+	int wb_err;			/* A worker's failure, for the next flush */
+	unsigned int nr_wb;
+	struct sblkdev_cache_wb *wb;
+	atomic64_t nr_written;		/* Pages written back */
+	atomic64_t nr_filled;		/* Pages read in from the file */
+};
+
+static inline spinlock_t *sblkdev_cache_lock(struct sblkdev_cache *cache, pgoff_t idx)
+{
+	return &cache->locks[hash_long(idx, SBLKDEV_CACHE_LOCK_BITS)];
+}
+
+static void sblkdev_cache_buf_free(struct sblkdev_cache_buf *buf)
+{
+	unsigned int i;
+
+	if (!buf)
+		return;
+	for (i = 0; i < SBLKDEV_CACHE_BATCH; i++)
+		if (buf->pages[i])
+			__free_page(buf->pages[i]);
+	kfree(buf);
+}
+
+/* A bounce buffer of @nr pages */
+static struct sblkdev_cache_buf *sblkdev_cache_buf_alloc(unsigned int nr, gfp_t gfp)
+{
+	struct sblkdev_cache_buf *buf;
+	unsigned int i;
+
+	buf = kzalloc(sizeof(*buf), gfp);
+	if (!buf)
+		return NULL;
+	for (i = 0; i < nr; i++) {
+		buf->pages[i] = alloc_page(gfp);
+		if (!buf->pages[i]) {
+			sblkdev_cache_buf_free(buf);
+			return NULL;
+		}
+	}
+	return buf;
+}
+
+/* Move @nr pages at @idx between the backing file and @buf, synchronously */
+static int sblkdev_cache_file_io(struct sblkdev_cache *cache, struct sblkdev_cache_buf *buf,
+				 pgoff_t idx, unsigned int nr, int rw)
+{
+	struct file *file = cache->dev->backing_file;
+	loff_t size = (loff_t)cache->dev->capacity << SECTOR_SHIFT;
+	loff_t pos = (loff_t)idx << PAGE_SHIFT;
+	size_t len = min_t(loff_t, (loff_t)nr << PAGE_SHIFT, size - pos);
+	struct iov_iter iter;
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < nr; i++)
+		bvec_set_page(&buf->bvec[i], buf->pages[i], PAGE_SIZE, 0);
+	iov_iter_bvec(&iter, rw, buf->bvec, nr, len);
+
+	if (rw == ITER_SOURCE)
+		ret = vfs_iter_write(file, &iter, &pos, 0);
+	else
+		ret = vfs_iter_read(file, &iter, &pos, 0);
+
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -EIO;
+}
+
+/*
+ * Write back the next batch of dirty pages from *@idx on, below @end; *@idx is
+ * advanced past them. Returns the number of pages written back, 0 once there
+ * are none left, or an error, the pages then being left dirty.
+ */
+static int sblkdev_cache_writeback(struct sblkdev_cache *cache, struct sblkdev_cache_buf *buf,
+				   pgoff_t *idx, pgoff_t end)
+{
+	pgoff_t first = find_next_bit(cache->dirty, end, *idx);
+	unsigned int nr = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (first >= end) {
+		*idx = end;
+		return 0;
+	}
+
+	/* A run of contiguous dirty pages, cleaned before they're copied out */
+	while (nr < SBLKDEV_CACHE_BATCH && first + nr < end &&
+	       test_and_clear_bit(first + nr, cache->dirty))
+		nr++;
+	*idx = first + max(nr, 1U);
+	if (!nr)
+		return 0;
+	atomic_long_sub(nr, &cache->nr_dirty);
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = sblkdev_store_read(&cache->dev->store, page_address(buf->pages[i]),
+					 (loff_t)(first + i) << PAGE_SHIFT, PAGE_SIZE);
+	if (!ret)
+		ret = sblkdev_cache_file_io(cache, buf, first, nr, ITER_SOURCE);
+	if (ret) {
+		for (i = 0; i < nr; i++)
+			if (!test_and_set_bit(first + i, cache->dirty))
+				atomic_long_inc(&cache->nr_dirty);
+		return ret;
+	}
+
+	atomic64_add(nr, &cache->nr_written);
+	return nr;
+}
+
+/*
+ * A worker writes its share of the device back one batch at a time, so that a
+ * flush waits for one batch at most. On failure, it tries again later.
+ */
+static void sblkdev_cache_wb_work(struct work_struct *work)
+{
+	struct sblkdev_cache_wb *wb = container_of(to_delayed_work(work),
+						   struct sblkdev_cache_wb, dwork);
+	struct sblkdev_cache *cache = wb->cache;
+	pgoff_t idx = wb->first;
+	int ret;
+
+	do {
+		down_read(&cache->wb_rwsem);
+		ret = sblkdev_cache_writeback(cache, wb->buf, &idx, wb->end);
+		up_read(&cache->wb_rwsem);
+		cond_resched();
+	} while (ret >= 0 && idx < wb->end);
+
+	if (ret < 0) {
+		pr_err_ratelimited("Writeback to the backing file failed: %d\n", ret);
+		WRITE_ONCE(cache->wb_err, ret);
+		queue_delayed_work(cache->dev->backing_wq, &wb->dwork, SBLKDEV_CACHE_WB_DELAY);
+	}
+}
+
+/* Have the workers owning the pages [first, last] write them back, in a while */
+static void sblkdev_cache_kick(struct sblkdev_cache *cache, pgoff_t first, pgoff_t last)
+{
+	pgoff_t per_wb = cache->wb[0].end;
+	unsigned int i;
+
+	for (i = first / per_wb; i <= last / per_wb && i < cache->nr_wb; i++)
+		queue_delayed_work(cache->dev->backing_wq, &cache->wb[i].dwork,
+				   SBLKDEV_CACHE_WB_DELAY);
+}
+
+/*
+ * Write back the dirty pages of [first, end) and make them durable. With the
+ * workers kept out, none of the pages can be in flight anywhere else.
+ */
+static int sblkdev_cache_sync(struct sblkdev_cache *cache, pgoff_t first, pgoff_t end,
+			      int datasync)
+{
+	pgoff_t idx = first;
+	int ret;
+
+	down_write(&cache->wb_rwsem);
+	do {
+		ret = sblkdev_cache_writeback(cache, cache->sync_buf, &idx, end);
+	} while (ret >= 0 && idx < end);
+	up_write(&cache->wb_rwsem);
+	if (ret < 0)
+		return ret;
+
+	return vfs_fsync_range(cache->dev->backing_file, (loff_t)first << PAGE_SHIFT,
+			       ((loff_t)end << PAGE_SHIFT) - 1, datasync);
+}
+
+/*
+ * Bring the pages of [first, end) that aren't in the store yet in from the
+ * backing file. A page first written meanwhile is left alone: the write is
+ * newer. May sleep.
+ */
+static int sblkdev_cache_fill(struct sblkdev_cache *cache, pgoff_t first, pgoff_t end)
+{
+	struct sblkdev_cache_buf *buf = NULL;
+	pgoff_t idx = first;
+	int ret = 0;
+
+	while ((idx = find_next_zero_bit(cache->valid, end, idx)) < end) {
+		unsigned int nr = 1;
+		unsigned int i;
+
+		while (nr < SBLKDEV_CACHE_BATCH && idx + nr < end &&
+		       !test_bit(idx + nr, cache->valid))
+			nr++;
+
+		if (!buf) {
+			buf = sblkdev_cache_buf_alloc(min_t(pgoff_t, end - idx,
+							    SBLKDEV_CACHE_BATCH), GFP_NOIO);
+			if (!buf)
+				return -ENOMEM;
+		}
+		ret = sblkdev_cache_file_io(cache, buf, idx, nr, ITER_DEST);
+		if (ret)
+			break;
+
+		for (i = 0; i < nr && !ret; i++) {
+			spinlock_t *lock = sblkdev_cache_lock(cache, idx + i);
+
+			spin_lock(lock);
+			if (!test_bit(idx + i, cache->valid)) {
+				ret = sblkdev_store_write(&cache->dev->store,
+							  page_address(buf->pages[i]),
+							  (loff_t)(idx + i) << PAGE_SHIFT, PAGE_SIZE,
+							  GFP_NOWAIT | __GFP_NOWARN, false);
+				if (!ret) {
+					set_bit(idx + i, cache->valid);
+					atomic_long_inc(&cache->nr_valid);
+				}
+			}
+			spin_unlock(lock);
+		}
+		if (ret)
+			break;
+		atomic64_add(nr, &cache->nr_filled);
+		idx += nr;
+	}
+
+	sblkdev_cache_buf_free(buf);
+	return ret;
+}
+
+/*
+ * Copy a write into the store. Its pages are only marked valid once their data
+ * is in, under the lock a fill takes: a hit never reads a hole, and a failed
+ * write leaves them to be filled from the file. No fill of them runs
+ * meanwhile: it would be for a request overlapping this one, which the range
+ * lock keeps out. They are dirtied last.
+ */
+static int sblkdev_cache_write(struct sblkdev_cache *cache, const void *buf, loff_t pos,
+			       size_t len, gfp_t gfp, bool nt)
+{
+	pgoff_t first = pos >> PAGE_SHIFT;
+	pgoff_t last = (pos + len - 1) >> PAGE_SHIFT;
+	pgoff_t idx;
+	int ret;
+
+	ret = sblkdev_store_write(&cache->dev->store, buf, pos, len, gfp, nt);
+	if (ret)
+		return ret;
+
+	for (idx = first; idx <= last; idx++) {
+		spinlock_t *lock;
+
+		if (test_bit(idx, cache->valid))
+			continue;
+		lock = sblkdev_cache_lock(cache, idx);
+		spin_lock(lock);
+		if (!test_and_set_bit(idx, cache->valid))
+			atomic_long_inc(&cache->nr_valid);
+		spin_unlock(lock);
+	}
+
+	/* Pairs with test_and_clear_bit() in sblkdev_cache_writeback() */
+	smp_mb();
+	for (idx = first; idx <= last; idx++)
+		if (!test_and_set_bit(idx, cache->dirty))
+			atomic_long_inc(&cache->nr_dirty);
+	return 0;
+}
+
+/* Move the data of a read or write request, all of whose pages are in RAM */
+static blk_status_t sblkdev_cache_transfer(struct sblkdev_cache *cache, struct request *rq,
+					   gfp_t gfp)
+{
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	bool nt = rq_data_dir(rq) && sblkdev_store_nt(blk_rq_bytes(rq));
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	int ret = 0;
+
+	rq_for_each_bvec(bvec, rq, iter) {
+		void *buf = bvec_virt(&bvec);
+
+		if (rq_data_dir(rq))
+			ret = sblkdev_cache_write(cache, buf, pos, bvec.bv_len, gfp, nt);
+		else
+			ret = sblkdev_store_read(&cache->dev->store, buf, pos, bvec.bv_len);
+		if (ret)
+			break;
+		pos += bvec.bv_len;
+	}
+	sblkdev_store_nt_fence(nt);
+
+	if (!ret && rq_data_dir(rq) && blk_rq_bytes(rq))
+		sblkdev_cache_kick(cache, blk_rq_pos(rq) >> (PAGE_SHIFT - SECTOR_SHIFT),
+				   (pos - 1) >> PAGE_SHIFT);
+
+	if (ret == -ENOMEM)
+		return BLK_STS_RESOURCE;
+	return ret ? BLK_STS_IOERR : BLK_STS_OK;
+}
+
+/*
+ * Can @rq be served from RAM right away? A read needs all its pages in it; a
+ * write only those it covers partly, the others being overwritten whole.
+ */
+static bool sblkdev_cache_hit(struct sblkdev_cache *cache, struct request *rq)
+{
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	loff_t end = pos + blk_rq_bytes(rq);
+	pgoff_t first = pos >> PAGE_SHIFT;
+	pgoff_t last = (end - 1) >> PAGE_SHIFT;
+
+	if (req_op(rq) == REQ_OP_READ)
+		return find_next_zero_bit(cache->valid, last + 1, first) > last;
+
+	if (offset_in_page(pos) && !test_bit(first, cache->valid))
+		return false;
+	if (offset_in_page(end) && !test_bit(last, cache->valid))
+		return false;
+	return true;
+}
+
+/*
+ * Discard and write-zeroes go to the backing file, as without the cache; the
+ * cached pages the range covers whole are dropped, the others zeroed in part.
+ * The workers are kept out, lest one write stale data back over the range.
+ */
+static int sblkdev_cache_discard(struct sblkdev_cache *cache, struct request *rq)
+{
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	pgoff_t first = (pos + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	pgoff_t end = (pos + blk_rq_bytes(rq)) >> PAGE_SHIFT;
+	pgoff_t idx;
+	int ret;
+
+	down_write(&cache->wb_rwsem);
+	ret = sblkdev_backing_discard(cache->dev, rq);
+	if (!ret)
+		ret = sblkdev_store_discard(&cache->dev->store, pos, blk_rq_bytes(rq));
+	for (idx = first; !ret && idx < end; idx++) {
+		if (test_and_clear_bit(idx, cache->dirty))
+			atomic_long_dec(&cache->nr_dirty);
+		if (test_and_clear_bit(idx, cache->valid))
+			atomic_long_dec(&cache->nr_valid);
+	}
+	up_write(&cache->wb_rwsem);
+
+	return ret;
+}
+
+/*
+ * Requests that need the backing file, or may sleep: flushes, discards,
+ * misses, FUA writes and the ones that found no memory right away.
+ */
+static void sblkdev_cache_work(struct work_struct *work)
+{
+	struct sblkdev_cmd *cmd = container_of(work, struct sblkdev_cmd, work);
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	struct sblkdev_device *dev = rq->q->queuedata;
+	struct sblkdev_cache *cache = dev->cache;
+	loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+	loff_t end = pos + blk_rq_bytes(rq);
+	pgoff_t first = pos >> PAGE_SHIFT;
+	pgoff_t last = (end - 1) >> PAGE_SHIFT;
+	int ret = 0;
+
+	/* A flush covers no range */
+	if (req_op(rq) != REQ_OP_FLUSH)
+		sblkdev_range_lock(dev, &cmd->range, pos, blk_rq_bytes(rq),
+				   op_is_write(req_op(rq)));
+
+	switch (req_op(rq)) {
+	case REQ_OP_FLUSH:
+		ret = sblkdev_cache_sync(cache, 0, cache->nr_pages, 0);
+		/* Report what the workers ran into since the last flush, too */
+		if (!ret)
+			ret = xchg(&cache->wb_err, 0);
+		cmd->status = errno_to_blk_status(ret);
+		blk_mq_complete_request(rq);
+		return;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		cmd->status = errno_to_blk_status(sblkdev_cache_discard(cache, rq));
+		sblkdev_range_unlock(dev, &cmd->range);
+		blk_mq_complete_request(rq);
+		return;
+	case REQ_OP_READ:
+		ret = sblkdev_cache_fill(cache, first, last + 1);
+		break;
+	case REQ_OP_WRITE:
+		if (offset_in_page(pos))
+			ret = sblkdev_cache_fill(cache, first, first + 1);
+		if (!ret && offset_in_page(end))
+			ret = sblkdev_cache_fill(cache, last, last + 1);
+		break;
+	default:
+		cmd->status = BLK_STS_NOTSUPP;
+		sblkdev_range_unlock(dev, &cmd->range);
+		blk_mq_complete_request(rq);
+		return;
+	}
+
+	if (ret == -ENOMEM)
+		goto requeue;
+	if (ret) {
+		cmd->status = errno_to_blk_status(ret);
+		sblkdev_range_unlock(dev, &cmd->range);
+		blk_mq_complete_request(rq);
+		return;
+	}
+
+	cmd->status = sblkdev_cache_transfer(cache, rq, GFP_NOIO);
+	if (cmd->status == BLK_STS_RESOURCE)
+		goto requeue;
+	/* FUA: on stable storage before it completes */
+	if (cmd->status == BLK_STS_OK && (rq->cmd_flags & REQ_FUA))
+		cmd->status = errno_to_blk_status(sblkdev_cache_sync(cache, first,
+								     last + 1, 1));
+	sblkdev_range_unlock(dev, &cmd->range);
+	blk_mq_complete_request(rq);
+	return;
+
+requeue:
+	sblkdev_range_unlock(dev, &cmd->range);
+	/* The store is short of memory: try again a little later */
+	blk_mq_requeue_request(rq, false);
+	blk_mq_delay_kick_requeue_list(rq->q, SBLKDEV_REQUEUE_DELAY_MS);
+}
+
+/*
+ * sblkdev_cache_queue() - Serve a started request from the cache
+ * Cache hits complete right here, from ->queue_rq(), unless their range is in
+ * use; everything else goes to the device's workqueue. Completed through
+ * blk_mq_complete_request().
+ */
+void sblkdev_cache_queue(struct request *rq)
+{
+	struct sblkdev_device *dev = rq->q->queuedata;
+	struct sblkdev_cache *cache = dev->cache;
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	if ((req_op(rq) == REQ_OP_READ || req_op(rq) == REQ_OP_WRITE) &&
+	    !(rq->cmd_flags & REQ_FUA) && sblkdev_cache_hit(cache, rq) &&
+	    sblkdev_range_trylock(dev, &cmd->range, (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT,
+				  blk_rq_bytes(rq), op_is_write(req_op(rq)))) {
+		cmd->status = sblkdev_cache_transfer(cache, rq, GFP_NOWAIT | __GFP_NOWARN);
+		sblkdev_range_unlock(dev, &cmd->range);
+		if (cmd->status != BLK_STS_RESOURCE) {
+			blk_mq_complete_request(rq);
+			return;
+		}
+		/* Retried from the workqueue, where the store may wait for memory */
+	}
+
+	INIT_WORK(&cmd->work, sblkdev_cache_work);
+	queue_work(dev->backing_wq, &cmd->work);
+}
+
+static void sblkdev_cache_release(struct sblkdev_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; cache->wb && i < cache->nr_wb; i++)
+		sblkdev_cache_buf_free(cache->wb[i].buf);
+	kfree(cache->wb);
+	sblkdev_cache_buf_free(cache->sync_buf);
+	kvfree(cache->dirty);
+	kvfree(cache->valid);
+	kfree(cache);
+}
+
+/*
+ * sblkdev_cache_init() - Put the store in front of the backing file, if asked
+ * The device then has a volatile write cache, with FUA.
+ */
+int sblkdev_cache_init(struct sblkdev_device *dev, const struct sblkdev_params *params,
+		       struct queue_limits *lim)
+{
+	struct sblkdev_cache *cache;
+	pgoff_t per_wb;
+	unsigned int i;
+
+	if (!params->writeback)
+		return 0;
+
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
+	cache->dev = dev;
+	cache->nr_pages = (((loff_t)dev->capacity << SECTOR_SHIFT) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	for (i = 0; i < ARRAY_SIZE(cache->locks); i++)
+		spin_lock_init(&cache->locks[i]);
+	init_rwsem(&cache->wb_rwsem);
+
+	cache->valid = kvcalloc(BITS_TO_LONGS(cache->nr_pages), sizeof(long), GFP_KERNEL);
+	cache->dirty = kvcalloc(BITS_TO_LONGS(cache->nr_pages), sizeof(long), GFP_KERNEL);
+	cache->sync_buf = sblkdev_cache_buf_alloc(SBLKDEV_CACHE_BATCH, GFP_KERNEL);
+	if (!cache->valid || !cache->dirty || !cache->sync_buf)
+		goto fail;
+
+	cache->nr_wb = clamp_t(pgoff_t, params->wb_workers ? : SBLKDEV_CACHE_WORKERS,
+			       1, cache->nr_pages);
+	cache->wb = kcalloc(cache->nr_wb, sizeof(*cache->wb), GFP_KERNEL);
+	if (!cache->wb)
+		goto fail;
+	per_wb = DIV_ROUND_UP(cache->nr_pages, cache->nr_wb);
+	for (i = 0; i < cache->nr_wb; i++) {
+		struct sblkdev_cache_wb *wb = &cache->wb[i];
+
+		wb->cache = cache;
+		INIT_DELAYED_WORK(&wb->dwork, sblkdev_cache_wb_work);
+		wb->first = min_t(pgoff_t, i * per_wb, cache->nr_pages);
+		wb->end = min_t(pgoff_t, wb->first + per_wb, cache->nr_pages);
+		wb->buf = sblkdev_cache_buf_alloc(SBLKDEV_CACHE_BATCH, GFP_KERNEL);
+		if (!wb->buf)
+			goto fail;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	lim->features |= BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA;
+#endif
+	dev->cache = cache;
+	pr_info("write-back cache, %u writeback worker(s)\n", cache->nr_wb);
+
+	return 0;
+
+fail:
+	sblkdev_cache_release(cache);
+	return -ENOMEM;
+}
+
+/*
+ * sblkdev_cache_free() - Write the cache back and free it
+ * Called once no request can come in anymore.
+ */
+void sblkdev_cache_free(struct sblkdev_device *dev)
+{
+	struct sblkdev_cache *cache = dev->cache;
+	unsigned int i;
+	int ret;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < cache->nr_wb; i++)
+		cancel_delayed_work_sync(&cache->wb[i].dwork);
+	ret = sblkdev_cache_sync(cache, 0, cache->nr_pages, 0);
+	if (ret)
+		pr_err("Failed to write the cache back: %d, %ld dirty pages lost\n",
+		       ret, atomic_long_read(&cache->nr_dirty));
+
+	sblkdev_cache_release(cache);
+	dev->cache = NULL;
+}
+
+/* The cache's part of the debugfs stats file */
+void sblkdev_cache_show(struct sblkdev_device *dev, struct seq_file *m)
+{
+	struct sblkdev_cache *cache = dev->cache;
+
+	if (!cache)
+		return;
+
+	seq_printf(m, "cached   %16ld\n", atomic_long_read(&cache->nr_valid));
+	seq_printf(m, "dirty    %16ld\n", atomic_long_read(&cache->nr_dirty));
+	seq_printf(m, "written back %12lld pages\n", (s64)atomic64_read(&cache->nr_written));
+	seq_printf(m, "filled       %12lld pages\n", (s64)atomic64_read(&cache->nr_filled));
+}
+
+#endif /* CONFIG_SBLKDEV_REQUESTS_BASED */
@@ -0,0 +1,474 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * The control plane: a configfs subsystem to add, retune and remove devices
+ * without reloading the module, null_blk-style:
+ *
+ *   mkdir /sys/kernel/config/sblkdev/sblkdev9
+ *   echo 2097152 > /sys/kernel/config/sblkdev/sblkdev9/capacity
+ *   echo lz4 > /sys/kernel/config/sblkdev/sblkdev9/compress
+ *   echo 1 > /sys/kernel/config/sblkdev/sblkdev9/power
+ *
+ * Each attribute is one catalog setting, kept as the text written to it; power
+ * on turns them into a catalog entry. Once the device is up, the capacity, the
+ * block size, the number of hw queues, the media emulation profile and the
+ * throttling limits can be changed in place. Writing any other setting gives
+ * EBUSY, and leaves it as it was, until the device is powered off again.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/configfs.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "device.h"
+
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
+
+/* The profile settings come in a row, as do the QoS ones: each is applied together */
+enum {
+	SBLKDEV_CFG_CAPACITY,
+	SBLKDEV_CFG_HW_QUEUES,
+	SBLKDEV_CFG_QUEUE_DEPTH,
+	SBLKDEV_CFG_READ_QUEUES,
+	SBLKDEV_CFG_POLL_QUEUES,
+	SBLKDEV_CFG_BLOCK_SIZE,
+	SBLKDEV_CFG_MAX_IO,
+	SBLKDEV_CFG_MERGES,
+	SBLKDEV_CFG_LATENCY,
+	SBLKDEV_CFG_JITTER,
+	SBLKDEV_CFG_BW,
+	SBLKDEV_CFG_IOPS,
+	SBLKDEV_CFG_ZONED,
+	SBLKDEV_CFG_ZONE_SIZE,
+	SBLKDEV_CFG_ZONE_CAPACITY,
+	SBLKDEV_CFG_ZONE_MAX_OPEN,
+	SBLKDEV_CFG_ZONE_MAX_ACTIVE,
+	SBLKDEV_CFG_COMPRESS,
+	SBLKDEV_CFG_DEDUP,
+	SBLKDEV_CFG_CHUNK,
+	SBLKDEV_CFG_FILE,
+	SBLKDEV_CFG_CACHE,
+	SBLKDEV_CFG_WB_WORKERS,
+	SBLKDEV_CFG_SNAPSHOT,
+	SBLKDEV_CFG_DAX,
+	SBLKDEV_CFG_NUMA,
+	SBLKDEV_CFG_NUMA_STRIPE,
+	SBLKDEV_CFG_IMAGE,
+	SBLKDEV_CFG_MEM,
+	SBLKDEV_CFG_QOS_BW,
+	SBLKDEV_CFG_QOS_IOPS,
+	SBLKDEV_CFG_QOS_HCTX_BW,
+	SBLKDEV_CFG_QOS_HCTX_IOPS,
+	SBLKDEV_CFG_QOS_BURST,
+	SBLKDEV_CFG_NR_KEYS,
+};
+
+static const char * const sblkdev_cfg_keys[SBLKDEV_CFG_NR_KEYS] = {
+	[SBLKDEV_CFG_CAPACITY] = "capacity",
+	[SBLKDEV_CFG_HW_QUEUES] = "hw_queues",
+	[SBLKDEV_CFG_QUEUE_DEPTH] = "queue_depth",
+	[SBLKDEV_CFG_READ_QUEUES] = "read_queues",
+	[SBLKDEV_CFG_POLL_QUEUES] = "poll_queues",
+	[SBLKDEV_CFG_BLOCK_SIZE] = "block_size",
+	[SBLKDEV_CFG_MAX_IO] = "max_io_kb",
+	[SBLKDEV_CFG_MERGES] = "merges",
+	[SBLKDEV_CFG_LATENCY] = "latency_us",
+	[SBLKDEV_CFG_JITTER] = "jitter_us",
+	[SBLKDEV_CFG_BW] = "bw_mbps",
+	[SBLKDEV_CFG_IOPS] = "iops",
+	[SBLKDEV_CFG_ZONED] = "zoned",
+	[SBLKDEV_CFG_ZONE_SIZE] = "zone_size_mb",
+	[SBLKDEV_CFG_ZONE_CAPACITY] = "zone_capacity_mb",
+	[SBLKDEV_CFG_ZONE_MAX_OPEN] = "zone_max_open",
+	[SBLKDEV_CFG_ZONE_MAX_ACTIVE] = "zone_max_active",
+	[SBLKDEV_CFG_COMPRESS] = "compress",
+	[SBLKDEV_CFG_DEDUP] = "dedup",
+	[SBLKDEV_CFG_CHUNK] = "chunk_kb",
+	[SBLKDEV_CFG_FILE] = "file",
+	[SBLKDEV_CFG_CACHE] = "cache",
+	[SBLKDEV_CFG_WB_WORKERS] = "wb_workers",
+	[SBLKDEV_CFG_SNAPSHOT] = "snapshot",
+	[SBLKDEV_CFG_DAX] = "dax",
+	[SBLKDEV_CFG_NUMA] = "numa",
+	[SBLKDEV_CFG_NUMA_STRIPE] = "numa_stripe_kb",
+	[SBLKDEV_CFG_IMAGE] = "image",
+	[SBLKDEV_CFG_MEM] = "mem",
+	[SBLKDEV_CFG_QOS_BW] = "qos_mbps",
+	[SBLKDEV_CFG_QOS_IOPS] = "qos_iops",
+	[SBLKDEV_CFG_QOS_HCTX_BW] = "qos_hctx_mbps",
+	[SBLKDEV_CFG_QOS_HCTX_IOPS] = "qos_hctx_iops",
+	[SBLKDEV_CFG_QOS_BURST] = "qos_burst_ms",
+};
+
+/* One directory: a device, powered on or not */
+struct sblkdev_cfg {
+	struct config_item item;
+	struct mutex lock;		/* Serializes the attribute writes */
+	bool powered;
+	char *values[SBLKDEV_CFG_NR_KEYS]; /* NULL: the default */
+};
+
+static inline struct sblkdev_cfg *to_sblkdev_cfg(struct config_item *item)
+{
+	return container_of(item, struct sblkdev_cfg, item);
+}
+
+static bool sblkdev_cfg_is_profile(int key)
+{
+	return key >= SBLKDEV_CFG_LATENCY && key <= SBLKDEV_CFG_IOPS;
+}
+
+static bool sblkdev_cfg_is_qos(int key)
+{
+	return key >= SBLKDEV_CFG_QOS_BW && key <= SBLKDEV_CFG_QOS_BURST;
+}
+
+/* Both in the same row */
+static bool sblkdev_cfg_same_row(int a, int b)
+{
+	return (sblkdev_cfg_is_profile(a) && sblkdev_cfg_is_profile(b)) ||
+	       (sblkdev_cfg_is_qos(a) && sblkdev_cfg_is_qos(b));
+}
+
+/*
+ * sblkdev_cfg_apply() - Change a setting of the powered on device
+ * The new value is parsed as at power on; for a profile or QoS setting,
+ * together with the rest of its row.
+ */
+static int sblkdev_cfg_apply(struct sblkdev_cfg *cfg, int key, const char *value)
+{
+	struct sblkdev_params params = {};
+	struct sblkdev_device *dev;
+	sector_t capacity = 0;
+	int k, ret = 0;
+
+	if (key != SBLKDEV_CFG_CAPACITY && key != SBLKDEV_CFG_HW_QUEUES &&
+	    key != SBLKDEV_CFG_BLOCK_SIZE && !sblkdev_cfg_is_profile(key) &&
+	    !sblkdev_cfg_is_qos(key))
+		return -EBUSY;
+	/* Back to the default isn't a value that can be applied */
+	if (!value)
+		return -EINVAL;
+
+	if (key == SBLKDEV_CFG_CAPACITY)
+		ret = kstrtoull(value, 10, &capacity);
+
+	for (k = 0; !ret && k < SBLKDEV_CFG_NR_KEYS; k++) {
+		const char *v = k == key ? value : cfg->values[k];
+		char *option;
+
+		if (!v || k == SBLKDEV_CFG_CAPACITY)
+			continue;
+		if (k != key && !sblkdev_cfg_same_row(key, k))
+			continue;
+
+		option = kasprintf(GFP_KERNEL, "%s=%s", sblkdev_cfg_keys[k], v);
+		if (!option)
+			return -ENOMEM;
+		ret = sblkdev_parse_option(&params, option);
+		kfree(option);
+	}
+	if (ret)
+		return ret;
+
+	dev = sblkdev_lock_device(config_item_name(&cfg->item));
+	if (!dev)
+		return -ENODEV;
+
+	if (key == SBLKDEV_CFG_CAPACITY)
+		ret = sblkdev_resize(dev, capacity);
+	else if (key == SBLKDEV_CFG_HW_QUEUES)
+		ret = sblkdev_set_hw_queues(dev, params.nr_hw_queues);
+	else if (key == SBLKDEV_CFG_BLOCK_SIZE)
+		ret = sblkdev_set_block_size(dev, params.block_size);
+	else if (sblkdev_cfg_is_qos(key))
+		ret = sblkdev_set_qos(dev, &params.qos);
+	else
+		ret = sblkdev_set_profile(dev, &params.profile);
+
+	sblkdev_unlock_devices();
+	return ret;
+}
+
+static ssize_t sblkdev_cfg_show(struct config_item *item, int key, char *page)
+{
+	struct sblkdev_cfg *cfg = to_sblkdev_cfg(item);
+	ssize_t ret;
+
+	mutex_lock(&cfg->lock);
+	ret = sprintf(page, "%s\n", cfg->values[key] ? : "");
+	mutex_unlock(&cfg->lock);
+	return ret;
+}
+
+static ssize_t sblkdev_cfg_store(struct config_item *item, int key,
+				 const char *page, size_t count)
+{
+	struct sblkdev_cfg *cfg = to_sblkdev_cfg(item);
+	char *buf, *value;
+	int ret = 0;
+
+	buf = kstrndup(page, count, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	value = strim(buf);
+
+	/* It ends up in a catalog entry; an empty value is the default again */
+	if (strchr(value, ',')) {
+		kfree(buf);
+		return -EINVAL;
+	}
+	if (!*value) {
+		kfree(buf);
+		buf = NULL;
+	} else if (value != buf) {
+		memmove(buf, value, strlen(value) + 1);
+	}
+
+	mutex_lock(&cfg->lock);
+	if (cfg->powered)
+		ret = sblkdev_cfg_apply(cfg, key, buf);
+	if (!ret)
+		swap(cfg->values[key], buf);
+	mutex_unlock(&cfg->lock);
+
+	kfree(buf);
+	return ret ? ret : count;
+}
+
+#define SBLKDEV_CFG_ATTR(_name, _key)					\
+static ssize_t sblkdev_cfg_##_name##_show(struct config_item *item,	\
+					  char *page)			\
+{									\
+	return sblkdev_cfg_show(item, _key, page);			\
+}									\
+static ssize_t sblkdev_cfg_##_name##_store(struct config_item *item,	\
+					   const char *page, size_t count) \
+{									\
+	return sblkdev_cfg_store(item, _key, page, count);		\
+}									\
+CONFIGFS_ATTR(sblkdev_cfg_, _name)
+
+SBLKDEV_CFG_ATTR(capacity, SBLKDEV_CFG_CAPACITY);
+SBLKDEV_CFG_ATTR(hw_queues, SBLKDEV_CFG_HW_QUEUES);
+SBLKDEV_CFG_ATTR(queue_depth, SBLKDEV_CFG_QUEUE_DEPTH);
+SBLKDEV_CFG_ATTR(read_queues, SBLKDEV_CFG_READ_QUEUES);
+SBLKDEV_CFG_ATTR(poll_queues, SBLKDEV_CFG_POLL_QUEUES);
+SBLKDEV_CFG_ATTR(block_size, SBLKDEV_CFG_BLOCK_SIZE);
+SBLKDEV_CFG_ATTR(max_io_kb, SBLKDEV_CFG_MAX_IO);
+SBLKDEV_CFG_ATTR(merges, SBLKDEV_CFG_MERGES);
+SBLKDEV_CFG_ATTR(latency_us, SBLKDEV_CFG_LATENCY);
+SBLKDEV_CFG_ATTR(jitter_us, SBLKDEV_CFG_JITTER);
+SBLKDEV_CFG_ATTR(bw_mbps, SBLKDEV_CFG_BW);
+SBLKDEV_CFG_ATTR(iops, SBLKDEV_CFG_IOPS);
+SBLKDEV_CFG_ATTR(zoned, SBLKDEV_CFG_ZONED);
+SBLKDEV_CFG_ATTR(zone_size_mb, SBLKDEV_CFG_ZONE_SIZE);
+SBLKDEV_CFG_ATTR(zone_capacity_mb, SBLKDEV_CFG_ZONE_CAPACITY);
+SBLKDEV_CFG_ATTR(zone_max_open, SBLKDEV_CFG_ZONE_MAX_OPEN);
+SBLKDEV_CFG_ATTR(zone_max_active, SBLKDEV_CFG_ZONE_MAX_ACTIVE);
+SBLKDEV_CFG_ATTR(compress, SBLKDEV_CFG_COMPRESS);
+SBLKDEV_CFG_ATTR(dedup, SBLKDEV_CFG_DEDUP);
+SBLKDEV_CFG_ATTR(chunk_kb, SBLKDEV_CFG_CHUNK);
+SBLKDEV_CFG_ATTR(file, SBLKDEV_CFG_FILE);
+SBLKDEV_CFG_ATTR(cache, SBLKDEV_CFG_CACHE);
+SBLKDEV_CFG_ATTR(wb_workers, SBLKDEV_CFG_WB_WORKERS);
+SBLKDEV_CFG_ATTR(snapshot, SBLKDEV_CFG_SNAPSHOT);
+SBLKDEV_CFG_ATTR(dax, SBLKDEV_CFG_DAX);
+SBLKDEV_CFG_ATTR(numa, SBLKDEV_CFG_NUMA);
+SBLKDEV_CFG_ATTR(numa_stripe_kb, SBLKDEV_CFG_NUMA_STRIPE);
+SBLKDEV_CFG_ATTR(image, SBLKDEV_CFG_IMAGE);
+SBLKDEV_CFG_ATTR(mem, SBLKDEV_CFG_MEM);
+SBLKDEV_CFG_ATTR(qos_mbps, SBLKDEV_CFG_QOS_BW);
+SBLKDEV_CFG_ATTR(qos_iops, SBLKDEV_CFG_QOS_IOPS);
+SBLKDEV_CFG_ATTR(qos_hctx_mbps, SBLKDEV_CFG_QOS_HCTX_BW);
+SBLKDEV_CFG_ATTR(qos_hctx_iops, SBLKDEV_CFG_QOS_HCTX_IOPS);
+SBLKDEV_CFG_ATTR(qos_burst_ms, SBLKDEV_CFG_QOS_BURST);
+
+/*
+ * sblkdev_cfg_power_on() - Add the device from its settings
+ * '<name>,<capacity>[,<key>=<value>...]', as in the catalog.
+ */
+static int sblkdev_cfg_power_on(struct sblkdev_cfg *cfg)
+{
+	const char *name = config_item_name(&cfg->item);
+	const char *capacity = cfg->values[SBLKDEV_CFG_CAPACITY] ? : "0";
+	size_t len = strlen(name) + 1 + strlen(capacity) + 1;
+	char *entry;
+	int pos, k, ret;
+
+	for (k = SBLKDEV_CFG_CAPACITY + 1; k < SBLKDEV_CFG_NR_KEYS; k++)
+		if (cfg->values[k])
+			len += 1 + strlen(sblkdev_cfg_keys[k]) + 1 + strlen(cfg->values[k]);
+
+	entry = kmalloc(len, GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	pos = sprintf(entry, "%s,%s", name, capacity);
+	for (k = SBLKDEV_CFG_CAPACITY + 1; k < SBLKDEV_CFG_NR_KEYS; k++)
+		if (cfg->values[k])
+			pos += sprintf(entry + pos, ",%s=%s", sblkdev_cfg_keys[k],
+				       cfg->values[k]);
+
+	ret = sblkdev_create(entry);
+	kfree(entry);
+	return ret;
+}
+
+static ssize_t sblkdev_cfg_power_show(struct config_item *item, char *page)
+{
+	return sprintf(page, "%d\n", to_sblkdev_cfg(item)->powered);
+}
+
+static ssize_t sblkdev_cfg_power_store(struct config_item *item,
+				       const char *page, size_t count)
+{
+	struct sblkdev_cfg *cfg = to_sblkdev_cfg(item);
+	bool power;
+	int ret;
+
+	ret = kstrtobool(page, &power);
+	if (ret)
+		return ret;
+
+	mutex_lock(&cfg->lock);
+	if (power != cfg->powered) {
+		if (power)
+			ret = sblkdev_cfg_power_on(cfg);
+		else
+			ret = sblkdev_destroy(config_item_name(item));
+		if (!ret)
+			cfg->powered = power;
+	}
+	mutex_unlock(&cfg->lock);
+
+	return ret ? ret : count;
+}
+
+CONFIGFS_ATTR(sblkdev_cfg_, power);
+
+static struct configfs_attribute *sblkdev_cfg_attrs[] = {
+	&sblkdev_cfg_attr_power,
+	&sblkdev_cfg_attr_capacity,
+	&sblkdev_cfg_attr_hw_queues,
+	&sblkdev_cfg_attr_queue_depth,
+	&sblkdev_cfg_attr_read_queues,
+	&sblkdev_cfg_attr_poll_queues,
+	&sblkdev_cfg_attr_block_size,
+	&sblkdev_cfg_attr_max_io_kb,
+	&sblkdev_cfg_attr_merges,
+	&sblkdev_cfg_attr_latency_us,
+	&sblkdev_cfg_attr_jitter_us,
+	&sblkdev_cfg_attr_bw_mbps,
+	&sblkdev_cfg_attr_iops,
+	&sblkdev_cfg_attr_zoned,
+	&sblkdev_cfg_attr_zone_size_mb,
+	&sblkdev_cfg_attr_zone_capacity_mb,
+	&sblkdev_cfg_attr_zone_max_open,
+	&sblkdev_cfg_attr_zone_max_active,
+	&sblkdev_cfg_attr_compress,
+	&sblkdev_cfg_attr_dedup,
+	&sblkdev_cfg_attr_chunk_kb,
+	&sblkdev_cfg_attr_file,
+	&sblkdev_cfg_attr_cache,
+	&sblkdev_cfg_attr_wb_workers,
+	&sblkdev_cfg_attr_snapshot,
+	&sblkdev_cfg_attr_dax,
+	&sblkdev_cfg_attr_numa,
+	&sblkdev_cfg_attr_numa_stripe_kb,
+	&sblkdev_cfg_attr_image,
+	&sblkdev_cfg_attr_mem,
+	&sblkdev_cfg_attr_qos_mbps,
+	&sblkdev_cfg_attr_qos_iops,
+	&sblkdev_cfg_attr_qos_hctx_mbps,
+	&sblkdev_cfg_attr_qos_hctx_iops,
+	&sblkdev_cfg_attr_qos_burst_ms,
+	NULL,
+};
+
+static void sblkdev_cfg_release(struct config_item *item)
+{
+	struct sblkdev_cfg *cfg = to_sblkdev_cfg(item);
+	int k;
+
+	for (k = 0; k < SBLKDEV_CFG_NR_KEYS; k++)
+		kfree(cfg->values[k]);
+	mutex_destroy(&cfg->lock);
+	kfree(cfg);
+}
+
+static struct configfs_item_operations sblkdev_cfg_item_ops = {
+	.release = sblkdev_cfg_release,
+};
+
+static const struct config_item_type sblkdev_cfg_type = {
+	.ct_item_ops = &sblkdev_cfg_item_ops,
+	.ct_attrs = sblkdev_cfg_attrs,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct config_item *sblkdev_cfg_make_item(struct config_group *group,
+						 const char *name)
+{
+	struct sblkdev_cfg *cfg;
+
+	/* It's the disk name, and the first field of a catalog entry */
+	if (strlen(name) >= DISK_NAME_LEN || strpbrk(name, ",;="))
+		return ERR_PTR(-EINVAL);
+
+	cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_init(&cfg->lock);
+	config_item_init_type_name(&cfg->item, name, &sblkdev_cfg_type);
+	return &cfg->item;
+}
+
+/* rmdir: powers the device off first */
+static void sblkdev_cfg_drop_item(struct config_group *group,
+				  struct config_item *item)
+{
+	struct sblkdev_cfg *cfg = to_sblkdev_cfg(item);
+
+	mutex_lock(&cfg->lock);
+	if (cfg->powered)
+		sblkdev_destroy(config_item_name(item));
+	cfg->powered = false;
+	mutex_unlock(&cfg->lock);
+
+	config_item_put(item);
+}
+
+static struct configfs_group_operations sblkdev_cfg_group_ops = {
+	.make_item = sblkdev_cfg_make_item,
+	.drop_item = sblkdev_cfg_drop_item,
+};
+
+static const struct config_item_type sblkdev_cfg_subsys_type = {
+	.ct_group_ops = &sblkdev_cfg_group_ops,
+	.ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem sblkdev_cfg_subsys = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = KBUILD_MODNAME,
+			.ci_type = &sblkdev_cfg_subsys_type,
+		},
+	},
+};
+
+int sblkdev_configfs_init(void)
+{
+	config_group_init(&sblkdev_cfg_subsys.su_group);
+	mutex_init(&sblkdev_cfg_subsys.su_mutex);
+	return configfs_register_subsystem(&sblkdev_cfg_subsys);
+}
+
+void sblkdev_configfs_exit(void)
+{
+	configfs_unregister_subsystem(&sblkdev_cfg_subsys);
+}
+
+#endif /* CONFIG_CONFIGFS_FS */
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * DAX ('dax=1'): filesystems mounted with '-o dax' map the file data straight
+ * from the device memory, and read and write it without going through the
+ * page cache, nor through the driver's own copy.
+ *
+ * The store is then allocated in full up front, in huge page sized and aligned
+ * blocks (see store.c), and its pages never move: ->direct_access() hands out
+ * their addresses for the filesystem to map and copy to and from. Block I/O
+ * (metadata, the journal) goes through the same pages as usual.
+ *
+ * The pages come from the page allocator, not from ZONE_DEVICE memory as with
+ * pmem, so fs-dax maps them page by page, not with huge (PMD) mappings, and
+ * get_user_pages() of such a mapping fails.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/blkdev.h>
+#include <linux/dax.h>
+#include <linux/version.h>
+#include "device.h"
+
+#if IS_ENABLED(CONFIG_DAX) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 15, 0)
+
+#include <linux/pfn_t.h>
+
+static long sblkdev_dax_direct_access(struct dax_device *dax_dev, pgoff_t pgoff,
+				      long nr_pages, enum dax_access_mode mode,
+				      void **kaddr, pfn_t *pfn)
+{
+	struct sblkdev_device *dev = dax_get_private(dax_dev);
+	unsigned long first_pfn;
+	long nr;
+
+	if (pgoff >= DIV_ROUND_UP(dev->capacity, PAGE_SECTORS))
+		return -ERANGE;
+
+	nr = sblkdev_store_direct_access(&dev->store, pgoff, nr_pages, kaddr,
+					 &first_pfn);
+	if (nr > 0 && pfn)
+		*pfn = pfn_to_pfn_t(first_pfn);
+	return nr;
+}
+
+static int sblkdev_dax_zero_page_range(struct dax_device *dax_dev, pgoff_t pgoff,
+				       size_t nr_pages)
+{
+	struct sblkdev_device *dev = dax_get_private(dax_dev);
+
+	/* Zeroes the pages in place: they may be mapped */
+	return sblkdev_store_discard(&dev->store, (loff_t)pgoff << PAGE_SHIFT,
+				     nr_pages << PAGE_SHIFT);
+}
+
+static const struct dax_operations sblkdev_dax_ops = {
+	.direct_access = sblkdev_dax_direct_access,
+	.zero_page_range = sblkdev_dax_zero_page_range,
+};
+
+/*
+ * sblkdev_dax_init() - Check the settings for DAX, and set its queue feature
+ * Plain RAM devices only: the pages must be the data, one for one.
+ */
+int sblkdev_dax_init(struct sblkdev_device *dev, const struct sblkdev_params *params,
+		     struct queue_limits *lim)
+{
+	if (!params->dax)
+		return 0;
+
+	if (params->zoned || params->backing_file || params->origin ||
+	    params->comp_alg || params->dedup || params->chunk_kb) {
+		pr_err("DAX is for plain RAM devices only\n");
+		return -EINVAL;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	lim->features |= BLK_FEAT_DAX;
+#endif
+	return 0;
+}
+
+/*
+ * sblkdev_dax_register() - Give the disk a DAX device, before it's added
+ */
+int sblkdev_dax_register(struct sblkdev_device *dev)
+{
+	struct dax_device *dax_dev;
+	int ret;
+
+	if (!dev->store.dax)
+		return 0;
+
+	dax_dev = alloc_dax(dev, &sblkdev_dax_ops);
+	if (IS_ERR(dax_dev))
+		return PTR_ERR(dax_dev);
+
+	ret = dax_add_host(dax_dev, dev->disk);
+	if (ret) {
+		kill_dax(dax_dev);
+		put_dax(dax_dev);
+		return ret;
+	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	blk_queue_flag_set(QUEUE_FLAG_DAX, dev->disk->queue);
+#endif
+	dev->dax_dev = dax_dev;
+	pr_info("DAX capable\n");
+	return 0;
+}
+
+/*
+ * sblkdev_dax_unregister() - Take the DAX device down, before the disk goes
+ * The filesystem, if any, is unmounted by then: nothing maps the pages anymore.
+ */
+void sblkdev_dax_unregister(struct sblkdev_device *dev)
+{
+	if (!dev->dax_dev)
+		return;
+
+	dax_remove_host(dev->disk);
+	kill_dax(dev->dax_dev);
+	put_dax(dev->dax_dev);
+	dev->dax_dev = NULL;
+}
+
+#endif /* CONFIG_DAX */
@@ -6,20 +6,75 @@
 #include <linux/version.h>
 #include <linux/blk-mq.h>
 #include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/sched/mm.h>
 #include "device.h"
 
+#define CREATE_TRACE_POINTS
+#include "sblkdev_trace.h"
+
+/*
+ * Discard and write-zeroes are handled alike: backing pages wholly inside the
+ * range are released (they read back as zeroes), the partially covered ones at
+ * the edges are zeroed in place. Only the latter, for a compressed page, may
+ * need memory.
+ */
+static inline blk_status_t sblkdev_discard(struct sblkdev_device *dev, loff_t pos,
+					   unsigned int len)
+{
+	if ((pos + len) > (dev->capacity << SECTOR_SHIFT))
+		return BLK_STS_IOERR;
+
+	if (sblkdev_store_discard(&dev->store, pos, len))
+		return BLK_STS_RESOURCE;
+	return BLK_STS_OK;
+}
+
+/*
+ * A frozen queue puts the freezer in a memalloc_noio scope, which unfreezing
+ * ends: reclaim must not wait on I/O to the frozen device. Since 6.14 the
+ * block layer does it and hands back the flags; before, we do it here.
+ */
+static inline unsigned int sblkdev_freeze_queue(struct request_queue *q)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	return blk_mq_freeze_queue(q);
+#else
+	blk_mq_freeze_queue(q);
+	return memalloc_noio_save();
+#endif
+}
+
+static inline void sblkdev_unfreeze_queue(struct request_queue *q, unsigned int memflags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	blk_mq_unfreeze_queue(q, memflags);
+#else
+	memalloc_noio_restore(memflags);
+	blk_mq_unfreeze_queue(q);
+#endif
+}
+
 #ifdef CONFIG_SBLKDEV_REQUESTS_BASED
 
 // TODO : use resource managed devm_* APIs for better error handling and cleanup
 
-static inline int process_request(struct request *rq, unsigned int *nr_bytes)
+/*
+ * sblkdev_transfer() - Move the data of a read or write request
+ * @pos is the device offset to transfer at; normally the request's own, but a
+ * zone append is told where to write by its zone's write pointer.
+ */
+blk_status_t sblkdev_transfer(struct sblkdev_device *dev, struct request *rq,
+			      loff_t pos, unsigned int *nr_bytes)
 {
-	int ret = BLK_STS_OK; // 0
+	blk_status_t ret = BLK_STS_OK; // 0
 	struct bio_vec bvec;
 	struct req_iterator iter;
-	struct sblkdev_device *dev = rq->q->queuedata;
-	loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
 	loff_t dev_size = (dev->capacity << SECTOR_SHIFT);
+	/* Large writes bypass the CPU caches, see sblkdev_store_nt() */
+	bool nt = rq_data_dir(rq) && sblkdev_store_nt(blk_rq_bytes(rq));
 
 	/*
 	 * The request contains a list of memory pages (bio_vec).
@@ -28,29 +83,316 @@ static inline int process_request(struct request *rq, unsigned int *nr_bytes)
 	 * device's "Doorbell" register or ring buffer.
 	 * Here, we do iterate over all the bio's - and each bio_vec within
 	 * them - calculating the src or dest address and the length; we then
-	 * perform a simple memcpy() (in lieu of DMA) to perform the actual IO,
-	 * the read or write.
+	 * perform a simple memcpy() (in lieu of DMA) to/from our sparse page
+	 * store to perform the actual IO, the read or write.
+	 * The bio_vecs are taken whole (multi-page): physically contiguous, so
+	 * a large I/O is a few large copies rather than one per page.
 	 */
-	PRINT_CTX();
-	rq_for_each_segment(bvec, rq, iter) {
+	rq_for_each_bvec(bvec, rq, iter) {
 		unsigned long len = bvec.bv_len;
-		void *buf = page_address(bvec.bv_page) + bvec.bv_offset;
+		void *buf = bvec_virt(&bvec);
 
 		if ((pos + len) > dev_size)
 			len = (unsigned long)(dev_size - pos);
 
-		if (rq_data_dir(rq))
-			memcpy(dev->data + pos, buf, len); /* WRITE */
-		else
-			memcpy(buf, dev->data + pos, len); /* READ */
+		trace_sblkdev_copy(disk_devt(dev->disk), rq_data_dir(rq), pos, len);
+		if (rq_data_dir(rq)) { /* WRITE */
+			/*
+			 * We can't sleep here; if a new page can't be had right
+			 * now, let blk-mq requeue and retry the request later.
+			 */
+			if (sblkdev_store_write(&dev->store, buf, pos, len,
+						GFP_NOWAIT | __GFP_NOWARN, nt)) {
+				ret = BLK_STS_RESOURCE;
+				break;
+			}
+		} else if (sblkdev_store_read(&dev->store, buf, pos, len)) { /* READ */
+			ret = BLK_STS_IOERR;
+			break;
+		}
 
 		pos += len;
 		*nr_bytes += len;
 	}
+	sblkdev_store_nt_fence(nt);
 
 	return ret;
 }
 
+/*
+ * Lock the range a request reads or writes (see rangelock.c), if it's free;
+ * discard and write-zeroes count as writes. Else, with @park, the request is
+ * parked until it is, and requeued then.
+ */
+static inline bool sblkdev_trylock_rq(struct sblkdev_device *dev, struct request *rq,
+				      bool park)
+{
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+
+	if (park)
+		return sblkdev_range_trylock_rq(dev, &cmd->range, pos, blk_rq_bytes(rq),
+						op_is_write(req_op(rq)), rq);
+	return sblkdev_range_trylock(dev, &cmd->range, pos, blk_rq_bytes(rq),
+				     op_is_write(req_op(rq)));
+}
+
+static inline void sblkdev_unlock_rq(struct sblkdev_device *dev, struct request *rq)
+{
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	sblkdev_range_unlock(dev, &cmd->range);
+}
+
+static inline blk_status_t process_request(struct request *rq, unsigned int *nr_bytes)
+{
+	struct sblkdev_device *dev = rq->q->queuedata;
+	loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
+	blk_status_t status;
+
+	/* Zone writes are serialized at the write pointer already */
+	if (dev->zoned)
+		return sblkdev_zoned_process(dev, rq, nr_bytes);
+
+	/*
+	 * An overlapping I/O is in the way: the request is parked until it's
+	 * done; on a poll queue, where nothing would run it again, the next
+	 * poll retries it instead.
+	 */
+	if (!sblkdev_trylock_rq(dev, rq, rq->mq_hctx->type != HCTX_TYPE_POLL))
+		return BLK_STS_DEV_RESOURCE;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		status = sblkdev_transfer(dev, rq, pos, nr_bytes);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		*nr_bytes = blk_rq_bytes(rq);
+		status = sblkdev_discard(dev, pos, blk_rq_bytes(rq));
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+
+	sblkdev_unlock_rq(dev, rq);
+	return status;
+}
+
+static inline void sblkdev_start_request(struct request *rq)
+{
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	cmd->start_ns = ktime_get_ns();
+	blk_mq_start_request(rq);
+	trace_sblkdev_submit(disk_devt(rq->q->disk), req_op(rq), blk_rq_pos(rq),
+			     blk_rq_bytes(rq), rq->mq_hctx->queue_num);
+}
+
+/*
+ * Account a request in the stats and complete it; as part of the @iob batch
+ * when possible (@iob may be NULL).
+ */
+static inline void sblkdev_end_request(struct request *rq, blk_status_t status,
+				       struct io_comp_batch *iob)
+{
+	struct sblkdev_device *dev = rq->q->queuedata;
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	u64 lat_ns = ktime_get_ns() - cmd->start_ns;
+
+	sblkdev_stats_account(dev->stats, req_op(rq), blk_rq_bytes(rq),
+			      status != BLK_STS_OK, rq->bio != rq->biotail, lat_ns,
+			      req_get_ioprio(rq));
+	trace_sblkdev_complete(disk_devt(dev->disk), req_op(rq), blk_rq_pos(rq),
+			       blk_rq_bytes(rq), blk_status_to_errno(status), lat_ns);
+
+	if (!blk_mq_add_to_batch(rq, iob, status != BLK_STS_OK,
+				 blk_mq_end_request_batch))
+		blk_mq_end_request(rq, status);
+}
+
+static inline bool sblkdev_profile_active(const struct sblkdev_profile *profile)
+{
+	return profile->latency_ns || profile->jitter_ns || profile->bw_limit ||
+	       profile->iops_limit;
+}
+
+/* Are requests completed later than when they're processed? */
+static inline bool sblkdev_deferred(struct sblkdev_device *dev)
+{
+	return dev->emulate || dev->throttle;
+}
+
+/*
+ * Media emulation: when would a request of @bytes, issued at @start, complete
+ * on the emulated device? The bandwidth and IOPS caps are modelled as one
+ * device-wide timeline of 'busy until' time, advanced locklessly; each IO
+ * occupies it for the longer of its transfer time and the per-IO slot. A real
+ * time (@rt) IO goes ahead of those queued, which it pushes back. The per-IO
+ * latency (and jitter) then comes on top, so it overlaps across queued IOs
+ * like on real media.
+ */
+static ktime_t sblkdev_emulated_completion(struct sblkdev_device *dev, unsigned int bytes,
+					   u64 start, bool rt)
+{
+	const struct sblkdev_profile *profile = &dev->profile;
+	u64 done = start;
+	u64 service_ns = 0;
+
+	if (profile->bw_limit)
+		service_ns = div64_u64((u64)bytes * NSEC_PER_SEC, profile->bw_limit);
+	if (profile->iops_limit)
+		service_ns = max_t(u64, service_ns, NSEC_PER_SEC / profile->iops_limit);
+
+	if (service_ns) {
+		s64 busy = atomic64_read(&dev->busy_until_ns);
+		u64 until;
+
+		do {
+			until = max_t(u64, busy, start) + service_ns;
+		} while (!atomic64_try_cmpxchg(&dev->busy_until_ns, &busy, until));
+		done = rt ? start + service_ns : until;
+	}
+
+	done += profile->latency_ns;
+	if (profile->jitter_ns)
+		done += mul_u64_u32_shr(profile->jitter_ns, get_random_u32(), 32);
+
+	return ns_to_ktime(done);
+}
+
+/*
+ * When is @rq due: once the limits let it through (see qos.c), then after its
+ * emulated service time, if any.
+ */
+static ktime_t sblkdev_completion_time(struct sblkdev_queue *sq, struct request *rq)
+{
+	struct sblkdev_device *dev = sq->dev;
+	u64 start = dev->throttle ? sblkdev_qos_release(sq, rq) : ktime_get_ns();
+
+	if (!dev->emulate)
+		return ns_to_ktime(start);
+	return sblkdev_emulated_completion(dev, blk_rq_bytes(rq), start,
+					   sblkdev_qos_class(req_get_ioprio(rq)) == SBLKDEV_QOS_RT);
+}
+
+/*
+ * Complete a processed request when it's due (see above) instead of right
+ * away: it's put on the hctx's time ordered queue, and the hctx's hrtimer is
+ * (re)armed if it's now the earliest.
+ */
+static void sblkdev_defer_completion(struct sblkdev_queue *sq, struct request *rq,
+				     blk_status_t status)
+{
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	unsigned long flags;
+
+	cmd->status = status;
+	timerqueue_init(&cmd->node);
+	cmd->node.expires = sblkdev_completion_time(sq, rq);
+
+	spin_lock_irqsave(&sq->timer_lock, flags);
+	if (timerqueue_add(&sq->pending, &cmd->node))
+		hrtimer_start(&sq->timer, cmd->node.expires, HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&sq->timer_lock, flags);
+}
+
+/*
+ * The hctx's hrtimer: complete (as a batch) every request that is due, then
+ * re-arm for the next one, if any.
+ */
+static enum hrtimer_restart sblkdev_timer_fn(struct hrtimer *timer)
+{
+	struct sblkdev_queue *sq = container_of(timer, struct sblkdev_queue, timer);
+	struct timerqueue_node *node;
+	DEFINE_IO_COMP_BATCH(iob);
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	LIST_HEAD(done);
+	struct request *rq, *next;
+
+	spin_lock_irqsave(&sq->timer_lock, flags);
+	while ((node = timerqueue_getnext(&sq->pending))) {
+		if (ktime_after(node->expires, now)) {
+			hrtimer_start(timer, node->expires, HRTIMER_MODE_ABS);
+			break;
+		}
+		timerqueue_del(&sq->pending, node);
+		rq = blk_mq_rq_from_pdu(container_of(node, struct sblkdev_cmd, node));
+		list_add_tail(&rq->queuelist, &done);
+	}
+	spin_unlock_irqrestore(&sq->timer_lock, flags);
+
+	list_for_each_entry_safe(rq, next, &done, queuelist) {
+		struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+		list_del_init(&rq->queuelist);
+		sblkdev_end_request(rq, cmd->status, &iob);
+	}
+	if (iob.complete)
+		iob.complete(&iob);
+
+	/* hrtimer_start() above has re-armed us if needed */
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Requests on a poll queue aren't executed at submission: they wait on the
+ * hctx's poll list until the submitter (e.g. io_uring with IORING_SETUP_IOPOLL)
+ * reaps them via sblkdev_poll(). No interrupt, no inline completion. With media
+ * emulation or throttling, the poller won't see them done before they're due.
+ */
+static inline void sblkdev_queue_poll(struct sblkdev_queue *sq, struct request *rq)
+{
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	cmd->node.expires = sblkdev_deferred(sq->dev) ? sblkdev_completion_time(sq, rq) : 0;
+
+	spin_lock(&sq->poll_lock);
+	list_add_tail(&rq->queuelist, &sq->poll_list);
+	spin_unlock(&sq->poll_lock);
+}
+
+static void sblkdev_par_rq_done(void *data, blk_status_t status)
+{
+	struct request *rq = data;
+	struct sblkdev_queue *sq = rq->mq_hctx->driver_data;
+
+	sblkdev_unlock_rq(sq->dev, rq);
+	if (sblkdev_deferred(sq->dev))
+		sblkdev_defer_completion(sq, rq, status);
+	else
+		sblkdev_end_request(rq, status, NULL);
+}
+
+/*
+ * Hand a very large read or write over to the parallel copy workers (see
+ * parcopy.c), which complete it. Zoned devices copy inline: their writes are
+ * tied to the write pointer. Returns false if the caller is to copy it itself.
+ */
+static bool sblkdev_par_queue(struct sblkdev_device *dev, struct request *rq)
+{
+	if (dev->zoned || !sblkdev_par_wanted(blk_rq_bytes(rq)))
+		return false;
+	if (req_op(rq) != REQ_OP_READ && req_op(rq) != REQ_OP_WRITE)
+		return false;
+
+	/* Held until the workers are done; process_request() parks it if busy */
+	if (!sblkdev_trylock_rq(dev, rq, false))
+		return false;
+
+	/* The workers can sleep, and wait for memory rather than requeue */
+	if (!sblkdev_par_copy(dev, rq->bio, blk_rq_pos(rq) << SECTOR_SHIFT,
+			      blk_rq_bytes(rq), rq_data_dir(rq), GFP_NOIO,
+			      sblkdev_par_rq_done, rq))
+		return true;
+
+	sblkdev_unlock_rq(dev, rq);
+	return false;
+}
+
 /*
  * IMPORTANT:
  * This is where any new request from block IO layer is handled; this is the
@@ -63,25 +405,243 @@ static blk_status_t sblkdev_queue_rq(struct blk_mq_hw_ctx *hctx, const struct bl
 	unsigned int nr_bytes = 0;
 	blk_status_t status = BLK_STS_OK;
 	struct request *rq = bd->rq;
+	struct sblkdev_queue *sq = hctx->driver_data;
 
 	cant_sleep(); /* cannot use any locks that make the thread sleep */
-	pr_debug("new request from block IO layer queued\n");
-	PRINT_CTX();
 
-	blk_mq_start_request(rq);
+	/* Tracepoints (see sblkdev_trace.h), not printks, on the data path */
+	sblkdev_start_request(rq);
+
+	if (sq->dev->backing_file) {
+		sblkdev_backing_queue(rq);
+		return BLK_STS_OK;
+	}
 
-	if (process_request(rq, &nr_bytes))
-		status = BLK_STS_IOERR;
+	if (hctx->type == HCTX_TYPE_POLL) {
+		sblkdev_queue_poll(sq, rq);
+		return BLK_STS_OK;
+	}
 
-	pr_debug("request %llu:%d (pos:#bytes) processed\n", blk_rq_pos(rq), nr_bytes);
+	if (sblkdev_par_queue(sq->dev, rq))
+		return BLK_STS_OK;
 
-	blk_mq_end_request(rq, status);
+	status = process_request(rq, &nr_bytes);
+	if (status == BLK_STS_DEV_RESOURCE)
+		return BLK_STS_OK;	/* Parked until its range is free */
+	if (status == BLK_STS_RESOURCE)
+		return status;	/* blk-mq requeues the request */
 
-	return status;
+	if (sblkdev_deferred(sq->dev)) {
+		sblkdev_defer_completion(sq, rq, status);
+		return BLK_STS_OK;
+	}
+
+	sblkdev_end_request(rq, status, NULL);
+
+	/* The request is completed (with its status); don't have blk-mq end it again */
+	return BLK_STS_OK;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+/*
+ * Batched dispatch: blk-mq hands us a whole plugged list of requests in one
+ * call (for 'none' scheduler queues). We process them back to back and
+ * complete the lot through a single io_comp_batch, so the per request
+ * completion overhead (tag freeing, accounting) is amortized over the batch.
+ * Requests we can't take right now are requeued; anything left on @rqlist on
+ * return would be issued again via ->queue_rq(), so we leave it empty.
+ */
+static void sblkdev_queue_rqs(struct rq_list *rqlist)
+{
+	DEFINE_IO_COMP_BATCH(iob);
+	struct request_queue *requeue_q = NULL;
+	struct request *rq;
+
+	cant_sleep();
+
+	while ((rq = rq_list_pop(rqlist))) {
+		struct sblkdev_queue *sq = rq->mq_hctx->driver_data;
+		unsigned int nr_bytes = 0;
+		blk_status_t status;
+
+		sblkdev_start_request(rq);
+
+		if (sq->dev->backing_file) {
+			sblkdev_backing_queue(rq);
+			continue;
+		}
+
+		if (rq->mq_hctx->type == HCTX_TYPE_POLL) {
+			sblkdev_queue_poll(sq, rq);
+			continue;
+		}
+
+		if (sblkdev_par_queue(sq->dev, rq))
+			continue;
+
+		status = process_request(rq, &nr_bytes);
+		if (status == BLK_STS_DEV_RESOURCE)
+			continue;	/* Parked until its range is free */
+		if (status == BLK_STS_RESOURCE) {
+			blk_mq_requeue_request(rq, false);
+			requeue_q = rq->q;
+			continue;
+		}
+
+		if (sblkdev_deferred(sq->dev)) {
+			sblkdev_defer_completion(sq, rq, status);
+			continue;
+		}
+
+		sblkdev_end_request(rq, status, &iob);
+	}
+
+	if (iob.complete)
+		iob.complete(&iob);
+	if (requeue_q)
+		blk_mq_delay_kick_requeue_list(requeue_q, SBLKDEV_REQUEUE_DELAY_MS);
+}
+#endif
+
+/*
+ * Execute and complete the (due) requests queued on a poll hctx, adding the
+ * completions to the poller's batch. Requests short of memory, or not yet due,
+ * stay on the list for the next poll. There is no ->timeout handler: poll
+ * requests are only ever completed here, so blk-mq just re-arms their timer.
+ */
+static int sblkdev_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+	struct sblkdev_queue *sq = hctx->driver_data;
+	struct request *rq, *next;
+	ktime_t now = ktime_get();
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&sq->poll_lock);
+	list_splice_init(&sq->poll_list, &list);
+	spin_unlock(&sq->poll_lock);
+
+	list_for_each_entry_safe(rq, next, &list, queuelist) {
+		struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+		unsigned int nr_bytes = 0;
+		blk_status_t status;
+
+		/* Not yet due on the emulated media */
+		if (ktime_after(cmd->node.expires, now))
+			continue;
+
+		status = process_request(rq, &nr_bytes);
+		if (status == BLK_STS_DEV_RESOURCE)
+			continue;	/* Its range is busy; the others may not be */
+		if (status == BLK_STS_RESOURCE)
+			break;
+
+		list_del_init(&rq->queuelist);
+		sblkdev_end_request(rq, status, iob);
+		nr++;
+	}
+
+	if (!list_empty(&list)) {
+		spin_lock(&sq->poll_lock);
+		list_splice(&list, &sq->poll_list);
+		spin_unlock(&sq->poll_lock);
+	}
+
+	return nr;
+}
+
+/*
+ * Lay the default, read and poll queues out one after the other and spread
+ * the CPUs over each map.
+ */
+static void sblkdev_map_queues(struct blk_mq_tag_set *set)
+{
+	struct sblkdev_device *dev = set->driver_data;
+	unsigned int nr_queues[HCTX_MAX_TYPES] = {
+		/* From the tag set: may be in the middle of sblkdev_set_hw_queues() */
+		[HCTX_TYPE_DEFAULT] = set->nr_hw_queues - dev->nr_read_queues -
+				      dev->nr_poll_queues,
+		[HCTX_TYPE_READ] = dev->nr_read_queues,
+		[HCTX_TYPE_POLL] = dev->nr_poll_queues,
+	};
+	unsigned int i, qoff = 0;
+
+	for (i = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		map->nr_queues = nr_queues[i];
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		/*
+		 * Spreads the hctxs over the nodes, then over the CPUs of each:
+		 * given at least as many hctxs as nodes, an hctx serves CPUs of
+		 * one node, and is allocated there. With numa=local, pages then
+		 * end up on the node of the hctx that first wrote them.
+		 *
+		 * An empty read map falls back to the default one.
+		 */
+		if (map->nr_queues)
+			blk_mq_map_queues(map);
+	}
+}
+
+/*
+ * Set up our per-hctx context. blk-mq hands us the node of the CPUs mapped to
+ * this hctx, so the context ends up local to its submitters.
+ */
+static int sblkdev_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx)
+{
+	struct sblkdev_queue *sq;
+
+	sq = kzalloc_node(sizeof(*sq), GFP_KERNEL, hctx->numa_node);
+	if (!sq)
+		return -ENOMEM;
+
+	sq->dev = data;
+	sq->hctx_idx = hctx_idx;
+	spin_lock_init(&sq->poll_lock);
+	INIT_LIST_HEAD(&sq->poll_list);
+	sblkdev_qos_reset(&sq->bucket);
+	spin_lock_init(&sq->timer_lock);
+	timerqueue_init_head(&sq->pending);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+	hrtimer_setup(&sq->timer, sblkdev_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&sq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	sq->timer.function = sblkdev_timer_fn;
+#endif
+	hctx->driver_data = sq;
+
+	return 0;
+}
+
+static void sblkdev_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+	struct sblkdev_queue *sq = hctx->driver_data;
+
+	hrtimer_cancel(&sq->timer);
+	kfree(sq);
+	hctx->driver_data = NULL;
+}
+
+/* Completion of the requests handed to blk_mq_complete_request(): file-backed mode */
+static void sblkdev_complete_rq(struct request *rq)
+{
+	struct sblkdev_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	sblkdev_end_request(rq, cmd->status, NULL);
 }
 
 static struct blk_mq_ops mq_ops = {
 	.queue_rq = sblkdev_queue_rq,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	.queue_rqs = sblkdev_queue_rqs,
+#endif
+	.complete = sblkdev_complete_rq,
+	.poll = sblkdev_poll,
+	.map_queues = sblkdev_map_queues,
+	.init_hctx = sblkdev_init_hctx,
+	.exit_hctx = sblkdev_exit_hctx,
 };
 
 #else  /* CONFIG_SBLKDEV_REQUESTS_BASED */
@@ -92,13 +652,54 @@ static inline void process_bio(struct sblkdev_device *dev, struct bio *bio)
 	struct bvec_iter iter;
 	loff_t pos = bio->bi_iter.bi_sector << SECTOR_SHIFT;
 	loff_t dev_size = (dev->capacity << SECTOR_SHIFT);
+	gfp_t gfp = (bio->bi_opf & REQ_NOWAIT) ? GFP_NOWAIT : GFP_NOIO;
+	unsigned int bytes = bio->bi_iter.bi_size;
+	struct sblkdev_range range;
+	bool nt = false;
+	u64 start_ns = ktime_get_ns();
 	unsigned long start_time;
+	u64 lat_ns;
 
-	PRINT_CTX();
 	start_time = bio_start_io_acct(bio);
-	bio_for_each_segment(bvec, bio, iter) {
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		break;
+	default:
+		bio->bi_status = BLK_STS_NOTSUPP;
+		goto out;
+	}
+
+	/* Ordered against the overlapping I/O, see rangelock.c */
+	if (!(bio->bi_opf & REQ_NOWAIT)) {
+		sblkdev_range_lock(dev, &range, pos, bytes, op_is_write(bio_op(bio)));
+	} else if (!sblkdev_range_trylock(dev, &range, pos, bytes,
+					  op_is_write(bio_op(bio)))) {
+		bio->bi_status = BLK_STS_AGAIN;
+		goto out;
+	}
+
+	if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+		/* Nothing retries a bio: short of memory is an I/O error, as for writes */
+		if (sblkdev_discard(dev, pos, bytes) != BLK_STS_OK)
+			bio->bi_status = BLK_STS_IOERR;
+		goto out_unlock;
+	}
+
+	/* Very large ones on several CPUs; not if the submitter can't wait */
+	if (!(bio->bi_opf & REQ_NOWAIT) && sblkdev_par_wanted(bytes) &&
+	    !sblkdev_par_copy_sync(dev, bio, pos, bytes, bio_data_dir(bio), gfp,
+				   &bio->bi_status))
+		goto out_unlock;
+
+	/* Multi-page bio_vecs, and the copy engine choice, as in sblkdev_transfer() */
+	if (bio_data_dir(bio))
+		nt = sblkdev_store_nt(bytes);
+	bio_for_each_bvec(bvec, bio, iter) {
 		unsigned int len = bvec.bv_len;
-		void *buf = page_address(bvec.bv_page) + bvec.bv_offset;
+		void *buf = bvec_virt(&bvec);
 
 		if ((pos + len) > dev_size) {
 			/* len = (unsigned long)(dev_size - pos);*/
@@ -106,13 +707,29 @@ static inline void process_bio(struct sblkdev_device *dev, struct bio *bio)
 			break;
 		}
 
-		if (bio_data_dir(bio))
-			memcpy(dev->data + pos, buf, len); /* WRITE */
-		else
-			memcpy(buf, dev->data + pos, len); /* READ */
+		trace_sblkdev_copy(disk_devt(dev->disk), bio_data_dir(bio), pos, len);
+		if (bio_data_dir(bio)) { /* WRITE */
+			if (sblkdev_store_write(&dev->store, buf, pos, len, gfp, nt)) {
+				bio->bi_status = BLK_STS_IOERR;
+				break;
+			}
+		} else if (sblkdev_store_read(&dev->store, buf, pos, len)) { /* READ */
+			bio->bi_status = BLK_STS_IOERR;
+			break;
+		}
 
 		pos += len;
 	}
+	sblkdev_store_nt_fence(nt);
+out_unlock:
+	sblkdev_range_unlock(dev, &range);
+out:
+	lat_ns = ktime_get_ns() - start_ns;
+	sblkdev_stats_account(dev->stats, bio_op(bio), bytes,
+			      bio->bi_status != BLK_STS_OK, false, lat_ns, bio_prio(bio));
+	trace_sblkdev_complete(disk_devt(dev->disk), bio_op(bio),
+			       bio->bi_iter.bi_sector, bytes,
+			       blk_status_to_errno(bio->bi_status), lat_ns);
 	bio_end_io_acct(bio, start_time);
 	bio_endio(bio);
 }
@@ -132,9 +749,10 @@ void sblkdev_submit_bio(struct bio *bio)
 	struct sblkdev_device *dev = bio->bi_disk->private_data;
 #endif
 
-	PRINT_CTX();
 	might_sleep();
 
+	trace_sblkdev_submit(disk_devt(dev->disk), bio_op(bio), bio->bi_iter.bi_sector,
+			     bio->bi_iter.bi_size, -1);
 	process_bio(dev, bio);
 
 #ifdef HAVE_QC_SUBMIT_BIO
@@ -249,6 +867,7 @@ static const struct block_device_operations fops = {
 	.open = sblkdev_open,
 	.release = sblkdev_release,
 	.ioctl = sblkdev_ioctl,
+	.report_zones = sblkdev_report_zones,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = sblkdev_compat_ioctl,
 #endif
@@ -257,12 +876,175 @@ static const struct block_device_operations fops = {
 #endif
 };
 
+/*
+ * Runtime changes, from the control plane (see configfs.c). Each is made with
+ * the queue frozen, so that no request sees half of it.
+ */
+
+/*
+ * sblkdev_save() - Write a live device out to its image
+ * The queue stays frozen until it's all written: the image is consistent.
+ */
+int sblkdev_save(struct sblkdev_device *dev)
+{
+	struct request_queue *q = dev->disk->queue;
+	unsigned int memflags;
+	int ret;
+
+	if (!dev->image)
+		return -EINVAL;
+
+	memflags = sblkdev_freeze_queue(q);
+	ret = sblkdev_image_save(dev);
+	sblkdev_unfreeze_queue(q, memflags);
+	return ret;
+}
+
+/*
+ * sblkdev_resize() - Change the capacity of a live device
+ * What a shrink cuts off is discarded, lest it read back after a regrow.
+ */
+int sblkdev_resize(struct sblkdev_device *dev, sector_t capacity)
+{
+	struct request_queue *q = dev->disk->queue;
+	unsigned int memflags;
+	int ret = 0;
+
+	/* A DAX store is allocated in full, for the capacity it was added with */
+	if (dev->zoned || dev->dax_dev)
+		return -EOPNOTSUPP;
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+	if (dev->backing_file)
+		return -EOPNOTSUPP;
+#endif
+
+	memflags = sblkdev_freeze_queue(q);
+	if (capacity < dev->capacity)
+		ret = sblkdev_store_discard(&dev->store, (loff_t)capacity << SECTOR_SHIFT,
+					    (size_t)(dev->capacity - capacity) << SECTOR_SHIFT);
+	if (!ret) {
+		dev->capacity = capacity;
+		set_capacity_and_notify(dev->disk, capacity);
+	}
+	sblkdev_unfreeze_queue(q, memflags);
+
+	if (!ret)
+		pr_info("'%s' resized to %llu sectors\n", dev->disk->disk_name, capacity);
+	return ret;
+}
+
+/*
+ * sblkdev_set_block_size() - Change the logical block size
+ */
+int sblkdev_set_block_size(struct sblkdev_device *dev, unsigned int block_size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	struct request_queue *q = dev->disk->queue;
+	struct queue_limits lim;
+	unsigned int memflags;
+	int ret;
+
+	if (dev->zoned)
+		return -EOPNOTSUPP;
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+	/* That one follows the backing storage */
+	if (dev->backing_file)
+		return -EOPNOTSUPP;
+#endif
+
+	lim = queue_limits_start_update(q);
+	/* The physical block size stays a page */
+	lim.logical_block_size = block_size;
+	memflags = sblkdev_freeze_queue(q);
+	ret = queue_limits_commit_update(q, &lim);
+	sblkdev_unfreeze_queue(q, memflags);
+	return ret;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+/*
+ * sblkdev_set_hw_queues() - Change the number of default hardware queues
+ * @nr: 0 is one per online CPU, as when adding the device.
+ */
+int sblkdev_set_hw_queues(struct sblkdev_device *dev, unsigned int nr)
+{
+	unsigned int others = dev->nr_read_queues + dev->nr_poll_queues;
+
+	nr = min(nr ? : num_online_cpus(), nr_cpu_ids);
+	/* Freezes the queue itself; keeps the old number if it can't be had */
+	blk_mq_update_nr_hw_queues(&dev->tag_set, nr + others);
+	dev->nr_hw_queues = dev->tag_set.nr_hw_queues - others;
+	if (dev->nr_hw_queues != nr)
+		return -ENOMEM;
+
+	pr_info("'%s' now has %u default hw queue(s)\n", dev->disk->disk_name, nr);
+	return 0;
+}
+
+/*
+ * sblkdev_set_profile() - Change the media emulation profile
+ * Requests already waiting for their emulated completion keep their time.
+ */
+int sblkdev_set_profile(struct sblkdev_device *dev, const struct sblkdev_profile *profile)
+{
+	struct request_queue *q = dev->disk->queue;
+	unsigned int memflags;
+
+	if (dev->backing_file)
+		return -EOPNOTSUPP;
+
+	memflags = sblkdev_freeze_queue(q);
+	dev->profile = *profile;
+	dev->emulate = sblkdev_profile_active(profile);
+	atomic64_set(&dev->busy_until_ns, 0);
+	sblkdev_unfreeze_queue(q, memflags);
+	return 0;
+}
+
+/*
+ * sblkdev_set_qos() - Change the throttling limits
+ * The buckets start out full again. Requests already held back keep their time.
+ */
+int sblkdev_set_qos(struct sblkdev_device *dev, const struct sblkdev_qos *qos)
+{
+	struct request_queue *q = dev->disk->queue;
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int memflags;
+	unsigned long i;
+
+	if (dev->backing_file)
+		return -EOPNOTSUPP;
+
+	memflags = sblkdev_freeze_queue(q);
+	dev->qos = *qos;
+	dev->throttle = sblkdev_qos_active(qos);
+	sblkdev_qos_reset(&dev->bucket);
+	queue_for_each_hw_ctx(q, hctx, i) {
+		struct sblkdev_queue *sq = hctx->driver_data;
+
+		sblkdev_qos_reset(&sq->bucket);
+	}
+	sblkdev_unfreeze_queue(q, memflags);
+	return 0;
+}
+#endif
+
 /*
  * sblkdev_remove() - Remove simple block device
  */
 void sblkdev_remove(struct sblkdev_device *dev)
 {
+	sblkdev_mem_unregister(dev);
+	sblkdev_dax_unregister(dev);
 	del_gendisk(dev->disk);
+	/* No more I/O: what's saved is the final content */
+	if (dev->image && sblkdev_image_save(dev))
+		pr_warn("'%s' removed without saving its content: '%s' is the last image saved\n",
+			dev->disk->disk_name, dev->image);
+	sblkdev_stats_free(dev);
 
 #ifdef HAVE_BLK_MQ_ALLOC_DISK
 #ifdef HAVE_BLK_CLEANUP_DISK
@@ -278,7 +1060,11 @@ void sblkdev_remove(struct sblkdev_device *dev)
 #ifdef CONFIG_SBLKDEV_REQUESTS_BASED
 	blk_mq_free_tag_set(&dev->tag_set);
 #endif
-	kvfree(dev->data);
+	sblkdev_backing_close(dev);
+	sblkdev_zoned_free(dev);
+	sblkdev_range_free(dev);
+	sblkdev_store_free(&dev->store);
+	sblkdev_image_free(dev);
 	kfree(dev);
 	pr_info("simple block device was removed\n");
 }
@@ -286,15 +1072,29 @@ void sblkdev_remove(struct sblkdev_device *dev)
 #ifdef CONFIG_SBLKDEV_REQUESTS_BASED
 static inline int init_tag_set(struct blk_mq_tag_set *set, void *data)
 {
+	struct sblkdev_device *dev = data;
+
 	set->ops = &mq_ops;	// block driver behavior
-	set->nr_hw_queues = 1;
-	set->nr_maps = 1;
-	set->queue_depth = 128;
+	/*
+	 * Several hw queues (by default one per online CPU) so that submitters
+	 * don't all contend for the one hctx and its one tag bitmap.
+	 */
+	set->nr_hw_queues = dev->nr_hw_queues + dev->nr_read_queues + dev->nr_poll_queues;
+	/*
+	 * With read or poll queues, all three maps exist: default, read, poll.
+	 * blk-mq considers the queue pollable once the poll map is non-empty.
+	 */
+	set->nr_maps = (dev->nr_read_queues || dev->nr_poll_queues) ? HCTX_MAX_TYPES : 1;
+	set->queue_depth = dev->queue_depth;
+	/*
+	 * No set-wide node: blk-mq then allocates each hctx's tags and requests
+	 * on the node of the CPUs mapped to that hctx, i.e. NUMA-local tags.
+	 */
 	set->numa_node = NUMA_NO_NODE;
 	set->flags = BLK_MQ_F_STACKING;
 	//set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_STACKING; // not on 6.14?
 
-	set->cmd_size = 0;	// additional bytes to alloc per request
+	set->cmd_size = sizeof(struct sblkdev_cmd);	// additional bytes to alloc per request
 	set->driver_data = data;
 
 	// 'Alloc a tag set to be associated with one or more request queues.'
@@ -357,19 +1157,98 @@ static inline struct gendisk *blk_alloc_disk(int node)
 }
 #endif
 
+/*
+ * A snapshot shares the store of its origin, pages and settings, until they're
+ * written. The origin is frozen only for the (constant) time it takes to set
+ * up, whatever its size.
+ */
+static int sblkdev_snapshot_init(struct sblkdev_device *dev, const struct sblkdev_params *params)
+{
+	struct sblkdev_device *origin = params->origin;
+	struct request_queue *q = origin->disk->queue;
+	unsigned int memflags;
+	int ret;
+
+	if (params->zoned || params->backing_file || params->comp_alg ||
+	    params->dedup || params->chunk_kb || params->dax || params->numa_policy ||
+	    params->mem || origin->zoned) {
+		pr_err("A snapshot takes its origin's settings, and can't be zoned\n");
+		return -EINVAL;
+	}
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+	if (origin->backing_file) {
+		pr_err("Can't snapshot a file-backed device\n");
+		return -EINVAL;
+	}
+#endif
+	if (params->capacity && params->capacity != origin->capacity) {
+		pr_err("A snapshot has the capacity of its origin\n");
+		return -EINVAL;
+	}
+	dev->capacity = origin->capacity;
+
+	memflags = sblkdev_freeze_queue(q);
+	ret = sblkdev_store_snapshot(&origin->store, &dev->store);
+	sblkdev_unfreeze_queue(q, memflags);
+	if (!ret)
+		pr_info("snapshot of '%s'\n", origin->disk->disk_name);
+	return ret;
+}
+
 /*
  * sblkdev_add() - Add simple block device
  * This function poses as an innocent but is really pretty large and important!
  */
 struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
-				  sector_t capacity)
+				  const struct sblkdev_params *params)
 {
 	struct sblkdev_device *dev = NULL;
+	sector_t capacity = params->capacity;
 	int ret = 0;
 	struct gendisk *disk;
+	struct sblkdev_store_opts store_opts = {
+		.size = (loff_t)capacity << SECTOR_SHIFT,
+		.comp_alg = params->comp_alg,
+		.dedup = params->dedup,
+		/* A power of 2, at least a page (see main.c) */
+		.chunk_order = params->chunk_kb ?
+			       ilog2(params->chunk_kb) + 10 - PAGE_SHIFT : 0,
+		.dax = params->dax,
+		.pinned = params->mem,
+		.numa_policy = params->numa_policy,
+		.numa_node = params->numa_node,
+		/* A power of 2, at least a page (see main.c) */
+		.numa_stripe_order = params->numa_stripe_kb ?
+				     ilog2(params->numa_stripe_kb) + 10 - PAGE_SHIFT : 0,
+	};
+	struct queue_limits lim = {
+		/* The store allocates, and copies, a page at a time */
+		.physical_block_size = PAGE_SIZE,
+		.io_min = PAGE_SIZE,
+		/* Memory has no DMA constraints: take bvecs as they come */
+		.max_segments = USHRT_MAX,
+		.max_segment_size = UINT_MAX,
+		/* Discard and write-zeroes release backing pages, see sblkdev_discard() */
+		.max_hw_discard_sectors = UINT_MAX,
+		.max_discard_segments = 1,
+		.discard_granularity = PAGE_SIZE,
+		.max_write_zeroes_sectors = UINT_MAX,
+	};
 
 	//--- Block driver Init step 1
 	pr_info("add device '%s' capacity %llu sectors\n", name, capacity);
+	if (params->block_size)
+		lim.logical_block_size = params->block_size;
+	/*
+	 * Large requests: without a max_hw_sectors, the block layer caps them to
+	 * 255 sectors, and max_sectors to BLK_DEF_MAX_SECTORS_CAP unless the user
+	 * limit is set too.
+	 */
+	if (params->max_io_kb) {
+		lim.max_hw_sectors = params->max_io_kb << 1;
+		lim.max_user_sectors = lim.max_hw_sectors;
+		lim.io_opt = params->max_io_kb * SZ_1K;
+	}
 
 	dev = kzalloc(sizeof(struct sblkdev_device), GFP_KERNEL);
 	if (!dev) {
@@ -379,11 +1258,52 @@ struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
 
 	INIT_LIST_HEAD(&dev->link);
 	dev->capacity = capacity;
-	dev->data = kvzalloc(capacity << SECTOR_SHIFT, GFP_KERNEL);
-	if (!dev->data) {
-		ret = -ENOMEM;
+	/* An image may size the device, hence the store */
+	ret = sblkdev_image_init(dev, params);
+	if (ret)
+		goto fail_free_image;
+	store_opts.size = (loff_t)dev->capacity << SECTOR_SHIFT;
+	/* DAX: before the store, which then comes allocated in full */
+	ret = sblkdev_dax_init(dev, params, &lim);
+	if (ret)
+		goto fail_free_image;
+	/* Sparse: backing pages get allocated as they're first written */
+	if (params->origin)
+		ret = sblkdev_snapshot_init(dev, params);
+	else
+		ret = sblkdev_store_init(&dev->store, &store_opts);
+	if (ret)
+		goto fail_free_image;
+
+	ret = sblkdev_range_init(dev);
+	if (ret)
+		goto fail_kfree;
+
+	/* Zoned: lays out the zones (may trim the capacity) and sets their limits */
+	ret = sblkdev_zoned_init(dev, params, &lim);
+	if (ret)
+		goto fail_kfree;
+
+	/* File-backed: the data goes to the backing file instead (may size the device) */
+	if (params->backing_file && params->zoned) {
+		pr_err("A zoned device can't be file-backed\n");
+		ret = -EINVAL;
+		goto fail_kfree;
+	}
+	if (params->writeback && !params->backing_file) {
+		pr_err("A write-back cache needs a backing file\n");
+		ret = -EINVAL;
+		goto fail_kfree;
+	}
+	/* Block I/O alone goes to the zones, or to the file */
+	if (params->mem && (params->zoned || params->backing_file)) {
+		pr_err("The memory char device is for RAM devices only\n");
+		ret = -EINVAL;
 		goto fail_kfree;
 	}
+	ret = sblkdev_backing_open(dev, params, &lim);
+	if (ret)
+		goto fail_kfree;
 
 	/*--- Block driver Init step 2 - tag set init; a critical part of block
 	 * driver initialization when using the request-based approach.
@@ -391,10 +1311,33 @@ struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
 	 */
 #ifdef CONFIG_SBLKDEV_REQUESTS_BASED
 	pr_info("Going via explicit (longer) request-based approach\n");
+	dev->nr_hw_queues = params->nr_hw_queues ? : num_online_cpus();
+	dev->nr_hw_queues = min(dev->nr_hw_queues, nr_cpu_ids);
+	dev->nr_read_queues = min(params->nr_read_queues, nr_cpu_ids);
+	dev->nr_poll_queues = min(params->nr_poll_queues, nr_cpu_ids);
+	dev->queue_depth = clamp_t(unsigned int, params->queue_depth, 1, BLK_MQ_MAX_DEPTH);
+	pr_info("%u default, %u read, %u poll hw queue(s), queue depth %u\n",
+		dev->nr_hw_queues, dev->nr_read_queues, dev->nr_poll_queues,
+		dev->queue_depth);
+	dev->profile = params->profile;
+	/* The backing file has latencies of its own */
+	dev->emulate = !dev->backing_file && sblkdev_profile_active(&dev->profile);
+	atomic64_set(&dev->busy_until_ns, 0);
+	if (dev->emulate)
+		pr_info("emulating latency %llu ns (+%llu ns jitter), %llu bytes/s, %u IOPS\n",
+			dev->profile.latency_ns, dev->profile.jitter_ns,
+			dev->profile.bw_limit, dev->profile.iops_limit);
+	dev->qos = params->qos;
+	dev->throttle = !dev->backing_file && sblkdev_qos_active(&dev->qos);
+	sblkdev_qos_reset(&dev->bucket);
+	if (dev->throttle)
+		pr_info("throttled to %llu bytes/s, %u IOPS; per hw queue %llu bytes/s, %u IOPS\n",
+			dev->qos.bw_limit, dev->qos.iops_limit,
+			dev->qos.hctx_bw_limit, dev->qos.hctx_iops_limit);
 	ret = init_tag_set(&dev->tag_set, dev);
 	if (ret) {
 		pr_err("Failed to allocate tag set\n");
-		goto fail_kvfree;
+		goto fail_kfree;
 	}
 
 	/*--- Block driver Init step 3 - allocate the disk
@@ -403,7 +1346,7 @@ struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
 	 * If < 5.14 we have our own implementation of this func,
 	 *  my_blk_mq_alloc_disk()
 	 */
-	disk = blk_mq_alloc_disk(&dev->tag_set, NULL, dev);
+	disk = blk_mq_alloc_disk(&dev->tag_set, &lim, dev);
 	if (unlikely(!disk)) {
 		ret = -ENOMEM;
 		pr_err("Failed to allocate disk (1)\n");
@@ -421,11 +1364,17 @@ struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
 	 * the same behavior as above via init_tag_set(), blk_mq_init_queue() &
 	 * alloc_disk()
 	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	disk = blk_alloc_disk(&lim, NUMA_NO_NODE);
+	if (IS_ERR(disk))
+		disk = NULL;
+#else
 	disk = blk_alloc_disk(NUMA_NO_NODE);
+#endif
 	if (!disk) {
 		pr_err("Failed to allocate disk\n");
 		ret = -ENOMEM;
-		goto fail_kvfree;
+		goto fail_kfree;
 	}
 #endif
 
@@ -458,25 +1407,52 @@ struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
 	snprintf(disk->disk_name, DISK_NAME_LEN, "%s", name);
 	set_capacity(disk, dev->capacity);
 
-#ifdef CONFIG_SBLKDEV_BLOCK_SIZE
-	// true: set to 512
-	blk_queue_physical_block_size(disk->queue, CONFIG_SBLKDEV_BLOCK_SIZE);
-	blk_queue_logical_block_size(disk->queue, CONFIG_SBLKDEV_BLOCK_SIZE);
-	blk_queue_io_min(disk->queue, CONFIG_SBLKDEV_BLOCK_SIZE);
-	blk_queue_io_opt(disk->queue, CONFIG_SBLKDEV_BLOCK_SIZE);
-#else
-	queue_physical_block_size(disk->queue);
-	//blk_queue_physical_block_size(disk->queue, SECTOR_SIZE);  // not on 6.14?
-	queue_logical_block_size(disk->queue);
-	//blk_queue_logical_block_size(disk->queue, SECTOR_SIZE);   // not on 6.14?
+	/* The block sizes and I/O sizes came with the queue_limits, above */
+	if (!params->merges)
+		blk_queue_flag_set(QUEUE_FLAG_NOMERGES, disk->queue);
+#if defined(CONFIG_SBLKDEV_REQUESTS_BASED) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+	/* Before 6.11, the write cache isn't a queue_limits feature yet */
+	if (dev->backing_file)
+		blk_queue_write_cache(disk->queue, true, dev->cache != NULL);
 #endif
-	blk_queue_flag_set(QUEUE_FLAG_NOMERGES, disk->queue);
+	pr_info("%u byte blocks, I/O up to %u KiB, merges %s\n",
+		queue_logical_block_size(disk->queue),
+		queue_max_hw_sectors(disk->queue) >> 1,
+		params->merges ? "on" : "off");
+
+	ret = sblkdev_zoned_register(dev);
+	if (ret) {
+		pr_err("Failed to register zones\n");
+		goto fail_put_disk;
+	}
+
+	ret = sblkdev_dax_register(dev);
+	if (ret) {
+		pr_err("Failed to set up DAX\n");
+		goto fail_put_disk;
+	}
+
+	ret = sblkdev_image_load(dev);
+	if (ret)
+		goto fail_put_disk;
+
+	ret = sblkdev_mem_register(dev, params);
+	if (ret) {
+		pr_err("Failed to add the memory char device\n");
+		goto fail_put_disk;
+	}
+
+	ret = sblkdev_stats_init(dev);
+	if (ret) {
+		pr_err("Failed to allocate stats\n");
+		goto fail_put_disk;
+	}
 
 #ifdef HAVE_ADD_DISK_RESULT
 	ret = add_disk(disk);
 	if (ret) {
 		pr_err("Failed to add disk '%s'\n", disk->disk_name);
-		goto fail_put_disk;
+		goto fail_free_stats;
 	}
 #else
 	add_disk(disk);
@@ -490,7 +1466,12 @@ struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
 	return dev;
 
 #ifdef HAVE_ADD_DISK_RESULT
+fail_free_stats:
+#endif
+	sblkdev_stats_free(dev);
 fail_put_disk:
+	sblkdev_mem_unregister(dev);
+	sblkdev_dax_unregister(dev);
 #ifdef HAVE_BLK_MQ_ALLOC_DISK
 #ifdef HAVE_BLK_CLEANUP_DISK
 	blk_cleanup_disk(dev->disk);
@@ -501,15 +1482,18 @@ fail_put_disk:
 	blk_cleanup_queue(dev->queue);
 	put_disk(dev->disk);
 #endif
-#endif /* HAVE_ADD_DISK_RESULT */
 
 #ifdef CONFIG_SBLKDEV_REQUESTS_BASED
 fail_free_tag_set:
 	blk_mq_free_tag_set(&dev->tag_set);
 #endif
-fail_kvfree:
-	kvfree(dev->data);
 fail_kfree:
+	sblkdev_backing_close(dev);
+	sblkdev_zoned_free(dev);
+	sblkdev_range_free(dev);
+	sblkdev_store_free(&dev->store);
+fail_free_image:
+	sblkdev_image_free(dev);
 	kfree(dev);
 fail:
 	pr_err("Failed to add block device\n");
@@ -5,18 +5,361 @@
 #include <linux/device.h>
 #include <linux/blk-mq.h>
 #include <linux/list.h>
+#include <linux/hrtimer.h>
+#include <linux/timerqueue.h>
+#include <linux/workqueue.h>
+#include <linux/fs.h>
+#include <linux/version.h>
 #include "convenient.h"
+#include "store.h"
+#include "stats.h"
+
+/*
+ * Media emulation profile: makes a device behave like slower storage. All
+ * zero (the default) means requests complete as soon as the copy is done.
+ */
+struct sblkdev_profile {
+	u64 latency_ns;			/* Fixed per-IO latency */
+	u64 jitter_ns;			/* Plus a uniformly distributed [0, jitter) */
+	u64 bw_limit;			/* Bytes per second; 0: unlimited */
+	u32 iops_limit;			/* IOs per second; 0: unlimited */
+};
+
+/*
+ * I/O throttling, see qos.c: token buckets for the whole device and for each
+ * hw queue. All zero (the default) means no limit.
+ */
+struct sblkdev_qos {
+	u64 bw_limit;			/* Bytes per second; 0: unlimited */
+	u32 iops_limit;			/* IOs per second; 0: unlimited */
+	u64 hctx_bw_limit;		/* The same, per hw queue */
+	u32 hctx_iops_limit;
+	u64 burst_ns;			/* Unused budget saved up, at most */
+};
+
+/* A token bucket per limit, each kept as the time it's even at (see qos.c) */
+struct sblkdev_bucket {
+	atomic64_t iops_tat;
+	atomic64_t bw_tat;
+};
+
+/*
+ * Per-device settings; parsed from the 'catalog' module parameter (see main.c)
+ * and handed to sblkdev_add().
+ */
+struct sblkdev_params {
+	sector_t capacity;		/* Device size in sectors */
+	unsigned int nr_hw_queues;	/* 0: one hw queue per online CPU */
+	unsigned int queue_depth;	/* Tags per hw queue */
+	unsigned int nr_read_queues;	/* Separate hw queues for reads */
+	unsigned int nr_poll_queues;	/* Polled (HCTX_TYPE_POLL) hw queues */
+	unsigned int block_size;	/* Logical block size; 0: 512 bytes */
+	unsigned int max_io_kb;		/* Largest request; 0: the block layer default */
+	bool merges;			/* Let the block layer merge requests */
+	struct sblkdev_profile profile;	/* Request-based only */
+	struct sblkdev_qos qos;		/* Likewise */
+	/* Host-managed zoned emulation; request-based only */
+	bool zoned;
+	sector_t zone_sectors;		/* Zone size, a power of 2 */
+	sector_t zone_capacity;		/* Writable sectors per zone; 0: zone size */
+	unsigned int zone_max_open;	/* 0: no limit */
+	unsigned int zone_max_active;	/* 0: no limit */
+	const char *comp_alg;		/* Keep the pages compressed with it */
+	bool dedup;			/* Share pages with the same content */
+	unsigned int chunk_kb;		/* Allocate memory in chunks this large */
+	/* Request-based only: keep the data in this file instead of in RAM */
+	const char *backing_file;
+	bool writeback;			/* ... with the RAM as a write-back cache */
+	unsigned int wb_workers;	/* Its writeback workers; 0: the default */
+	/* A copy-on-write snapshot of this device; it has no data of its own */
+	struct sblkdev_device *origin;
+	bool dax;			/* Filesystems may map the memory directly */
+	/* NUMA placement of the store's pages */
+	enum sblkdev_numa_policy numa_policy;
+	int numa_node;			/* SBLKDEV_NUMA_BIND */
+	unsigned int numa_stripe_kb;	/* SBLKDEV_NUMA_INTERLEAVE */
+	const char *image;		/* Loaded when added, saved when removed */
+	bool mem;			/* Companion char device mapping the RAM */
+};
+
+/* Range locks, see rangelock.c: 64 KiB regions over 256 stripes */
+#define SBLKDEV_RANGE_SHIFT	16
+#define SBLKDEV_RANGE_STRIPES	256
+
+/* A locked range of the device; len 0: none */
+struct sblkdev_range {
+	loff_t pos;
+	unsigned int len;
+	bool write;
+	u64 start_ns;			/* When it was locked, for the hold time */
+};
+
+struct sblkdev_zone;
+struct sblkdev_cache;
+struct sblkdev_range_stripe;
+struct sblkdev_mem;
+struct dax_device;
 
 struct sblkdev_device {
 	struct list_head link;
 	sector_t capacity;		/* Device size in sectors */
-	u8 *data;			/* The data in virtual memory */
+	struct sblkdev_store store;	/* The data: sparse pages in RAM */
+	struct sblkdev_stats __percpu *stats;
+	struct dentry *debugfs_dir;
+	struct sblkdev_range_stripe *ranges; /* Range locks, see rangelock.c */
 #ifdef CONFIG_SBLKDEV_REQUESTS_BASED
 	struct blk_mq_tag_set tag_set;
+	unsigned int nr_hw_queues;	/* HCTX_TYPE_DEFAULT queues */
+	unsigned int nr_read_queues;	/* HCTX_TYPE_READ queues */
+	unsigned int nr_poll_queues;	/* HCTX_TYPE_POLL queues */
+	unsigned int queue_depth;
+	struct sblkdev_profile profile;
+	bool emulate;			/* Profile is not all zero */
+	atomic64_t busy_until_ns;	/* Emulated bandwidth/IOPS timeline */
+	struct sblkdev_qos qos;
+	bool throttle;			/* Some limit is set */
+	struct sblkdev_bucket bucket;	/* The device-wide limits */
+	/* Zoned emulation, see zoned.c */
+	struct sblkdev_zone *zones;
+	unsigned int nr_zones;
+	sector_t zone_sectors;
+	sector_t zone_capacity;
+	unsigned int zone_max_open;
+	unsigned int zone_max_active;
+	spinlock_t zone_res_lock;	/* Protects the two counts below */
+	unsigned int zone_nr_open;	/* Implicitly or explicitly open zones */
+	unsigned int zone_nr_active;	/* Open or closed zones */
+	/* File-backed mode, see backing.c */
+	struct file *backing_file;	/* NULL: the data is in the store */
+	struct workqueue_struct *backing_wq;
+	struct sblkdev_cache *cache;	/* Write-back cache mode, see cache.c */
 #endif
+	bool zoned;
+	struct dax_device *dax_dev;	/* DAX, see dax.c; NULL: none */
+	char *image;			/* Image file, see image.c; NULL: none */
+	loff_t image_size;		/* Its size when last loaded or saved */
+	struct sblkdev_mem *mem;	/* Char device, see mem.c; NULL: none */
 	struct gendisk *disk;
 };
 
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+/*
+ * Per hardware queue context; hctx->driver_data points here. Allocated on the
+ * NUMA node of the CPUs that map to the hctx.
+ */
+struct sblkdev_queue {
+	struct sblkdev_device *dev;
+	unsigned int hctx_idx;
+	spinlock_t poll_lock;		/* Protects poll_list */
+	struct list_head poll_list;	/* Requests waiting for ->poll() */
+	struct sblkdev_bucket bucket;	/* The per hw queue limits */
+	/* Completions delayed by media emulation or throttling */
+	spinlock_t timer_lock;		/* Protects pending */
+	struct timerqueue_head pending;	/* Requests by emulated completion time */
+	struct hrtimer timer;		/* Fires at the earliest one */
+};
+
+/* Back-off before retrying a request that found no memory, whatever for */
+#define SBLKDEV_REQUEUE_DELAY_MS	3
+
+/* Per request driver data (the tag set's cmd_size) */
+struct sblkdev_cmd {
+	struct timerqueue_node node;	/* Emulated or throttled completion time */
+	blk_status_t status;
+	u64 start_ns;			/* For the latency histograms */
+	/* File-backed mode */
+	struct work_struct work;
+	struct kiocb iocb;
+	struct bio_vec *bvec;		/* Gathered from a multi-bio request */
+	atomic_t ref;			/* Submitter and kiocb completion */
+	struct sblkdev_range range;	/* Held from dispatch until copied */
+};
+
+blk_status_t sblkdev_transfer(struct sblkdev_device *dev, struct request *rq,
+			      loff_t pos, unsigned int *nr_bytes);
+
+int sblkdev_backing_open(struct sblkdev_device *dev, const struct sblkdev_params *params,
+			 struct queue_limits *lim);
+void sblkdev_backing_close(struct sblkdev_device *dev);
+void sblkdev_backing_queue(struct request *rq);
+int sblkdev_backing_discard(struct sblkdev_device *dev, struct request *rq);
+
+int sblkdev_cache_init(struct sblkdev_device *dev, const struct sblkdev_params *params,
+		       struct queue_limits *lim);
+void sblkdev_cache_free(struct sblkdev_device *dev);
+void sblkdev_cache_queue(struct request *rq);
+void sblkdev_cache_show(struct sblkdev_device *dev, struct seq_file *m);
+
+bool sblkdev_qos_active(const struct sblkdev_qos *qos);
+void sblkdev_qos_reset(struct sblkdev_bucket *bucket);
+u64 sblkdev_qos_release(struct sblkdev_queue *sq, struct request *rq);
+#else
+static inline int sblkdev_backing_open(struct sblkdev_device *dev,
+				       const struct sblkdev_params *params,
+				       struct queue_limits *lim)
+{
+	return params->backing_file ? -EOPNOTSUPP : 0;
+}
+static inline void sblkdev_backing_close(struct sblkdev_device *dev)
+{
+}
+static inline void sblkdev_cache_show(struct sblkdev_device *dev, struct seq_file *m)
+{
+}
+#endif
+
+/* Zoned emulation; the zoned queue limits are features from 6.11 on */
+#if defined(CONFIG_SBLKDEV_REQUESTS_BASED) && defined(CONFIG_BLK_DEV_ZONED) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+int sblkdev_zoned_init(struct sblkdev_device *dev, const struct sblkdev_params *params,
+		       struct queue_limits *lim);
+int sblkdev_zoned_register(struct sblkdev_device *dev);
+void sblkdev_zoned_free(struct sblkdev_device *dev);
+blk_status_t sblkdev_zoned_process(struct sblkdev_device *dev, struct request *rq,
+				   unsigned int *nr_bytes);
+int sblkdev_report_zones(struct gendisk *disk, sector_t sector,
+			 unsigned int nr_zones, report_zones_cb cb, void *data);
+#else
+static inline int sblkdev_zoned_init(struct sblkdev_device *dev,
+				     const struct sblkdev_params *params,
+				     struct queue_limits *lim)
+{
+	return params->zoned ? -EOPNOTSUPP : 0;
+}
+static inline int sblkdev_zoned_register(struct sblkdev_device *dev)
+{
+	return 0;
+}
+static inline void sblkdev_zoned_free(struct sblkdev_device *dev)
+{
+}
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+static inline blk_status_t sblkdev_zoned_process(struct sblkdev_device *dev,
+						 struct request *rq,
+						 unsigned int *nr_bytes)
+{
+	return BLK_STS_NOTSUPP;
+}
+#endif
+#define sblkdev_report_zones NULL
+#endif
+
+/*
+ * DAX; from 6.15 on, fs-dax refcounts the pages it maps, which only works for
+ * ZONE_DEVICE memory, not for pages from the page allocator.
+ */
+#if IS_ENABLED(CONFIG_DAX) && LINUX_VERSION_CODE < KERNEL_VERSION(6, 15, 0)
+int sblkdev_dax_init(struct sblkdev_device *dev, const struct sblkdev_params *params,
+		     struct queue_limits *lim);
+int sblkdev_dax_register(struct sblkdev_device *dev);
+void sblkdev_dax_unregister(struct sblkdev_device *dev);
+#else
+static inline int sblkdev_dax_init(struct sblkdev_device *dev,
+				   const struct sblkdev_params *params,
+				   struct queue_limits *lim)
+{
+	return params->dax ? -EOPNOTSUPP : 0;
+}
+static inline int sblkdev_dax_register(struct sblkdev_device *dev)
+{
+	return 0;
+}
+static inline void sblkdev_dax_unregister(struct sblkdev_device *dev)
+{
+}
+#endif
+
+int sblkdev_range_init(struct sblkdev_device *dev);
+void sblkdev_range_free(struct sblkdev_device *dev);
+bool sblkdev_range_trylock(struct sblkdev_device *dev, struct sblkdev_range *range,
+			   loff_t pos, unsigned int len, bool write);
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+bool sblkdev_range_trylock_rq(struct sblkdev_device *dev, struct sblkdev_range *range,
+			      loff_t pos, unsigned int len, bool write,
+			      struct request *rq);
+#endif
+void sblkdev_range_lock(struct sblkdev_device *dev, struct sblkdev_range *range,
+			loff_t pos, unsigned int len, bool write);
+void sblkdev_range_unlock(struct sblkdev_device *dev, struct sblkdev_range *range);
+
+int sblkdev_mem_register(struct sblkdev_device *dev, const struct sblkdev_params *params);
+void sblkdev_mem_unregister(struct sblkdev_device *dev);
+
+int sblkdev_image_init(struct sblkdev_device *dev, const struct sblkdev_params *params);
+int sblkdev_image_load(struct sblkdev_device *dev);
+int sblkdev_image_save(struct sblkdev_device *dev);
+void sblkdev_image_free(struct sblkdev_device *dev);
+
 struct sblkdev_device *sblkdev_add(int major, int minor, char *name,
-				  sector_t capacity);
+				  const struct sblkdev_params *params);
 void sblkdev_remove(struct sblkdev_device *dev);
+
+/* Runtime changes to a live device */
+int sblkdev_resize(struct sblkdev_device *dev, sector_t capacity);
+int sblkdev_set_block_size(struct sblkdev_device *dev, unsigned int block_size);
+int sblkdev_save(struct sblkdev_device *dev);
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+int sblkdev_set_hw_queues(struct sblkdev_device *dev, unsigned int nr);
+int sblkdev_set_profile(struct sblkdev_device *dev, const struct sblkdev_profile *profile);
+int sblkdev_set_qos(struct sblkdev_device *dev, const struct sblkdev_qos *qos);
+#else
+static inline int sblkdev_set_hw_queues(struct sblkdev_device *dev, unsigned int nr)
+{
+	return -EOPNOTSUPP;
+}
+static inline int sblkdev_set_profile(struct sblkdev_device *dev,
+				      const struct sblkdev_profile *profile)
+{
+	return -EOPNOTSUPP;
+}
+static inline int sblkdev_set_qos(struct sblkdev_device *dev, const struct sblkdev_qos *qos)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+/* The set of devices, see main.c */
+int sblkdev_parse_option(struct sblkdev_params *params, char *option);
+int sblkdev_create(char *entry);
+int sblkdev_destroy(const char *name);
+struct sblkdev_device *sblkdev_lock_device(const char *name);
+void sblkdev_unlock_devices(void);
+
+/* The control plane, see configfs.c */
+#if IS_ENABLED(CONFIG_CONFIGFS_FS)
+int sblkdev_configfs_init(void);
+void sblkdev_configfs_exit(void);
+#else
+static inline int sblkdev_configfs_init(void)
+{
+	return 0;
+}
+static inline void sblkdev_configfs_exit(void)
+{
+}
+#endif
+
+/*
+ * Parallel copy offload, see parcopy.c: I/Os of at least 'par_copy_kb' (0:
+ * never) are copied by per-CPU workers, 'par_chunk_kb' each (main.c).
+ */
+extern unsigned int sblkdev_par_copy_kb;
+extern unsigned int sblkdev_par_chunk_kb;
+
+static inline bool sblkdev_par_wanted(unsigned int bytes)
+{
+	unsigned int threshold_kb = READ_ONCE(sblkdev_par_copy_kb);
+
+	return threshold_kb && bytes >= (u64)threshold_kb * SZ_1K;
+}
+
+typedef void (*sblkdev_par_done_t)(void *data, blk_status_t status);
+
+int sblkdev_par_copy(struct sblkdev_device *dev, struct bio *bio, loff_t pos,
+		     unsigned int bytes, bool write, gfp_t gfp,
+		     sblkdev_par_done_t done, void *data);
+int sblkdev_par_copy_sync(struct sblkdev_device *dev, struct bio *bio, loff_t pos,
+			  unsigned int bytes, bool write, gfp_t gfp,
+			  blk_status_t *status);
+int sblkdev_par_init(void);
+void sblkdev_par_exit(void);
@@ -0,0 +1,398 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Images ('image=<path>'): a RAM device is filled from a file when it's added,
+ * and written back to it when it's removed (or on demand, see 'save' in
+ * main.c), so that its content survives a module reload.
+ *
+ * Both ways, the image is cut in SBLKDEV_IMAGE_CHUNK chunks that a few workers
+ * take in turn, each with a buffer of its own, so that several reads (or
+ * writes) of the file and copies are underway at once. Pages of zeroes are
+ * skipped: not written to the store on load, left as holes in the file on
+ * save.
+ *
+ * A save goes to '<image>.tmp', which is synced and only then renamed over the
+ * image: a save that fails half way leaves the previous image as it was.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include "device.h"
+
+#define SBLKDEV_IMAGE_CHUNK	SZ_4M
+#define SBLKDEV_IMAGE_WORKERS	8
+
+struct sblkdev_image_job {
+	struct sblkdev_device *dev;
+	struct file *file;
+	loff_t size;			/* Bytes to move */
+	bool save;
+	atomic64_t next;		/* The next chunk to take */
+	atomic64_t bytes;		/* Moved, zeroes excluded */
+	int error;			/* The first one, if any */
+};
+
+struct sblkdev_image_worker {
+	struct work_struct work;
+	struct sblkdev_image_job *job;
+};
+
+/*
+ * The next run of pages with data in them in @buf, [@*start, @*end), from
+ * @*start on. Returns false if there's none left.
+ */
+static bool sblkdev_image_next_run(const void *buf, size_t len, size_t *start, size_t *end)
+{
+	size_t off = *start;
+
+	while (off < len && !memchr_inv(buf + off, 0, min_t(size_t, PAGE_SIZE, len - off)))
+		off += PAGE_SIZE;
+	if (off >= len)
+		return false;
+
+	*start = off;
+	while (off < len && memchr_inv(buf + off, 0, min_t(size_t, PAGE_SIZE, len - off)))
+		off += PAGE_SIZE;
+	*end = min(off, len);
+	return true;
+}
+
+/* All of [@pos, @pos + @len) of the file; past its end reads as zeroes */
+static int sblkdev_image_read(struct file *file, void *buf, loff_t pos, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = kernel_read(file, buf + done, len - done, &pos);
+
+		if (ret < 0)
+			return ret;
+		if (!ret) {
+			memset(buf + done, 0, len - done);
+			break;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+static int sblkdev_image_write(struct file *file, const void *buf, loff_t pos, size_t len)
+{
+	while (len) {
+		ssize_t ret = kernel_write(file, buf, len, &pos);
+
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EIO;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int sblkdev_image_chunk(struct sblkdev_image_job *job, void *buf, loff_t pos, size_t len)
+{
+	struct sblkdev_store *store = &job->dev->store;
+	size_t start = 0, end;
+	bool nt = !job->save && sblkdev_store_nt(len);
+	int ret;
+
+	if (job->save)
+		ret = sblkdev_store_read(store, buf, pos, len);
+	else
+		ret = sblkdev_image_read(job->file, buf, pos, len);
+	if (ret)
+		return ret;
+
+	for (; sblkdev_image_next_run(buf, len, &start, &end); start = end) {
+		if (job->save)
+			ret = sblkdev_image_write(job->file, buf + start, pos + start,
+						  end - start);
+		else
+			ret = sblkdev_store_write(store, buf + start, pos + start,
+						  end - start, GFP_KERNEL, nt);
+		if (ret)
+			break;
+		atomic64_add(end - start, &job->bytes);
+	}
+	sblkdev_store_nt_fence(nt);
+	return ret;
+}
+
+static void sblkdev_image_work(struct work_struct *work)
+{
+	struct sblkdev_image_worker *worker =
+		container_of(work, struct sblkdev_image_worker, work);
+	struct sblkdev_image_job *job = worker->job;
+	unsigned int noio_flags;
+	void *buf;
+	int ret = 0;
+
+	/*
+	 * A save runs with the device's queue frozen, and the workers don't
+	 * inherit the freezer's noio scope: reclaim writing back to a
+	 * filesystem on the device would wait on the save, which waits on us.
+	 */
+	noio_flags = memalloc_noio_save();
+	buf = kvmalloc(SBLKDEV_IMAGE_CHUNK, GFP_KERNEL);
+	if (!buf) {
+		cmpxchg(&job->error, 0, -ENOMEM);
+		goto out;
+	}
+
+	while (!ret && !READ_ONCE(job->error)) {
+		loff_t pos = atomic64_fetch_add(SBLKDEV_IMAGE_CHUNK, &job->next);
+
+		if (pos >= job->size)
+			break;
+		ret = sblkdev_image_chunk(job, buf, pos,
+					  min_t(loff_t, SBLKDEV_IMAGE_CHUNK, job->size - pos));
+	}
+	if (ret)
+		cmpxchg(&job->error, 0, ret);
+	kvfree(buf);
+out:
+	memalloc_noio_restore(noio_flags);
+}
+
+/* Move the data with up to SBLKDEV_IMAGE_WORKERS workers, and wait for them */
+static int sblkdev_image_run(struct sblkdev_image_job *job)
+{
+	unsigned int i, nr = min3(num_online_cpus(), (unsigned int)SBLKDEV_IMAGE_WORKERS,
+				  (unsigned int)DIV_ROUND_UP_ULL(job->size, SBLKDEV_IMAGE_CHUNK));
+	struct sblkdev_image_worker *workers;
+	u64 start_ns = ktime_get_ns();
+
+	if (!nr)
+		return 0;
+	workers = kcalloc(nr, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+
+	atomic64_set(&job->next, 0);
+	atomic64_set(&job->bytes, 0);
+	job->error = 0;
+	for (i = 0; i < nr; i++) {
+		workers[i].job = job;
+		INIT_WORK(&workers[i].work, sblkdev_image_work);
+		queue_work(system_unbound_wq, &workers[i].work);
+	}
+	for (i = 0; i < nr; i++)
+		flush_work(&workers[i].work);
+	kfree(workers);
+
+	if (!job->error)
+		pr_info("'%s': %s %llu MiB of data in %llu ms\n", job->dev->disk->disk_name,
+			job->save ? "saved" : "loaded", atomic64_read(&job->bytes) >> 20,
+			div_u64(ktime_get_ns() - start_ns, NSEC_PER_MSEC));
+	return job->error;
+}
+
+/*
+ * sblkdev_image_init() - Check the settings for an image, and size the device
+ * A capacity of 0 takes the image's size; the image may not exist yet, in
+ * which case the device starts out empty. Before the store is set up.
+ */
+int sblkdev_image_init(struct sblkdev_device *dev, const struct sblkdev_params *params)
+{
+	struct file *file;
+
+	if (!params->image)
+		return 0;
+
+	if (params->zoned || params->backing_file || params->origin) {
+		pr_err("An image is for RAM devices only, not zoned nor snapshots\n");
+		return -EINVAL;
+	}
+	dev->image = kstrdup(params->image, GFP_KERNEL);
+	if (!dev->image)
+		return -ENOMEM;
+
+	file = filp_open(dev->image, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		if (PTR_ERR(file) == -ENOENT && dev->capacity)
+			return 0;
+		pr_err("Can't open image '%s': %ld\n", dev->image, PTR_ERR(file));
+		return PTR_ERR(file);
+	}
+	dev->image_size = i_size_read(file_inode(file));
+	fput(file);
+
+	if (!dev->capacity)
+		dev->capacity = dev->image_size >> SECTOR_SHIFT;
+	if (!dev->capacity)
+		return -EINVAL;
+	if (dev->image_size > ((loff_t)dev->capacity << SECTOR_SHIFT))
+		pr_warn("Image '%s' is larger than the device: only its start is loaded\n",
+			dev->image);
+	return 0;
+}
+
+/*
+ * sblkdev_image_load() - Fill the store from the image, if there's one yet
+ * Before the disk is added: nothing else touches the store.
+ */
+int sblkdev_image_load(struct sblkdev_device *dev)
+{
+	struct sblkdev_image_job job = {
+		.dev = dev,
+		.size = min_t(loff_t, dev->image_size, (loff_t)dev->capacity << SECTOR_SHIFT),
+	};
+	int ret;
+
+	if (!dev->image || !job.size)
+		return 0;
+
+	job.file = filp_open(dev->image, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(job.file))
+		return PTR_ERR(job.file);
+	ret = sblkdev_image_run(&job);
+	fput(job.file);
+	if (ret)
+		pr_err("Failed to load image '%s': %d\n", dev->image, ret);
+	return ret;
+}
+
+/* Rename @tmp to @name, in the same directory; replaces what's there */
+static int sblkdev_image_rename(struct file *tmp, const char *name)
+{
+	struct dentry *dentry = tmp->f_path.dentry;
+	struct dentry *dir = dget_parent(dentry);
+	struct dentry *target;
+	int ret;
+
+	ret = mnt_want_write(tmp->f_path.mnt);
+	if (ret)
+		goto out;
+
+	/* The same directory: only it is locked, and there's no trap */
+	lock_rename(dir, dir);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+	target = lookup_noperm(&(struct qstr)QSTR_INIT(name, strlen(name)), dir);
+#else
+	target = lookup_one_len(name, dir, strlen(name));
+#endif
+	if (IS_ERR(target)) {
+		ret = PTR_ERR(target);
+	} else if (dentry->d_parent != dir || d_unhashed(dentry)) {
+		ret = -ENOENT;		/* Moved or removed meanwhile */
+		dput(target);
+	} else {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		struct renamedata rd = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+			.mnt_idmap = file_mnt_idmap(tmp),
+			.old_parent = dir,
+			.new_parent = dir,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+			.old_mnt_idmap = file_mnt_idmap(tmp),
+			.old_dir = d_inode(dir),
+			.new_mnt_idmap = file_mnt_idmap(tmp),
+			.new_dir = d_inode(dir),
+#else
+			.old_mnt_userns = file_mnt_user_ns(tmp),
+			.old_dir = d_inode(dir),
+			.new_mnt_userns = file_mnt_user_ns(tmp),
+			.new_dir = d_inode(dir),
+#endif
+			.old_dentry = dentry,
+			.new_dentry = target,
+		};
+
+		ret = vfs_rename(&rd);
+#else
+		ret = vfs_rename(d_inode(dir), dentry, d_inode(dir), target, NULL, 0);
+#endif
+		dput(target);
+	}
+	unlock_rename(dir, dir);
+	mnt_drop_write(tmp->f_path.mnt);
+out:
+	dput(dir);
+	return ret;
+}
+
+/* Remove @tmp, what's left of a failed save, if it's still where it was */
+static void sblkdev_image_unlink(struct file *tmp)
+{
+	struct dentry *dentry = tmp->f_path.dentry;
+	struct dentry *dir = dget_parent(dentry);
+
+	if (mnt_want_write(tmp->f_path.mnt))
+		goto out;
+
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+	if (dentry->d_parent == dir && !d_unhashed(dentry))
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+		vfs_unlink(file_mnt_idmap(tmp), d_inode(dir), dentry, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		vfs_unlink(file_mnt_user_ns(tmp), d_inode(dir), dentry, NULL);
+#else
+		vfs_unlink(d_inode(dir), dentry, NULL);
+#endif
+	inode_unlock(d_inode(dir));
+	mnt_drop_write(tmp->f_path.mnt);
+out:
+	dput(dir);
+}
+
+/*
+ * sblkdev_image_save() - Write the device's content out to its image
+ * The whole image is rewritten, with holes for the zeroes, into a temporary
+ * file, synced, then renamed over the image; on failure, the temporary file
+ * is removed and the image is left as it was. The caller keeps I/O off the device meanwhile (see sblkdev_save()).
+ */
+int sblkdev_image_save(struct sblkdev_device *dev)
+{
+	struct sblkdev_image_job job = {
+		.dev = dev,
+		.size = (loff_t)dev->capacity << SECTOR_SHIFT,
+		.save = true,
+	};
+	char *tmp;
+	int ret;
+
+	if (!dev->image)
+		return -ENOENT;
+
+	tmp = kasprintf(GFP_KERNEL, "%s.tmp", dev->image);
+	if (!tmp)
+		return -ENOMEM;
+	job.file = filp_open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+	if (IS_ERR(job.file)) {
+		pr_err("Can't open '%s': %ld\n", tmp, PTR_ERR(job.file));
+		kfree(tmp);
+		return PTR_ERR(job.file);
+	}
+
+	ret = sblkdev_image_run(&job);
+	/* The zeroes at the end are holes too */
+	if (!ret)
+		ret = vfs_truncate(&job.file->f_path, job.size);
+	if (!ret)
+		ret = vfs_fsync(job.file, 0);
+	if (!ret)
+		ret = sblkdev_image_rename(job.file, kbasename(dev->image));
+	if (ret)
+		sblkdev_image_unlink(job.file);
+	fput(job.file);
+
+	if (ret)
+		pr_err("Failed to save image '%s', kept as it was: %d\n", dev->image, ret);
+	else
+		dev->image_size = job.size;
+	kfree(tmp);
+	return ret;
+}
+
+void sblkdev_image_free(struct sblkdev_device *dev)
+{
+	kfree(dev->image);
+	dev->image = NULL;
+}
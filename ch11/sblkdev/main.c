@@ -15,6 +15,10 @@
 // TODO : use resource managed devm_* APIs for better error handling and cleanup
 
 #include <linux/module.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/sizes.h>
 #include "device.h"
 
 /* Ref: GCC diagnostic pragmas:
@@ -56,14 +60,396 @@
  * A module can create more than one block device.
  * The configuration of block devices is implemented in the simplest way:
  * using the module parameter, which is passed when the module is loaded.
+ * Each entry may be followed by optional per-device '<key>=<value>' settings.
  * Example:
- *    modprobe sblkdev catalog="sblkdev1,4096;sblkdev2,8192"
+ *    modprobe sblkdev catalog="sblkdev1,4096;sblkdev2,8192,hw_queues=4,queue_depth=256"
  */
 static int sblkdev_major;
+static int sblkdev_next_minor;
 static LIST_HEAD(sblkdev_device_list);
+static DEFINE_MUTEX(sblkdev_device_lock);	/* Protects the two above, and the devices */
 static char *sblkdev_catalog = "sblkdev1,4096;sblkdev2,8192";
 module_param_named(catalog, sblkdev_catalog, charp, 0644);
-MODULE_PARM_DESC(catalog, "New block devices catalog in format '<name>,<capacity sectors>;...'");
+MODULE_PARM_DESC(catalog, "New block devices catalog in format '<name>,<capacity sectors>[,<key>=<value>...];...'");
+
+/* Defaults for the per-device settings that a catalog entry may override */
+static unsigned int sblkdev_hw_queues;
+module_param_named(hw_queues, sblkdev_hw_queues, uint, 0444);
+MODULE_PARM_DESC(hw_queues, "Default number of hardware queues per device (0: one per online CPU)");
+
+static unsigned int sblkdev_queue_depth = 128;
+module_param_named(queue_depth, sblkdev_queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Default number of tags per hardware queue");
+
+static unsigned int sblkdev_read_queues;
+module_param_named(read_queues, sblkdev_read_queues, uint, 0444);
+MODULE_PARM_DESC(read_queues, "Default number of dedicated read hardware queues per device");
+
+static unsigned int sblkdev_poll_queues;
+module_param_named(poll_queues, sblkdev_poll_queues, uint, 0444);
+MODULE_PARM_DESC(poll_queues, "Default number of polled hardware queues per device (for io_uring hipri)");
+
+static unsigned int sblkdev_max_io_kb = 1024;
+module_param_named(max_io_kb, sblkdev_max_io_kb, uint, 0444);
+MODULE_PARM_DESC(max_io_kb, "Default largest request per device, in KiB");
+
+/* Can be changed at runtime, to compare the two copy strategies (see store.c) */
+unsigned int sblkdev_nt_copy_kb = 256;
+module_param_named(nt_copy_kb, sblkdev_nt_copy_kb, uint, 0644);
+MODULE_PARM_DESC(nt_copy_kb, "Copy writes of at least this many KiB with non-temporal stores (0: never)");
+
+/* Likewise, see parcopy.c */
+unsigned int sblkdev_par_copy_kb = 4096;
+module_param_named(par_copy_kb, sblkdev_par_copy_kb, uint, 0644);
+MODULE_PARM_DESC(par_copy_kb, "Copy I/Os of at least this many KiB on several CPUs (0: never)");
+
+unsigned int sblkdev_par_chunk_kb = 1024;
+module_param_named(par_chunk_kb, sblkdev_par_chunk_kb, uint, 0644);
+MODULE_PARM_DESC(par_chunk_kb, "Share of a parallel copy per CPU, in KiB");
+
+static struct sblkdev_device *sblkdev_find(const char *name)
+{
+	struct sblkdev_device *dev;
+
+	list_for_each_entry(dev, &sblkdev_device_list, link)
+		if (!strcmp(dev->disk->disk_name, name))
+			return dev;
+	return NULL;
+}
+
+/*
+ * *@val *= @unit: the profile, the limits and the zone sizes are given in
+ * handier units than they're kept in. Invalid if it won't fit.
+ */
+static int sblkdev_scale(u64 *val, u64 unit)
+{
+	return check_mul_overflow(*val, unit, val) ? -EINVAL : 0;
+}
+
+/*
+ * sblkdev_parse_option() - Apply one '<key>=<value>' catalog setting
+ */
+int sblkdev_parse_option(struct sblkdev_params *params, char *option)
+{
+	char *key = strsep(&option, "=");
+	int ret;
+
+	if (!option) {
+		pr_info("Missing value for catalog option '%s'\n", key);
+		return -EINVAL;
+	}
+
+	if (!strcmp(key, "hw_queues"))
+		ret = kstrtouint(option, 10, &params->nr_hw_queues);
+	else if (!strcmp(key, "queue_depth"))
+		ret = kstrtouint(option, 10, &params->queue_depth);
+	else if (!strcmp(key, "read_queues"))
+		ret = kstrtouint(option, 10, &params->nr_read_queues);
+	else if (!strcmp(key, "poll_queues"))
+		ret = kstrtouint(option, 10, &params->nr_poll_queues);
+	else if (!strcmp(key, "block_size")) {
+		ret = kstrtouint(option, 10, &params->block_size);
+		if (!ret && (!is_power_of_2(params->block_size) ||
+			     params->block_size < SECTOR_SIZE ||
+			     params->block_size > PAGE_SIZE))
+			ret = -EINVAL;
+	} else if (!strcmp(key, "max_io_kb")) {
+		ret = kstrtouint(option, 10, &params->max_io_kb);
+		/* At least a page, and no more sectors than a request can count */
+		if (!ret && params->max_io_kb &&
+		    ((u64)params->max_io_kb * SZ_1K < PAGE_SIZE ||
+		     params->max_io_kb > UINT_MAX >> 1))
+			ret = -EINVAL;
+	} else if (!strcmp(key, "merges"))
+		ret = kstrtobool(option, &params->merges);
+	else if (!strcmp(key, "latency_us")) {
+		ret = kstrtou64(option, 10, &params->profile.latency_ns);
+		if (!ret)
+			ret = sblkdev_scale(&params->profile.latency_ns, NSEC_PER_USEC);
+	} else if (!strcmp(key, "jitter_us")) {
+		ret = kstrtou64(option, 10, &params->profile.jitter_ns);
+		if (!ret)
+			ret = sblkdev_scale(&params->profile.jitter_ns, NSEC_PER_USEC);
+	} else if (!strcmp(key, "bw_mbps")) {
+		ret = kstrtou64(option, 10, &params->profile.bw_limit);
+		if (!ret)
+			ret = sblkdev_scale(&params->profile.bw_limit, SZ_1M);
+	} else if (!strcmp(key, "iops"))
+		ret = kstrtou32(option, 10, &params->profile.iops_limit);
+	else if (!strcmp(key, "qos_mbps")) {
+		ret = kstrtou64(option, 10, &params->qos.bw_limit);
+		if (!ret)
+			ret = sblkdev_scale(&params->qos.bw_limit, SZ_1M);
+	} else if (!strcmp(key, "qos_iops"))
+		ret = kstrtou32(option, 10, &params->qos.iops_limit);
+	else if (!strcmp(key, "qos_hctx_mbps")) {
+		ret = kstrtou64(option, 10, &params->qos.hctx_bw_limit);
+		if (!ret)
+			ret = sblkdev_scale(&params->qos.hctx_bw_limit, SZ_1M);
+	} else if (!strcmp(key, "qos_hctx_iops"))
+		ret = kstrtou32(option, 10, &params->qos.hctx_iops_limit);
+	else if (!strcmp(key, "qos_burst_ms")) {
+		ret = kstrtou64(option, 10, &params->qos.burst_ns);
+		if (!ret)
+			ret = sblkdev_scale(&params->qos.burst_ns, NSEC_PER_MSEC);
+	} else if (!strcmp(key, "zoned"))
+		ret = kstrtobool(option, &params->zoned);
+	else if (!strcmp(key, "zone_size_mb")) {
+		ret = kstrtou64(option, 10, &params->zone_sectors);
+		if (!ret)
+			ret = sblkdev_scale(&params->zone_sectors, SZ_1M >> SECTOR_SHIFT);
+	} else if (!strcmp(key, "zone_capacity_mb")) {
+		ret = kstrtou64(option, 10, &params->zone_capacity);
+		if (!ret)
+			ret = sblkdev_scale(&params->zone_capacity, SZ_1M >> SECTOR_SHIFT);
+	} else if (!strcmp(key, "zone_max_open"))
+		ret = kstrtouint(option, 10, &params->zone_max_open);
+	else if (!strcmp(key, "zone_max_active"))
+		ret = kstrtouint(option, 10, &params->zone_max_active);
+	else if (!strcmp(key, "file")) {
+		/* Points into the catalog copy, which outlives sblkdev_add() */
+		params->backing_file = option;
+		ret = *option ? 0 : -EINVAL;
+	} else if (!strcmp(key, "cache")) {
+		/* What the RAM is to the backing file */
+		params->writeback = !strcmp(option, "writeback");
+		ret = (params->writeback || !strcmp(option, "none")) ? 0 : -EINVAL;
+	} else if (!strcmp(key, "wb_workers")) {
+		ret = kstrtouint(option, 10, &params->wb_workers);
+	} else if (!strcmp(key, "chunk_kb")) {
+		ret = kstrtouint(option, 10, &params->chunk_kb);
+		/* A power of 2 number of pages */
+		if (!ret && params->chunk_kb &&
+		    (!is_power_of_2(params->chunk_kb) ||
+		     params->chunk_kb * SZ_1K < PAGE_SIZE))
+			ret = -EINVAL;
+	} else if (!strcmp(key, "dedup")) {
+		ret = kstrtobool(option, &params->dedup);
+	} else if (!strcmp(key, "dax")) {
+		ret = kstrtobool(option, &params->dax);
+	} else if (!strcmp(key, "mem")) {
+		ret = kstrtobool(option, &params->mem);
+	} else if (!strcmp(key, "numa")) {
+		/* 'local', 'interleave', or a node to bind to */
+		ret = 0;
+		if (!strcmp(option, "local"))
+			params->numa_policy = SBLKDEV_NUMA_LOCAL;
+		else if (!strcmp(option, "interleave"))
+			params->numa_policy = SBLKDEV_NUMA_INTERLEAVE;
+		else if (!kstrtoint(option, 10, &params->numa_node))
+			params->numa_policy = SBLKDEV_NUMA_BIND;
+		else
+			ret = -EINVAL;
+	} else if (!strcmp(key, "numa_stripe_kb")) {
+		ret = kstrtouint(option, 10, &params->numa_stripe_kb);
+		/* A power of 2 number of pages */
+		if (!ret && (!is_power_of_2(params->numa_stripe_kb) ||
+			     params->numa_stripe_kb * SZ_1K < PAGE_SIZE))
+			ret = -EINVAL;
+	} else if (!strcmp(key, "image")) {
+		/* Copied by sblkdev_add(): it's needed again on removal */
+		params->image = option;
+		ret = *option ? 0 : -EINVAL;
+	} else if (!strcmp(key, "compress")) {
+		params->comp_alg = option;
+		ret = *option ? 0 : -EINVAL;
+	} else if (!strcmp(key, "snapshot")) {
+		/* Of a device added before */
+		params->origin = sblkdev_find(option);
+		ret = params->origin ? 0 : -ENODEV;
+	} else
+		ret = -EINVAL;
+
+	if (ret)
+		pr_info("Invalid catalog option '%s=%s'\n", key, option);
+	return ret;
+}
+
+/*
+ * sblkdev_add_entry() - Add a device from one catalog entry
+ * '<name>,<capacity sectors>[,<key>=<value>...]'; an entry without a capacity
+ * is skipped. Called with sblkdev_device_lock held.
+ */
+static int sblkdev_add_entry(char *entry)
+{
+	struct sblkdev_device *dev;
+	struct sblkdev_params params = {
+		.nr_hw_queues = sblkdev_hw_queues,
+		.queue_depth = sblkdev_queue_depth,
+		.nr_read_queues = sblkdev_read_queues,
+		.nr_poll_queues = sblkdev_poll_queues,
+#ifdef CONFIG_SBLKDEV_BLOCK_SIZE
+		.block_size = CONFIG_SBLKDEV_BLOCK_SIZE,
+#endif
+		.max_io_kb = sblkdev_max_io_kb,
+		.merges = true,
+		.numa_stripe_kb = SZ_2M / SZ_1K,
+		.zone_sectors = SZ_256M >> SECTOR_SHIFT,
+	};
+	char *name;
+	char *capacity;
+	char *option;
+	int ret;
+
+	name = strsep(&entry, ",");
+	if (!name)
+		return 0;
+	capacity = strsep(&entry, ",");
+	if (!capacity)
+		return 0;
+
+	ret = kstrtoull(capacity, 10, &params.capacity);
+	if (ret)
+		return ret;
+
+	while ((option = strsep(&entry, ","))) {
+		ret = sblkdev_parse_option(&params, option);
+		if (ret)
+			return ret;
+	}
+
+	if (sblkdev_find(name)) {
+		pr_info("Device '%s' already exists\n", name);
+		return -EEXIST;
+	}
+
+	dev = sblkdev_add(sblkdev_major, sblkdev_next_minor, name, &params);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+
+	list_add(&dev->link, &sblkdev_device_list);
+	sblkdev_next_minor++;
+	return 0;
+}
+
+/*
+ * sblkdev_create() - Add a device, from a catalog entry, once loaded
+ */
+int sblkdev_create(char *entry)
+{
+	int ret;
+
+	mutex_lock(&sblkdev_device_lock);
+	ret = sblkdev_add_entry(entry);
+	mutex_unlock(&sblkdev_device_lock);
+	return ret;
+}
+
+/*
+ * sblkdev_destroy() - Remove a device once loaded
+ * Its snapshots, if any, stay: they keep the pages they share with it.
+ */
+int sblkdev_destroy(const char *name)
+{
+	struct sblkdev_device *dev;
+
+	mutex_lock(&sblkdev_device_lock);
+	dev = sblkdev_find(name);
+	if (dev) {
+		list_del(&dev->link);
+		sblkdev_remove(dev);
+	}
+	mutex_unlock(&sblkdev_device_lock);
+	return dev ? 0 : -ENODEV;
+}
+
+/*
+ * sblkdev_lock_device() - Find a device and keep it from going away
+ * Until sblkdev_unlock_devices(), which only a device found needs.
+ */
+struct sblkdev_device *sblkdev_lock_device(const char *name)
+{
+	struct sblkdev_device *dev;
+
+	mutex_lock(&sblkdev_device_lock);
+	dev = sblkdev_find(name);
+	if (!dev)
+		mutex_unlock(&sblkdev_device_lock);
+	return dev;
+}
+
+void sblkdev_unlock_devices(void)
+{
+	mutex_unlock(&sblkdev_device_lock);
+}
+
+static void sblkdev_remove_all(void)
+{
+	struct sblkdev_device *dev;
+
+	mutex_lock(&sblkdev_device_lock);
+	while ((dev = list_first_entry_or_null(&sblkdev_device_list,
+					       struct sblkdev_device, link))) {
+		list_del(&dev->link);
+		sblkdev_remove(dev);
+	}
+	mutex_unlock(&sblkdev_device_lock);
+}
+
+/*
+ * Devices can also be added once the module is loaded, one catalog entry at a
+ * time, e.g. a snapshot of a device that has been filled up since:
+ *    echo "clone1,0,snapshot=sblkdev1" > /sys/module/sblkdev/parameters/create
+ * See configfs.c for full control.
+ */
+static int sblkdev_create_set(const char *val, const struct kernel_param *kp)
+{
+	char *entry;
+	int ret;
+
+	/* Not while loading: the catalog comes first */
+	if (sblkdev_major <= 0)
+		return -ENODEV;
+
+	entry = kstrdup(val, GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+
+	ret = sblkdev_create(strim(entry));
+
+	kfree(entry);
+	return ret;
+}
+
+static const struct kernel_param_ops sblkdev_create_ops = {
+	.set = sblkdev_create_set,
+};
+module_param_cb(create, &sblkdev_create_ops, NULL, 0200);
+MODULE_PARM_DESC(create, "Add a device: '<name>,<capacity sectors>[,<key>=<value>...]'");
+
+/*
+ * A device with an image can be saved to it at any time, not only on removal,
+ * e.g. once a filesystem has been made on it:
+ *    echo sblkdev1 > /sys/module/sblkdev/parameters/save
+ * Its I/O is held off meanwhile.
+ */
+static int sblkdev_save_set(const char *val, const struct kernel_param *kp)
+{
+	struct sblkdev_device *dev;
+	char *name;
+	int ret;
+
+	name = kstrdup(val, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	dev = sblkdev_lock_device(strim(name));
+	if (dev) {
+		ret = sblkdev_save(dev);
+		sblkdev_unlock_devices();
+	} else {
+		ret = -ENODEV;
+	}
+
+	kfree(name);
+	return ret;
+}
+
+static const struct kernel_param_ops sblkdev_save_ops = {
+	.set = sblkdev_save_set,
+};
+module_param_cb(save, &sblkdev_save_ops, NULL, 0200);
+MODULE_PARM_DESC(save, "Write a device out to its image: '<name>'");
 
 /*
  * sblkdev_init() - Entry point 'init'.
@@ -75,7 +461,6 @@ MODULE_PARM_DESC(catalog, "New block devices catalog in format '<name>,<capacity
 static int __init sblkdev_init(void)
 {
 	int ret = 0;
-	int inx = 0;
 	char *catalog;
 	char *next_token;
 	char *token;
@@ -86,55 +471,56 @@ static int __init sblkdev_init(void)
 		pr_info("Unable to get major number\n");
 		return sblkdev_major;
 	}
+	sblkdev_debugfs_init();
+
+	ret = sblkdev_par_init();
+	if (ret) {
+		pr_info("Unable to create the copy workqueue\n");
+		goto fail_unregister;
+	}
+
+	ret = sblkdev_configfs_init();
+	if (ret) {
+		pr_info("Unable to register the configfs subsystem\n");
+		goto fail_par;
+	}
 
 	length = strlen(sblkdev_catalog);
 	if ((length < 1) || (length > PAGE_SIZE)) {
 		pr_info("Invalid module parameter 'catalog'\n");
 		ret = -EINVAL;
-		goto fail_unregister;
+		goto fail_configfs;
 	}
 
 	catalog = kzalloc(length + 1, GFP_KERNEL);
 	if (!catalog) {
 		ret = -ENOMEM;
-		goto fail_unregister;
+		goto fail_configfs;
 	}
 	strscpy(catalog, sblkdev_catalog, length + 1);
 
 	next_token = catalog;
+	mutex_lock(&sblkdev_device_lock);
 	while ((token = strsep(&next_token, ";"))) {
-		struct sblkdev_device *dev;
-		char *name;
-		char *capacity;
-		sector_t capacity_value;
-
-		name = strsep(&token, ",");
-		if (!name)
-			continue;
-		capacity = strsep(&token, ",");
-		if (!capacity)
-			continue;
-
-		ret = kstrtoull(capacity, 10, &capacity_value);
+		ret = sblkdev_add_entry(token);
 		if (ret)
 			break;
-
-		dev = sblkdev_add(sblkdev_major, inx, name, capacity_value);
-		if (IS_ERR(dev)) {
-			ret = PTR_ERR(dev);
-			break;
-		}
-
-		list_add(&dev->link, &sblkdev_device_list);
-		inx++;
 	}
+	mutex_unlock(&sblkdev_device_lock);
 	kfree(catalog);
 
 	pr_info("registered\n");
 	if (ret == 0)
 		return 0;
 
+	/* Don't leave the devices added before the faulty entry behind */
+	sblkdev_remove_all();
+fail_configfs:
+	sblkdev_configfs_exit();
+fail_par:
+	sblkdev_par_exit();
 fail_unregister:
+	sblkdev_debugfs_exit();
 	unregister_blkdev(sblkdev_major, KBUILD_MODNAME);
 	return ret;
 }
@@ -147,14 +533,12 @@ fail_unregister:
  */
 static void __exit sblkdev_exit(void)
 {
-	struct sblkdev_device *dev;
-
-	while ((dev = list_first_entry_or_null(&sblkdev_device_list,
-					       struct sblkdev_device, link))) {
-		list_del(&dev->link);
-		sblkdev_remove(dev);
-	}
+	/* No configfs device is left: each pins the module */
+	sblkdev_configfs_exit();
+	sblkdev_remove_all();
 
+	sblkdev_par_exit();
+	sblkdev_debugfs_exit();
 	if (sblkdev_major > 0)
 		unregister_blkdev(sblkdev_major, KBUILD_MODNAME);
 }
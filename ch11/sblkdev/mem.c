@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Companion char device ('mem=1'): /dev/<disk>-mem maps the device's RAM
+ * straight into a process, so that tools can checksum, compare or fill it at
+ * memory speed, without the block layer, the page cache or a copy.
+ *
+ * Page N of the char device is page N of the store, the very same memory the
+ * block I/O copies to and from. For that to hold, the store is pinned: its
+ * pages are never freed nor replaced while the device exists, discard zeroes
+ * them in place, and a hole gets a page of its own once it's mapped (see
+ * sblkdev_store_get_page()). Holes can be skipped with SEEK_DATA/SEEK_HOLE
+ * instead, to keep a sparse device sparse.
+ *
+ * Mappings outlive the char device's file and even the block device: the
+ * pages are referenced by the mappings, and any fault once the device is gone
+ * gets a SIGBUS.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include "device.h"
+
+struct sblkdev_mem {
+	struct miscdevice misc;
+	char name[DISK_NAME_LEN + 4];
+	struct kref ref;		/* The device, open files and mappings */
+	struct rw_semaphore lock;	/* Protects dev */
+	struct sblkdev_device *dev;	/* NULL: gone */
+};
+
+static void sblkdev_mem_release_ref(struct kref *ref)
+{
+	kfree(container_of(ref, struct sblkdev_mem, ref));
+}
+
+static void sblkdev_mem_put(struct sblkdev_mem *mem)
+{
+	kref_put(&mem->ref, sblkdev_mem_release_ref);
+}
+
+/* The store's pages, in the device's capacity */
+static inline pgoff_t sblkdev_mem_pages(struct sblkdev_device *dev)
+{
+	return DIV_ROUND_UP(dev->capacity, PAGE_SECTORS);
+}
+
+static vm_fault_t sblkdev_mem_fault(struct vm_fault *vmf)
+{
+	struct sblkdev_mem *mem = vmf->vma->vm_private_data;
+	vm_fault_t ret = VM_FAULT_SIGBUS;
+	struct page *page;
+
+	down_read(&mem->lock);
+	if (mem->dev && vmf->pgoff < sblkdev_mem_pages(mem->dev)) {
+		page = sblkdev_store_get_page(&mem->dev->store, vmf->pgoff, GFP_KERNEL);
+		if (page) {
+			vmf->page = page;
+			ret = 0;
+		} else {
+			ret = VM_FAULT_OOM;
+		}
+	}
+	up_read(&mem->lock);
+	return ret;
+}
+
+static void sblkdev_mem_vm_open(struct vm_area_struct *vma)
+{
+	struct sblkdev_mem *mem = vma->vm_private_data;
+
+	kref_get(&mem->ref);
+}
+
+static void sblkdev_mem_vm_close(struct vm_area_struct *vma)
+{
+	sblkdev_mem_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct sblkdev_mem_vm_ops = {
+	.open = sblkdev_mem_vm_open,
+	.close = sblkdev_mem_vm_close,
+	.fault = sblkdev_mem_fault,
+};
+
+static int sblkdev_mem_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct sblkdev_mem *mem = file->private_data;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+	vma->vm_ops = &sblkdev_mem_vm_ops;
+	vma->vm_private_data = mem;
+	sblkdev_mem_vm_open(vma);
+	return 0;
+}
+
+/* SEEK_DATA and SEEK_HOLE find the pages that exist, and the holes */
+static loff_t sblkdev_mem_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct sblkdev_mem *mem = file->private_data;
+	loff_t size, pos;
+
+	down_read(&mem->lock);
+	if (!mem->dev) {
+		up_read(&mem->lock);
+		return -ENODEV;
+	}
+	size = (loff_t)mem->dev->capacity << SECTOR_SHIFT;
+	if ((whence == SEEK_DATA || whence == SEEK_HOLE) && offset >= 0 && offset < size) {
+		pos = (loff_t)sblkdev_store_next(&mem->dev->store, offset >> PAGE_SHIFT,
+						 sblkdev_mem_pages(mem->dev),
+						 whence == SEEK_DATA) << PAGE_SHIFT;
+		if (pos < offset)
+			pos = offset;	/* Within the page at @offset */
+		if (pos >= size)
+			pos = whence == SEEK_DATA ? -ENXIO : size;
+		if (pos >= 0)
+			pos = vfs_setpos(file, pos, size);
+	} else {
+		pos = fixed_size_llseek(file, offset, whence, size);
+	}
+	up_read(&mem->lock);
+	return pos;
+}
+
+static int sblkdev_mem_open(struct inode *inode, struct file *file)
+{
+	/* misc_open() points it at the miscdevice */
+	struct sblkdev_mem *mem = container_of(file->private_data, struct sblkdev_mem, misc);
+
+	kref_get(&mem->ref);
+	file->private_data = mem;
+	return 0;
+}
+
+static int sblkdev_mem_release(struct inode *inode, struct file *file)
+{
+	sblkdev_mem_put(file->private_data);
+	return 0;
+}
+
+static const struct file_operations sblkdev_mem_fops = {
+	.owner = THIS_MODULE,
+	.open = sblkdev_mem_open,
+	.release = sblkdev_mem_release,
+	.mmap = sblkdev_mem_mmap,
+	.llseek = sblkdev_mem_llseek,
+};
+
+/*
+ * sblkdev_mem_register() - Add the companion char device, if asked for
+ * The store must have been set up pinned (see sblkdev_add()).
+ */
+int sblkdev_mem_register(struct sblkdev_device *dev, const struct sblkdev_params *params)
+{
+	struct sblkdev_mem *mem;
+	int ret;
+
+	if (!params->mem)
+		return 0;
+	if (WARN_ON(!dev->store.pinned))
+		return -EINVAL;
+
+	mem = kzalloc(sizeof(*mem), GFP_KERNEL);
+	if (!mem)
+		return -ENOMEM;
+	kref_init(&mem->ref);
+	init_rwsem(&mem->lock);
+	mem->dev = dev;
+	snprintf(mem->name, sizeof(mem->name), "%s-mem", dev->disk->disk_name);
+	mem->misc.minor = MISC_DYNAMIC_MINOR;
+	mem->misc.name = mem->name;
+	mem->misc.fops = &sblkdev_mem_fops;
+	mem->misc.mode = 0600;
+
+	ret = misc_register(&mem->misc);
+	if (ret) {
+		kfree(mem);
+		return ret;
+	}
+	dev->mem = mem;
+	pr_info("memory mappable through /dev/%s\n", mem->name);
+	return 0;
+}
+
+/*
+ * sblkdev_mem_unregister() - Take the char device down
+ * What's still open or mapped of it is cut off from the device, which may go.
+ */
+void sblkdev_mem_unregister(struct sblkdev_device *dev)
+{
+	struct sblkdev_mem *mem = dev->mem;
+
+	if (!mem)
+		return;
+
+	misc_deregister(&mem->misc);
+	down_write(&mem->lock);
+	mem->dev = NULL;
+	up_write(&mem->lock);
+	dev->mem = NULL;
+	sblkdev_mem_put(mem);
+}
@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Parallel copy offload: the data of a very large read or write (at least
+ * 'par_copy_kb') is copied by per-CPU workers, 'par_chunk_kb' each, instead of
+ * by the submitting CPU alone, so that a single stream can use more than one
+ * core's memory bandwidth. The I/O completes once the last chunk is copied.
+ *
+ * The chunks go to the CPUs of the submitter's node first: the data is most
+ * likely there. The workers may sleep, so they allocate the store's pages with
+ * GFP_NOIO instead of failing for lack of memory.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
+#include "device.h"
+#include "sblkdev_trace.h"
+
+/* One chunk of the I/O, for one worker */
+struct sblkdev_par_chunk {
+	struct work_struct work;
+	struct sblkdev_par_job *job;
+	unsigned int start;		/* [start, end) of the I/O's data */
+	unsigned int end;
+};
+
+/* One I/O */
+struct sblkdev_par_job {
+	struct sblkdev_device *dev;
+	struct bio *bio;		/* The I/O's data: the bio chain from here */
+	loff_t pos;			/* Device offset */
+	bool write;
+	bool nt;			/* Non-temporal stores, see sblkdev_store_nt() */
+	gfp_t gfp;
+	atomic_t pending;		/* Chunks not copied yet */
+	blk_status_t status;		/* The first error, if any */
+	sblkdev_par_done_t done;
+	void *data;
+	struct sblkdev_par_chunk chunks[];
+};
+
+static struct workqueue_struct *sblkdev_par_wq;
+
+/* Copy [@start, @end) of the job's data, wherever it is in the bio chain */
+static blk_status_t sblkdev_par_copy_range(struct sblkdev_par_job *job,
+					   unsigned int start, unsigned int end)
+{
+	struct sblkdev_device *dev = job->dev;
+	unsigned int off = 0;
+	struct bvec_iter iter;
+	struct bio_vec bvec;
+	struct bio *bio;
+
+	for (bio = job->bio; bio && off < end; bio = bio->bi_next) {
+		bio_for_each_bvec(bvec, bio, iter) {
+			unsigned int s = max(off, start);
+			unsigned int e = min(off + bvec.bv_len, end);
+
+			if (s < e) {
+				void *buf = bvec_virt(&bvec) + (s - off);
+				loff_t pos = job->pos + s;
+
+				if (job->write) {
+					/* Not requeued: the workers already wait for memory */
+					if (sblkdev_store_write(&dev->store, buf, pos, e - s,
+								job->gfp, job->nt))
+						return BLK_STS_IOERR;
+				} else if (sblkdev_store_read(&dev->store, buf, pos, e - s)) {
+					return BLK_STS_IOERR;
+				}
+			}
+			off += bvec.bv_len;
+			if (off >= end)
+				break;
+		}
+	}
+	return BLK_STS_OK;
+}
+
+static void sblkdev_par_work(struct work_struct *work)
+{
+	struct sblkdev_par_chunk *chunk = container_of(work, struct sblkdev_par_chunk, work);
+	struct sblkdev_par_job *job = chunk->job;
+	blk_status_t status;
+
+	trace_sblkdev_copy(disk_devt(job->dev->disk), job->write,
+			   job->pos + chunk->start, chunk->end - chunk->start);
+	status = sblkdev_par_copy_range(job, chunk->start, chunk->end);
+	/* Each worker fences its own stores; the atomic below orders them */
+	sblkdev_store_nt_fence(job->nt);
+	if (status)
+		cmpxchg(&job->status, BLK_STS_OK, status);
+
+	if (atomic_dec_and_test(&job->pending)) {
+		job->done(job->data, job->status);
+		kfree(job);
+	}
+}
+
+/* The CPU after @cpu in @mask, round robin */
+static inline unsigned int sblkdev_par_next_cpu(unsigned int cpu, const struct cpumask *mask)
+{
+	cpu = cpumask_next(cpu, mask);
+	return cpu < nr_cpu_ids ? cpu : cpumask_first(mask);
+}
+
+/*
+ * sblkdev_par_copy() - Copy the data of an I/O in parallel
+ * @bio: the I/O's data; it and the bios chained to it (a request's)
+ * @pos, @bytes: where the I/O is on the device, and its size
+ * @done: called with @data and the I/O's status once it's all copied, from a
+ * worker
+ * Returns 0 if the copy is underway; an error if it isn't, in which case the
+ * caller copies the data itself.
+ */
+int sblkdev_par_copy(struct sblkdev_device *dev, struct bio *bio, loff_t pos,
+		     unsigned int bytes, bool write, gfp_t gfp,
+		     sblkdev_par_done_t done, void *data)
+{
+	unsigned int chunk_size = max_t(unsigned int, READ_ONCE(sblkdev_par_chunk_kb) * SZ_1K,
+					PAGE_SIZE);
+	unsigned int i, nr = DIV_ROUND_UP(bytes, chunk_size);
+	const struct cpumask *mask = cpumask_of_node(numa_node_id());
+	struct sblkdev_par_job *job;
+	unsigned int cpu;
+
+	if (!sblkdev_par_wq || nr < 2 ||
+	    pos + bytes > ((loff_t)dev->capacity << SECTOR_SHIFT))
+		return -EINVAL;
+
+	/* Possibly under a spinlock, or in the I/O path: don't wait for memory */
+	job = kmalloc(struct_size(job, chunks, nr), GFP_NOWAIT | __GFP_NOWARN);
+	if (!job)
+		return -ENOMEM;
+	job->dev = dev;
+	job->bio = bio;
+	job->pos = pos;
+	job->write = write;
+	job->nt = write && sblkdev_store_nt(bytes);
+	job->gfp = gfp;
+	atomic_set(&job->pending, nr);
+	job->status = BLK_STS_OK;
+	job->done = done;
+	job->data = data;
+
+	/* The node's online CPUs, or all of them if it has none */
+	if (!cpumask_intersects(mask, cpu_online_mask))
+		mask = cpu_online_mask;
+
+	cpu = raw_smp_processor_id();
+	for (i = 0; i < nr; i++) {
+		struct sblkdev_par_chunk *chunk = &job->chunks[i];
+
+		chunk->job = job;
+		chunk->start = i * chunk_size;
+		chunk->end = min(bytes, chunk->start + chunk_size);
+		INIT_WORK(&chunk->work, sblkdev_par_work);
+	}
+	/* Past this, the job may be gone at any time */
+	for (i = 0; i < nr; i++) {
+		do {
+			cpu = sblkdev_par_next_cpu(cpu, mask);
+		} while (!cpu_online(cpu));
+		queue_work_on(cpu, sblkdev_par_wq, &job->chunks[i].work);
+	}
+	return 0;
+}
+
+struct sblkdev_par_wait {
+	struct completion done;
+	blk_status_t status;
+};
+
+static void sblkdev_par_wake(void *data, blk_status_t status)
+{
+	struct sblkdev_par_wait *wait = data;
+
+	wait->status = status;
+	complete(&wait->done);
+}
+
+/*
+ * sblkdev_par_copy_sync() - Copy the data of an I/O in parallel, and wait
+ * For the bio-based scheme, whose submitter may sleep. Returns 0 and the I/O's
+ * status in @status if it was copied; an error if the caller has to.
+ */
+int sblkdev_par_copy_sync(struct sblkdev_device *dev, struct bio *bio, loff_t pos,
+			  unsigned int bytes, bool write, gfp_t gfp,
+			  blk_status_t *status)
+{
+	struct sblkdev_par_wait wait;
+	int ret;
+
+	init_completion(&wait.done);
+	ret = sblkdev_par_copy(dev, bio, pos, bytes, write, gfp, sblkdev_par_wake, &wait);
+	if (ret)
+		return ret;
+
+	wait_for_completion_io(&wait.done);
+	*status = wait.status;
+	return 0;
+}
+
+int sblkdev_par_init(void)
+{
+	/* Per-CPU workers; on the I/O path, so they need a rescuer */
+	sblkdev_par_wq = alloc_workqueue(KBUILD_MODNAME "_copy", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	return sblkdev_par_wq ? 0 : -ENOMEM;
+}
+
+void sblkdev_par_exit(void)
+{
+	if (sblkdev_par_wq)
+		destroy_workqueue(sblkdev_par_wq);
+	sblkdev_par_wq = NULL;
+}
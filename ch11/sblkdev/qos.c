@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * I/O throttling and QoS classes (request-based only): token buckets cap the
+ * IOPS and bandwidth of the whole device ('qos_iops', 'qos_mbps') and of each
+ * hw queue ('qos_hctx_iops', 'qos_hctx_mbps'); up to 'qos_burst_ms' worth of
+ * unused budget is saved up for a burst.
+ *
+ * A bucket is kept as the time at which it's even, GCRA-style: one atomic per
+ * limit, advanced with a cmpxchg like the media emulation's timeline, so the
+ * dispatch path takes no lock. A read or write the buckets can't pay for yet
+ * is still copied at dispatch, but only completed once they can, from the
+ * hctx's hrtimer: a submitter, its queue depth bounded, sees the limit.
+ *
+ * The request's I/O priority class (ionice) sets how it's served:
+ *   - real time: never held back. It borrows its tokens, so the best effort
+ *     I/O queued behind it pays for them instead.
+ *   - best effort, or no class: throttled, with the burst.
+ *   - idle: throttled, without the burst.
+ * Each class has its counters and latency histogram (see stats.c).
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/atomic.h>
+#include <linux/math64.h>
+#include "device.h"
+
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+
+bool sblkdev_qos_active(const struct sblkdev_qos *qos)
+{
+	return qos->bw_limit || qos->iops_limit || qos->hctx_bw_limit ||
+	       qos->hctx_iops_limit;
+}
+
+/* Full buckets */
+void sblkdev_qos_reset(struct sblkdev_bucket *bucket)
+{
+	atomic64_set(&bucket->iops_tat, 0);
+	atomic64_set(&bucket->bw_tat, 0);
+}
+
+/*
+ * Take @cost_ns worth of tokens from the bucket even at @tat; it's full when
+ * that's @burst_ns or more ago. Returns when the I/O may go: @now if the bucket
+ * has the tokens (or with @borrow), else once it's been refilled.
+ */
+static u64 sblkdev_bucket_take(atomic64_t *tat, u64 cost_ns, u64 burst_ns, u64 now,
+			       bool borrow)
+{
+	u64 full = now > burst_ns ? now - burst_ns : 0;
+	s64 old = atomic64_read(tat);
+	u64 even;
+
+	do {
+		even = max_t(u64, old, full);
+	} while (!atomic64_try_cmpxchg(tat, &old, even + cost_ns));
+
+	return borrow ? now : max(even, now);
+}
+
+static u64 sblkdev_qos_take(struct sblkdev_bucket *bucket, u32 iops_limit, u64 bw_limit,
+			    unsigned int bytes, u64 burst_ns, u64 now, bool borrow)
+{
+	u64 release = now;
+
+	if (iops_limit)
+		release = max(release, sblkdev_bucket_take(&bucket->iops_tat,
+							   NSEC_PER_SEC / iops_limit,
+							   burst_ns, now, borrow));
+	if (bw_limit)
+		release = max(release, sblkdev_bucket_take(&bucket->bw_tat,
+							   div64_u64((u64)bytes * NSEC_PER_SEC,
+								     bw_limit),
+							   burst_ns, now, borrow));
+	return release;
+}
+
+/*
+ * sblkdev_qos_release() - When may @rq complete, as far as the limits go?
+ * Takes its tokens from the device's buckets and from its hw queue's. Only
+ * reads and writes are throttled. Never sleeps nor locks.
+ */
+u64 sblkdev_qos_release(struct sblkdev_queue *sq, struct request *rq)
+{
+	struct sblkdev_device *dev = sq->dev;
+	const struct sblkdev_qos *qos = &dev->qos;
+	enum sblkdev_qos_class class = sblkdev_qos_class(req_get_ioprio(rq));
+	enum sblkdev_stat_op op = sblkdev_stat_op(req_op(rq));
+	u64 burst_ns = class == SBLKDEV_QOS_IDLE ? 0 : qos->burst_ns;
+	bool borrow = class == SBLKDEV_QOS_RT;
+	u64 now = ktime_get_ns();
+	u64 release;
+
+	if (op != SBLKDEV_STAT_READ && op != SBLKDEV_STAT_WRITE)
+		return now;
+
+	release = sblkdev_qos_take(&dev->bucket, qos->iops_limit, qos->bw_limit,
+				   blk_rq_bytes(rq), burst_ns, now, borrow);
+	release = max(release, sblkdev_qos_take(&sq->bucket, qos->hctx_iops_limit,
+						qos->hctx_bw_limit, blk_rq_bytes(rq),
+						burst_ns, now, borrow));
+
+	if (release > now) {
+		this_cpu_inc(dev->stats->class_throttled[class]);
+		this_cpu_add(dev->stats->class_delay_ns[class], release - now);
+	}
+	return release;
+}
+
+#endif /* CONFIG_SBLKDEV_REQUESTS_BASED */
@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Range locks: overlapping I/O is ordered, and a write is atomic with respect
+ * to any I/O overlapping it, whatever queue or CPU each comes from; I/O that
+ * doesn't overlap goes on in parallel.
+ *
+ * The device is cut in 2^SBLKDEV_RANGE_SHIFT byte regions, and those hashed, by
+ * index, onto SBLKDEV_RANGE_STRIPES reader/writer stripes: an I/O takes the
+ * stripes of the regions it spans, in stripe order (all of them if it's that
+ * large), readers shared, writers exclusive. Two I/Os only ever contend when
+ * they are close, or a stripe count of regions apart.
+ *
+ * A stripe is a count, not a spinlock: it may be held while sleeping (e.g. in
+ * a page allocation), and blk-mq dispatch never waits for one. A request that
+ * finds one of its stripes taken gives back the others and is parked on that
+ * stripe, to be requeued as soon as it's unlocked: no polling, no back-off
+ * delay. Only the bio-based submitter sleeps on a stripe.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/atomic.h>
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/wait_bit.h>
+#include "device.h"
+
+struct sblkdev_range_stripe {
+	atomic_t state;			/* > 0: readers; -1: a writer */
+	atomic_t waiters;		/* Sleeping in sblkdev_range_lock() */
+	spinlock_t park_lock;
+	struct list_head parked;	/* Requests waiting for it, by queuelist */
+} ____cacheline_aligned_in_smp;
+
+/* The stripes of @range: @nr of them, from @first on, wrapping around */
+static inline void sblkdev_range_span(const struct sblkdev_range *range,
+				      unsigned int *first, unsigned int *nr)
+{
+	u64 start = range->pos >> SBLKDEV_RANGE_SHIFT;
+	u64 end = (range->pos + range->len - 1) >> SBLKDEV_RANGE_SHIFT;
+
+	*first = start & (SBLKDEV_RANGE_STRIPES - 1);
+	*nr = min_t(u64, end - start + 1, SBLKDEV_RANGE_STRIPES);
+}
+
+/* The @i-th stripe of the span, in stripe order: the wrapped part first */
+static inline unsigned int sblkdev_range_stripe(unsigned int first, unsigned int nr,
+						unsigned int i)
+{
+	unsigned int wrapped = first + nr > SBLKDEV_RANGE_STRIPES ?
+			       first + nr - SBLKDEV_RANGE_STRIPES : 0;
+
+	return i < wrapped ? i : first + i - wrapped;
+}
+
+static inline bool sblkdev_stripe_trylock(struct sblkdev_range_stripe *stripe, bool write)
+{
+	if (write)
+		return atomic_cmpxchg_acquire(&stripe->state, 0, -1) == 0;
+	return atomic_inc_unless_negative(&stripe->state);
+}
+
+/* Would @stripe still be in the way of a reader, or of a writer? */
+static inline bool sblkdev_stripe_held(struct sblkdev_range_stripe *stripe, bool write)
+{
+	int state = atomic_read(&stripe->state);
+
+	return write ? state : state < 0;
+}
+
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+/* Requeue the requests parked on @stripe, which has just been unlocked */
+static void sblkdev_stripe_unpark(struct sblkdev_range_stripe *stripe)
+{
+	struct request_queue *q = NULL;
+	struct request *rq, *next;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&stripe->park_lock, flags);
+	list_splice_init(&stripe->parked, &list);
+	spin_unlock_irqrestore(&stripe->park_lock, flags);
+
+	list_for_each_entry_safe(rq, next, &list, queuelist) {
+		list_del_init(&rq->queuelist);
+		q = rq->q;
+		blk_mq_requeue_request(rq, false);
+	}
+	if (q)
+		blk_mq_kick_requeue_list(q);
+}
+#endif
+
+static inline void sblkdev_stripe_unlock(struct sblkdev_range_stripe *stripe, bool write)
+{
+	if (write)
+		atomic_set_release(&stripe->state, 0);
+	else if (atomic_dec_return_release(&stripe->state))
+		return;		/* Other readers still hold it */
+
+	/* Pairs with the barrier in sblkdev_stripe_lock() */
+	smp_mb();
+	if (atomic_read(&stripe->waiters))
+		wake_up_var(&stripe->state);
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+	if (!list_empty_careful(&stripe->parked))
+		sblkdev_stripe_unpark(stripe);
+#endif
+}
+
+static void sblkdev_stripe_lock(struct sblkdev_range_stripe *stripe, bool write)
+{
+	if (sblkdev_stripe_trylock(stripe, write))
+		return;
+
+	atomic_inc(&stripe->waiters);
+	smp_mb__after_atomic();
+	wait_var_event(&stripe->state, sblkdev_stripe_trylock(stripe, write));
+	atomic_dec(&stripe->waiters);
+}
+
+static inline void sblkdev_range_locked(struct sblkdev_device *dev,
+					struct sblkdev_range *range, bool contended)
+{
+	range->start_ns = ktime_get_ns();
+	this_cpu_inc(dev->stats->range_locks);
+	if (contended)
+		this_cpu_inc(dev->stats->range_contended);
+}
+
+static void sblkdev_range_set(struct sblkdev_range *range, loff_t pos,
+			      unsigned int len, bool write)
+{
+	range->pos = pos;
+	range->len = len;
+	range->write = write;
+}
+
+/* Take all the stripes of @range, or none: returns the one in the way, if any */
+static struct sblkdev_range_stripe *sblkdev_range_tryspan(struct sblkdev_device *dev,
+							  const struct sblkdev_range *range)
+{
+	struct sblkdev_range_stripe *stripe;
+	unsigned int first, nr, i;
+
+	sblkdev_range_span(range, &first, &nr);
+	for (i = 0; i < nr; i++) {
+		stripe = &dev->ranges[sblkdev_range_stripe(first, nr, i)];
+		if (!sblkdev_stripe_trylock(stripe, range->write))
+			goto busy;
+	}
+	return NULL;
+
+busy:
+	while (i--)
+		sblkdev_stripe_unlock(&dev->ranges[sblkdev_range_stripe(first, nr, i)],
+				      range->write);
+	return stripe;
+}
+
+/*
+ * sblkdev_range_trylock() - Lock [@pos, @pos + @len) for reading or writing,
+ * if it can be had right away
+ * Never sleeps nor spins. Returns false, with nothing held, if an I/O that
+ * overlaps holds it (or one of its stripes); the caller retries later.
+ */
+bool sblkdev_range_trylock(struct sblkdev_device *dev, struct sblkdev_range *range,
+			   loff_t pos, unsigned int len, bool write)
+{
+	sblkdev_range_set(range, pos, len, write);
+	if (!len)
+		return true;
+
+	if (sblkdev_range_tryspan(dev, range)) {
+		this_cpu_inc(dev->stats->range_contended);
+		range->len = 0;
+		return false;
+	}
+	sblkdev_range_locked(dev, range, false);
+	return true;
+}
+
+#ifdef CONFIG_SBLKDEV_REQUESTS_BASED
+/*
+ * sblkdev_range_trylock_rq() - Lock [@pos, @pos + @len) for @rq, or park @rq
+ * Never sleeps nor spins. Returns false, with nothing held, if an I/O that
+ * overlaps holds it (or one of its stripes): @rq is then parked on that stripe
+ * and requeued once it's unlocked, which may already have happened by the time
+ * this returns. The caller must leave @rq alone.
+ */
+bool sblkdev_range_trylock_rq(struct sblkdev_device *dev, struct sblkdev_range *range,
+			      loff_t pos, unsigned int len, bool write,
+			      struct request *rq)
+{
+	struct sblkdev_range_stripe *busy;
+	bool contended = false;
+	unsigned long flags;
+
+	sblkdev_range_set(range, pos, len, write);
+	if (!len)
+		return true;
+
+	while ((busy = sblkdev_range_tryspan(dev, range))) {
+		contended = true;
+		spin_lock_irqsave(&busy->park_lock, flags);
+		list_add_tail(&rq->queuelist, &busy->parked);
+		/*
+		 * Pairs with the barrier in sblkdev_stripe_unlock(): either it
+		 * sees @rq parked, or we see the stripe free and try again.
+		 */
+		smp_mb();
+		if (sblkdev_stripe_held(busy, write)) {
+			spin_unlock_irqrestore(&busy->park_lock, flags);
+			this_cpu_inc(dev->stats->range_contended);
+			range->len = 0;
+			return false;
+		}
+		list_del_init(&rq->queuelist);
+		spin_unlock_irqrestore(&busy->park_lock, flags);
+	}
+	sblkdev_range_locked(dev, range, contended);
+	return true;
+}
+#endif
+
+/*
+ * sblkdev_range_lock() - Lock [@pos, @pos + @len) for reading or writing
+ * Sleeps until the overlapping I/O, if any, is done with it.
+ */
+void sblkdev_range_lock(struct sblkdev_device *dev, struct sblkdev_range *range,
+			loff_t pos, unsigned int len, bool write)
+{
+	unsigned int first, nr, i;
+	bool contended = false;
+
+	might_sleep();
+	sblkdev_range_set(range, pos, len, write);
+	if (!len)
+		return;
+
+	/* In stripe order, as every sleeper does: no deadlock */
+	sblkdev_range_span(range, &first, &nr);
+	for (i = 0; i < nr; i++) {
+		struct sblkdev_range_stripe *stripe =
+			&dev->ranges[sblkdev_range_stripe(first, nr, i)];
+
+		if (!contended && sblkdev_stripe_trylock(stripe, write))
+			continue;
+		contended = true;
+		sblkdev_stripe_lock(stripe, write);
+	}
+	sblkdev_range_locked(dev, range, contended);
+}
+
+/* Unlock a range locked above; a no-op for an empty one */
+void sblkdev_range_unlock(struct sblkdev_device *dev, struct sblkdev_range *range)
+{
+	unsigned int first, nr, i;
+
+	if (!range->len)
+		return;
+
+	this_cpu_add(dev->stats->range_hold_ns, ktime_get_ns() - range->start_ns);
+	sblkdev_range_span(range, &first, &nr);
+	for (i = 0; i < nr; i++)
+		sblkdev_stripe_unlock(&dev->ranges[sblkdev_range_stripe(first, nr, i)],
+				      range->write);
+	range->len = 0;
+}
+
+int sblkdev_range_init(struct sblkdev_device *dev)
+{
+	int i;
+
+	dev->ranges = kcalloc(SBLKDEV_RANGE_STRIPES, sizeof(*dev->ranges), GFP_KERNEL);
+	if (!dev->ranges)
+		return -ENOMEM;
+
+	for (i = 0; i < SBLKDEV_RANGE_STRIPES; i++) {
+		spin_lock_init(&dev->ranges[i].park_lock);
+		INIT_LIST_HEAD(&dev->ranges[i].parked);
+	}
+	return 0;
+}
+
+void sblkdev_range_free(struct sblkdev_device *dev)
+{
+	kfree(dev->ranges);
+	dev->ranges = NULL;
+}
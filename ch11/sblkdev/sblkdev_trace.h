@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * sblkdev data path tracepoints. Like all tracepoints they sit behind static
+ * keys, so they cost (next to) nothing until enabled, e.g.:
+ *    trace-cmd record -e sblkdev
+ * or
+ *    echo 1 > /sys/kernel/tracing/events/sblkdev/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sblkdev
+
+#if !defined(_SBLKDEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SBLKDEV_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/blk_types.h>
+#include <linux/kdev_t.h>
+
+TRACE_DEFINE_ENUM(REQ_OP_READ);
+TRACE_DEFINE_ENUM(REQ_OP_WRITE);
+TRACE_DEFINE_ENUM(REQ_OP_FLUSH);
+TRACE_DEFINE_ENUM(REQ_OP_DISCARD);
+TRACE_DEFINE_ENUM(REQ_OP_WRITE_ZEROES);
+TRACE_DEFINE_ENUM(REQ_OP_ZONE_APPEND);
+TRACE_DEFINE_ENUM(REQ_OP_ZONE_RESET);
+TRACE_DEFINE_ENUM(REQ_OP_ZONE_RESET_ALL);
+TRACE_DEFINE_ENUM(REQ_OP_ZONE_OPEN);
+TRACE_DEFINE_ENUM(REQ_OP_ZONE_CLOSE);
+TRACE_DEFINE_ENUM(REQ_OP_ZONE_FINISH);
+
+#define show_sblkdev_op(op)					\
+	__print_symbolic(op,					\
+		{ REQ_OP_READ,		"read" },		\
+		{ REQ_OP_WRITE,		"write" },		\
+		{ REQ_OP_FLUSH,		"flush" },		\
+		{ REQ_OP_DISCARD,	"discard" },		\
+		{ REQ_OP_WRITE_ZEROES,	"write_zeroes" },	\
+		{ REQ_OP_ZONE_APPEND,	"zone_append" },	\
+		{ REQ_OP_ZONE_RESET,	"zone_reset" },		\
+		{ REQ_OP_ZONE_RESET_ALL, "zone_reset_all" },	\
+		{ REQ_OP_ZONE_OPEN,	"zone_open" },		\
+		{ REQ_OP_ZONE_CLOSE,	"zone_close" },		\
+		{ REQ_OP_ZONE_FINISH,	"zone_finish" })
+
+/* A request (or, bio-based, a bio) reaches the driver; @hctx is -1 for bios */
+TRACE_EVENT(sblkdev_submit,
+	TP_PROTO(dev_t devt, enum req_op op, sector_t sector, unsigned int bytes,
+		 int hctx),
+
+	TP_ARGS(devt, op, sector, bytes, hctx),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+		__field(unsigned int, op)
+		__field(sector_t, sector)
+		__field(unsigned int, bytes)
+		__field(int, hctx)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+		__entry->op = op;
+		__entry->sector = sector;
+		__entry->bytes = bytes;
+		__entry->hctx = hctx;
+	),
+
+	TP_printk("%d:%d %s sector=%llu bytes=%u hctx=%d",
+		  MAJOR(__entry->devt), MINOR(__entry->devt),
+		  show_sblkdev_op(__entry->op),
+		  (unsigned long long)__entry->sector, __entry->bytes,
+		  __entry->hctx)
+);
+
+/* One segment copied to/from the backing store */
+TRACE_EVENT(sblkdev_copy,
+	TP_PROTO(dev_t devt, bool write, loff_t pos, unsigned int len),
+
+	TP_ARGS(devt, write, pos, len),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+		__field(bool, write)
+		__field(loff_t, pos)
+		__field(unsigned int, len)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+		__entry->write = write;
+		__entry->pos = pos;
+		__entry->len = len;
+	),
+
+	TP_printk("%d:%d %s pos=%lld len=%u",
+		  MAJOR(__entry->devt), MINOR(__entry->devt),
+		  __entry->write ? "write" : "read",
+		  __entry->pos, __entry->len)
+);
+
+/* A request (or bio) is completed, @lat_ns after it was started */
+TRACE_EVENT(sblkdev_complete,
+	TP_PROTO(dev_t devt, enum req_op op, sector_t sector, unsigned int bytes,
+		 int error, u64 lat_ns),
+
+	TP_ARGS(devt, op, sector, bytes, error, lat_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+		__field(unsigned int, op)
+		__field(sector_t, sector)
+		__field(unsigned int, bytes)
+		__field(int, error)
+		__field(u64, lat_ns)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+		__entry->op = op;
+		__entry->sector = sector;
+		__entry->bytes = bytes;
+		__entry->error = error;
+		__entry->lat_ns = lat_ns;
+	),
+
+	TP_printk("%d:%d %s sector=%llu bytes=%u error=%d lat=%llu ns",
+		  MAJOR(__entry->devt), MINOR(__entry->devt),
+		  show_sblkdev_op(__entry->op),
+		  (unsigned long long)__entry->sector, __entry->bytes,
+		  __entry->error, __entry->lat_ns)
+);
+
+#endif /* _SBLKDEV_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sblkdev_trace
+#include <trace/define_trace.h>
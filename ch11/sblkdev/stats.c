@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per device IO statistics, exported through debugfs:
+ *   /sys/kernel/debug/sblkdev/<disk>/stats    - ops, bytes, errors, merges,
+ *                                               range lock contention, I/O
+ *                                               priority classes
+ *   /sys/kernel/debug/sblkdev/<disk>/latency  - log2 latency histograms per
+ *                                               op type and IO size class,
+ *                                               and per priority class
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include "device.h"
+
+static struct dentry *sblkdev_debugfs_root;
+
+static const char * const sblkdev_stat_op_names[SBLKDEV_STAT_NR_OPS] = {
+	[SBLKDEV_STAT_READ] = "read",
+	[SBLKDEV_STAT_WRITE] = "write",
+	[SBLKDEV_STAT_DISCARD] = "discard",
+	[SBLKDEV_STAT_OTHER] = "other",
+};
+
+static const char * const sblkdev_stat_size_names[SBLKDEV_STAT_NR_SIZES] = {
+	"<=4K", "<=64K", "<=1M", ">1M",
+};
+
+static const char * const sblkdev_qos_class_names[SBLKDEV_QOS_NR_CLASSES] = {
+	[SBLKDEV_QOS_RT] = "rt",
+	[SBLKDEV_QOS_BE] = "be",
+	[SBLKDEV_QOS_IDLE] = "idle",
+};
+
+/* Sum a counter over all CPUs */
+#define sblkdev_stats_sum(stats, field) ({				\
+	u64 __sum = 0;							\
+	int __cpu;							\
+	for_each_possible_cpu(__cpu)					\
+		__sum += per_cpu_ptr(stats, __cpu)->field;		\
+	__sum;								\
+})
+
+static void sblkdev_range_show(struct sblkdev_device *dev, struct seq_file *m)
+{
+	u64 locks = sblkdev_stats_sum(dev->stats, range_locks);
+
+	if (!locks)
+		return;
+	seq_printf(m, "range locks: %llu, contended %llu, held %llu ns on average\n",
+		   locks, sblkdev_stats_sum(dev->stats, range_contended),
+		   div64_u64(sblkdev_stats_sum(dev->stats, range_hold_ns), locks));
+}
+
+/* The classes seen so far; with throttling on, how long they were held back */
+static void sblkdev_class_show(struct sblkdev_device *dev, struct seq_file *m)
+{
+	int class;
+
+	seq_printf(m, "%-8s %16s %16s %16s %16s\n",
+		   "class", "ops", "avg lat ns", "throttled", "avg delay ns");
+	for (class = 0; class < SBLKDEV_QOS_NR_CLASSES; class++) {
+		u64 ops = sblkdev_stats_sum(dev->stats, class_ops[class]);
+		u64 throttled = sblkdev_stats_sum(dev->stats, class_throttled[class]);
+
+		if (!ops)
+			continue;
+		seq_printf(m, "%-8s %16llu %16llu %16llu %16llu\n",
+			   sblkdev_qos_class_names[class], ops,
+			   div64_u64(sblkdev_stats_sum(dev->stats, class_lat_ns[class]), ops),
+			   throttled, throttled ?
+			   div64_u64(sblkdev_stats_sum(dev->stats, class_delay_ns[class]),
+				     throttled) : 0);
+	}
+}
+
+static int sblkdev_stats_show(struct seq_file *m, void *v)
+{
+	struct sblkdev_device *dev = m->private;
+	int op;
+
+	seq_printf(m, "%-8s %16s %20s %12s %12s\n",
+		   "op", "ops", "bytes", "errors", "merged");
+	for (op = 0; op < SBLKDEV_STAT_NR_OPS; op++)
+		seq_printf(m, "%-8s %16llu %20llu %12llu %12llu\n",
+			   sblkdev_stat_op_names[op],
+			   sblkdev_stats_sum(dev->stats, ops[op]),
+			   sblkdev_stats_sum(dev->stats, bytes[op]),
+			   sblkdev_stats_sum(dev->stats, errors[op]),
+			   sblkdev_stats_sum(dev->stats, merged[op]));
+	sblkdev_class_show(dev, m);
+	sblkdev_range_show(dev, m);
+	sblkdev_store_show(&dev->store, m);
+	sblkdev_cache_show(dev, m);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sblkdev_stats);
+
+/* One histogram; nothing if it's empty */
+static void sblkdev_histogram_show(struct seq_file *m, const u64 *count,
+				   const char *name, const char *sub)
+{
+	int bucket;
+
+	for (bucket = 0; bucket < SBLKDEV_STAT_NR_LAT; bucket++)
+		if (count[bucket])
+			break;
+	if (bucket == SBLKDEV_STAT_NR_LAT)
+		return;
+
+	seq_printf(m, "%s %s:\n", name, sub);
+	for (; bucket < SBLKDEV_STAT_NR_LAT; bucket++) {
+		if (!count[bucket])
+			continue;
+		seq_printf(m, "  [%12llu, %12llu) ns: %llu\n",
+			   1ULL << bucket, 2ULL << bucket, count[bucket]);
+	}
+}
+
+/* Only the non-empty histograms and buckets are shown */
+static int sblkdev_latency_show(struct seq_file *m, void *v)
+{
+	struct sblkdev_device *dev = m->private;
+	u64 count[SBLKDEV_STAT_NR_LAT];
+	int op, size, class, bucket;
+
+	for (op = 0; op < SBLKDEV_STAT_NR_OPS; op++) {
+		for (size = 0; size < SBLKDEV_STAT_NR_SIZES; size++) {
+			for (bucket = 0; bucket < SBLKDEV_STAT_NR_LAT; bucket++)
+				count[bucket] = sblkdev_stats_sum(dev->stats,
+								  lat[op][size][bucket]);
+			sblkdev_histogram_show(m, count, sblkdev_stat_op_names[op],
+					       sblkdev_stat_size_names[size]);
+		}
+	}
+
+	for (class = 0; class < SBLKDEV_QOS_NR_CLASSES; class++) {
+		for (bucket = 0; bucket < SBLKDEV_STAT_NR_LAT; bucket++)
+			count[bucket] = sblkdev_stats_sum(dev->stats, class_lat[class][bucket]);
+		sblkdev_histogram_show(m, count, "class", sblkdev_qos_class_names[class]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sblkdev_latency);
+
+/*
+ * sblkdev_stats_init() - Allocate the counters of a device and publish them
+ * A failure to create the debugfs files is not fatal (and not checked, as is
+ * the debugfs convention).
+ */
+int sblkdev_stats_init(struct sblkdev_device *dev)
+{
+	dev->stats = alloc_percpu(struct sblkdev_stats);
+	if (!dev->stats)
+		return -ENOMEM;
+
+	dev->debugfs_dir = debugfs_create_dir(dev->disk->disk_name, sblkdev_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev, &sblkdev_stats_fops);
+	debugfs_create_file("latency", 0444, dev->debugfs_dir, dev, &sblkdev_latency_fops);
+
+	return 0;
+}
+
+void sblkdev_stats_free(struct sblkdev_device *dev)
+{
+	debugfs_remove(dev->debugfs_dir);
+	dev->debugfs_dir = NULL;
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
+
+void sblkdev_debugfs_init(void)
+{
+	sblkdev_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+}
+
+void sblkdev_debugfs_exit(void)
+{
+	debugfs_remove(sblkdev_debugfs_root);
+}
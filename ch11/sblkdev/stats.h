@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __SBLKDEV_STATS_H__
+#define __SBLKDEV_STATS_H__
+
+#include <linux/blk_types.h>
+#include <linux/ioprio.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/sizes.h>
+
+struct sblkdev_device;
+
+enum sblkdev_stat_op {
+	SBLKDEV_STAT_READ,
+	SBLKDEV_STAT_WRITE,
+	SBLKDEV_STAT_DISCARD,		/* Discard and write-zeroes */
+	SBLKDEV_STAT_OTHER,
+	SBLKDEV_STAT_NR_OPS,
+};
+
+/* I/O priority classes, see qos.c; requests without one are best effort */
+enum sblkdev_qos_class {
+	SBLKDEV_QOS_RT,
+	SBLKDEV_QOS_BE,
+	SBLKDEV_QOS_IDLE,
+	SBLKDEV_QOS_NR_CLASSES,
+};
+
+/* IO size classes: <= 4K, <= 64K, <= 1M, larger */
+#define SBLKDEV_STAT_NR_SIZES	4
+/* Latency bucket N counts completions taking [2^N, 2^(N+1)) ns; the last one is open */
+#define SBLKDEV_STAT_NR_LAT	32
+
+/*
+ * IO counters and latency histograms. Kept per CPU and only ever updated with
+ * this_cpu ops: no lock, no shared cacheline on the data path. Readers (the
+ * debugfs files) sum over all CPUs.
+ */
+struct sblkdev_stats {
+	u64 ops[SBLKDEV_STAT_NR_OPS];
+	u64 bytes[SBLKDEV_STAT_NR_OPS];
+	u64 errors[SBLKDEV_STAT_NR_OPS];
+	u64 merged[SBLKDEV_STAT_NR_OPS];	/* Requests made of more than one bio */
+	u64 lat[SBLKDEV_STAT_NR_OPS][SBLKDEV_STAT_NR_SIZES][SBLKDEV_STAT_NR_LAT];
+	/* Range locks, see rangelock.c */
+	u64 range_locks;		/* Taken */
+	u64 range_contended;		/* Found (part) held by another I/O */
+	u64 range_hold_ns;		/* Total time held */
+	/* Per I/O priority class, see qos.c */
+	u64 class_ops[SBLKDEV_QOS_NR_CLASSES];
+	u64 class_lat_ns[SBLKDEV_QOS_NR_CLASSES];	/* Total latency */
+	u64 class_throttled[SBLKDEV_QOS_NR_CLASSES];	/* Held back by the limits */
+	u64 class_delay_ns[SBLKDEV_QOS_NR_CLASSES];	/* Total time held back */
+	u64 class_lat[SBLKDEV_QOS_NR_CLASSES][SBLKDEV_STAT_NR_LAT];
+};
+
+static inline enum sblkdev_stat_op sblkdev_stat_op(enum req_op op)
+{
+	switch (op) {
+	case REQ_OP_READ:
+		return SBLKDEV_STAT_READ;
+	case REQ_OP_WRITE:
+	case REQ_OP_ZONE_APPEND:
+		return SBLKDEV_STAT_WRITE;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		return SBLKDEV_STAT_DISCARD;
+	default:
+		return SBLKDEV_STAT_OTHER;
+	}
+}
+
+static inline enum sblkdev_qos_class sblkdev_qos_class(unsigned short ioprio)
+{
+	switch (IOPRIO_PRIO_CLASS(ioprio)) {
+	case IOPRIO_CLASS_RT:
+		return SBLKDEV_QOS_RT;
+	case IOPRIO_CLASS_IDLE:
+		return SBLKDEV_QOS_IDLE;
+	default:
+		return SBLKDEV_QOS_BE;
+	}
+}
+
+static inline unsigned int sblkdev_stat_size(unsigned int bytes)
+{
+	if (bytes <= SZ_4K)
+		return 0;
+	if (bytes <= SZ_64K)
+		return 1;
+	if (bytes <= SZ_1M)
+		return 2;
+	return 3;
+}
+
+/*
+ * sblkdev_stats_account() - Account one completed IO
+ * Safe from any context; never sleeps, locks or prints.
+ */
+static inline void sblkdev_stats_account(struct sblkdev_stats __percpu *stats,
+					 enum req_op req_op, unsigned int bytes,
+					 bool error, bool merged, u64 lat_ns,
+					 unsigned short ioprio)
+{
+	enum sblkdev_stat_op op = sblkdev_stat_op(req_op);
+	enum sblkdev_qos_class class = sblkdev_qos_class(ioprio);
+	unsigned int bucket = lat_ns ? min_t(unsigned int, ilog2(lat_ns),
+					     SBLKDEV_STAT_NR_LAT - 1) : 0;
+
+	this_cpu_inc(stats->ops[op]);
+	this_cpu_add(stats->bytes[op], bytes);
+	if (unlikely(error))
+		this_cpu_inc(stats->errors[op]);
+	if (merged)
+		this_cpu_inc(stats->merged[op]);
+	this_cpu_inc(stats->lat[op][sblkdev_stat_size(bytes)][bucket]);
+	this_cpu_inc(stats->class_ops[class]);
+	this_cpu_add(stats->class_lat_ns[class], lat_ns);
+	this_cpu_inc(stats->class_lat[class][bucket]);
+}
+
+void sblkdev_debugfs_init(void);
+void sblkdev_debugfs_exit(void);
+int sblkdev_stats_init(struct sblkdev_device *dev);
+void sblkdev_stats_free(struct sblkdev_device *dev);
+
+#endif /* __SBLKDEV_STATS_H__ */
@@ -0,0 +1,1700 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Sparse, allocate-on-write backing store for sblkdev.
+ *
+ * Instead of one huge (and up front zeroed) kvzalloc() of the full capacity,
+ * the data lives in individual pages kept in an xarray. Page lookups are
+ * lockless (RCU); only inserting a new page takes the xarray lock.
+ *
+ * A page written full of one repeated 32-bit pattern takes no memory at all:
+ * it's kept as a value entry (zeroes simply as a hole) and reads synthesize it.
+ *
+ * Optionally, whole pages written with the same content share one page
+ * (dedup): they're found through a content hash index, and are copied on
+ * write when partially overwritten. A shared page has page->private pointing
+ * to its index node; a private one has it 0.
+ *
+ * Optionally the pages are kept compressed, zram-style: each written page is
+ * compressed through the crypto acomp API (lz4, zstd, ...) into a kmalloc()ed
+ * object just as large as needed. Pages that don't compress well are kept
+ * as they are. Writes then replace whole objects (read-modify-write for partial
+ * pages), serialized per page by a striped lock; reads stay lockless.
+ *
+ * Optionally the memory comes in large chunks: naturally aligned large folios
+ * (e.g. 2M, a huge page) held by multi-index xarray entries, so a large I/O is
+ * a few big copies through the direct map rather than a lookup and a kmap per
+ * page. Where a chunk can't be had in one piece, its pages are allocated one
+ * by one as usual.
+ *
+ * A store can be made a copy-on-write snapshot of another in constant time:
+ * the other's pages are frozen into a read-only layer, which both then keep
+ * under a new, empty, top layer of their own (see sblkdev_store_snapshot()).
+ * A page missing from the top layer is looked up in the layers below; one
+ * written is copied up first. A zeroed page then can't be a hole, as that
+ * would let a lower layer's page through: it's a zero value entry instead.
+ *
+ * A DAX store is allocated in full at init, in huge page sized and aligned
+ * blocks where it can be: split into single pages, as fs-dax tracks each page
+ * it maps, but physically contiguous. The pages may be mapped into user space
+ * (see dax.c), so they're never freed nor replaced until the store goes: they
+ * are always written in place, and discard zeroes them.
+ *
+ * A pinned store (for the companion char device, see mem.c) keeps its pages
+ * put the same way, as they may be mapped too, but is allocated page by page
+ * as it's written, or as a page is first mapped.
+ *
+ * Pages are placed on NUMA nodes by a per-store policy: the writer's node,
+ * one node, or interleaved in stripes (by device offset) over the nodes with
+ * memory. Under an explicit policy, the bytes copied to and from each node's
+ * pages are counted, and those copied by a CPU of another node.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/local_lock.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/refcount.h>
+#include <linux/scatterlist.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/xxhash.h>
+#include <crypto/acompress.h>
+#include "store.h"
+
+/* Compressing to more than this isn't worth it: the page is kept as is */
+#define SBLKDEV_ZOBJ_MAX	(PAGE_SIZE * 3 / 4)
+
+#define SBLKDEV_STORE_LOCK_BITS	6
+
+/* The blocks a DAX store is allocated in: huge pages if possible */
+#define SBLKDEV_DAX_ORDER	min_t(unsigned int, PMD_SHIFT - PAGE_SHIFT, \
+				      SBLKDEV_MAX_PAGE_ORDER)
+
+/* Renamed in 6.8 (and made inclusive) */
+#ifdef MAX_PAGE_ORDER
+#define SBLKDEV_MAX_PAGE_ORDER	MAX_PAGE_ORDER
+#else
+#define SBLKDEV_MAX_PAGE_ORDER	(MAX_ORDER - 1)
+#endif
+
+/* Words compared at a time by the same-filled page scan: a cache line */
+#define SBLKDEV_FILL_STRIDE	(64 / sizeof(unsigned long))
+
+/* A page of a compressed store; either compressed data or a whole page */
+struct sblkdev_zobj {
+	struct rcu_head rcu;
+	struct page *page;		/* Incompressible: the data as is */
+	unsigned int len;		/* Compressed: length of data[] */
+	u8 data[];
+};
+
+/* Per-CPU compression context; the compressor's output and a scratch page */
+struct sblkdev_zstrm {
+	local_lock_t lock;
+	struct crypto_acomp *tfm;
+	struct acomp_req *req;
+	void *buf;			/* 2 pages: compressed output may grow */
+	void *scratch;			/* Decompressed page for partial I/O */
+	/* CPU cost; updated under the lock, summed by sblkdev_store_show() */
+	u64 nr_comp;
+	u64 comp_ns;
+	u64 nr_decomp;
+	u64 decomp_ns;
+};
+
+struct sblkdev_store_comp {
+	char alg[CRYPTO_MAX_ALG_NAME];
+	struct sblkdev_zstrm __percpu *strm;
+	/* Serializes the read-modify-write of a page (hashed by page index) */
+	spinlock_t locks[1 << SBLKDEV_STORE_LOCK_BITS];
+	atomic_long_t nr_zobjs;		/* Compressed pages */
+	atomic_long_t zbytes;		/* Their compressed size */
+};
+
+/* A page shared by all the store slots written with its content */
+struct sblkdev_dpage {
+	struct hlist_node node;		/* In its index bucket */
+	u64 hash;
+	unsigned int ref;		/* Slots pointing to it; under the bucket lock */
+	struct page *page;
+	struct rcu_head rcu;
+};
+
+/*
+ * A frozen layer of pages, shared by the snapshots taken of it; its pages are
+ * never written nor freed until the last of them goes away.
+ */
+struct sblkdev_store_layer {
+	struct xarray *pages;
+	struct sblkdev_store_layer *parent;	/* Next layer down */
+	refcount_t ref;				/* Stores and layers right above */
+	long nr_pages;				/* Frozen with it */
+};
+
+/* NUMA placement, and the traffic to and from each node */
+struct sblkdev_store_numa {
+	enum sblkdev_numa_policy policy;
+	int node;			/* SBLKDEV_NUMA_BIND */
+	unsigned int stripe_order;	/* SBLKDEV_NUMA_INTERLEAVE */
+	unsigned int nr_nodes;
+	int *nodes;			/* The nodes with memory, to stripe over */
+	/* Per node: bytes copied, and of those by a CPU of another node */
+	u64 __percpu *traffic;		/* [2 * node + remote] */
+};
+
+/* The content hash index of the shared pages */
+struct sblkdev_store_dedup {
+	struct hlist_head *buckets;
+	unsigned int hash_bits;
+	spinlock_t locks[1 << SBLKDEV_STORE_LOCK_BITS]; /* Bucket locks, striped */
+	atomic_long_t nr_pages;		/* Shared pages */
+	atomic_long_t nr_refs;		/* Slots pointing to them */
+};
+
+/*
+ * Same-filled pages
+ */
+
+/* The word a 32-bit pattern fills memory with */
+static inline unsigned long sblkdev_fill_word(u32 pattern)
+{
+#if BITS_PER_LONG == 64
+	return ((unsigned long)pattern << 32) | pattern;
+#else
+	return pattern;
+#endif
+}
+
+/*
+ * Is the page at @src filled with one repeated word? A cache line at a time,
+ * OR-ing the differences, which the compiler turns into vector compares.
+ */
+static bool sblkdev_same_filled(const void *src, unsigned long *word)
+{
+	const unsigned long *p = src;
+	unsigned long w = p[0];
+	unsigned int i, j;
+
+	/* Most pages are told apart by their last word */
+	if (p[PAGE_SIZE / sizeof(*p) - 1] != w)
+		return false;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i += SBLKDEV_FILL_STRIDE) {
+		unsigned long diff = 0;
+
+		for (j = 0; j < SBLKDEV_FILL_STRIDE; j++)
+			diff |= p[i + j] ^ w;
+		if (diff)
+			return false;
+	}
+
+	*word = w;
+	return true;
+}
+
+/*
+ * The entry for a page filled with @word: a hole for zeroes (unless there are
+ * layers below), a value entry for a repeated 32-bit pattern. False if it has
+ * none (a value entry only holds BITS_PER_LONG - 1 bits).
+ */
+static bool sblkdev_fill_entry(const struct sblkdev_store *store, unsigned long word,
+			       void **entry)
+{
+	u32 pattern = word;
+
+	if (sblkdev_fill_word(pattern) != word)
+		return false;
+	if (BITS_PER_LONG == 32 && pattern > LONG_MAX)
+		return false;
+
+	*entry = (pattern || store->base) ? xa_mk_value(pattern) : NULL;
+	return true;
+}
+
+/* Synthesize @len bytes at @offset of a page filled with @pattern */
+static void sblkdev_fill(void *buf, u32 pattern, unsigned int offset, size_t len)
+{
+	const u8 *bytes = (const u8 *)&pattern;
+	size_t i;
+
+	if (!((offset | len | (unsigned long)buf) & 3)) {
+		memset32(buf, pattern, len / 4);
+		return;
+	}
+	for (i = 0; i < len; i++)
+		((u8 *)buf)[i] = bytes[(offset + i) & 3];
+}
+
+/*
+ * Dedup
+ */
+
+static inline struct sblkdev_dpage *sblkdev_page_dpage(struct page *page)
+{
+	return (struct sblkdev_dpage *)page_private(page);
+}
+
+static inline struct hlist_head *sblkdev_dedup_bucket(struct sblkdev_store_dedup *dd,
+						      u64 hash)
+{
+	return &dd->buckets[hash_64(hash, dd->hash_bits)];
+}
+
+/* The top bits of the bucket index: the buckets sharing a lock are adjacent */
+static inline spinlock_t *sblkdev_dedup_lock(struct sblkdev_store_dedup *dd, u64 hash)
+{
+	return &dd->locks[hash_64(hash, SBLKDEV_STORE_LOCK_BITS)];
+}
+
+/* A shared page with the content @buf, referenced; called with the bucket lock */
+static struct sblkdev_dpage *sblkdev_dedup_find(struct sblkdev_store_dedup *dd,
+						const void *buf, u64 hash)
+{
+	struct sblkdev_dpage *dp;
+
+	hlist_for_each_entry(dp, sblkdev_dedup_bucket(dd, hash), node) {
+		void *addr;
+		int diff;
+
+		if (dp->hash != hash)
+			continue;
+		addr = kmap_local_page(dp->page);
+		diff = memcmp(addr, buf, PAGE_SIZE);
+		kunmap_local(addr);
+		if (!diff) {
+			dp->ref++;
+			atomic_long_inc(&dd->nr_refs);
+			return dp;
+		}
+	}
+	return NULL;
+}
+
+static void sblkdev_dpage_free_rcu(struct rcu_head *head)
+{
+	struct sblkdev_dpage *dp = container_of(head, struct sblkdev_dpage, rcu);
+
+	set_page_private(dp->page, 0);
+	__free_page(dp->page);
+	kfree(dp);
+}
+
+static void sblkdev_dedup_put(struct sblkdev_store_dedup *dd, struct sblkdev_dpage *dp)
+{
+	spinlock_t *lock = sblkdev_dedup_lock(dd, dp->hash);
+	bool last;
+
+	spin_lock(lock);
+	last = !--dp->ref;
+	if (last)
+		hlist_del(&dp->node);
+	spin_unlock(lock);
+
+	atomic_long_dec(&dd->nr_refs);
+	if (last) {
+		atomic_long_dec(&dd->nr_pages);
+		call_rcu(&dp->rcu, sblkdev_dpage_free_rcu);
+	}
+}
+
+/*
+ * The shared page with the content @buf, referenced; a new one if there's
+ * none yet.
+ */
+static struct sblkdev_dpage *sblkdev_dedup_get(struct sblkdev_store_dedup *dd,
+					       const void *buf, gfp_t gfp)
+{
+	u64 hash = xxh64(buf, PAGE_SIZE, 0);
+	spinlock_t *lock = sblkdev_dedup_lock(dd, hash);
+	struct sblkdev_dpage *dp, *found;
+
+	spin_lock(lock);
+	found = sblkdev_dedup_find(dd, buf, hash);
+	spin_unlock(lock);
+	if (found)
+		return found;
+
+	dp = kmalloc(sizeof(*dp), gfp);
+	if (!dp)
+		return NULL;
+	dp->page = alloc_page(gfp | __GFP_HIGHMEM);
+	if (!dp->page) {
+		kfree(dp);
+		return NULL;
+	}
+	memcpy_to_page(dp->page, 0, buf, PAGE_SIZE);
+	set_page_private(dp->page, (unsigned long)dp);
+	dp->hash = hash;
+	dp->ref = 1;
+
+	/* Someone may have added the same content meanwhile */
+	spin_lock(lock);
+	found = sblkdev_dedup_find(dd, buf, hash);
+	if (!found) {
+		hlist_add_head(&dp->node, sblkdev_dedup_bucket(dd, hash));
+		atomic_long_inc(&dd->nr_pages);
+		atomic_long_inc(&dd->nr_refs);
+	}
+	spin_unlock(lock);
+
+	if (found) {
+		set_page_private(dp->page, 0);
+		__free_page(dp->page);
+		kfree(dp);
+		return found;
+	}
+	return dp;
+}
+
+/*
+ * Store entries: a hole (NULL), a same-filled page (value entry), and then
+ * either a compressed page (struct sblkdev_zobj) or a private or shared page.
+ */
+
+static void sblkdev_zobj_account(struct sblkdev_store *store,
+				 const struct sblkdev_zobj *zobj, long sign)
+{
+	if (zobj->page) {
+		atomic_long_add(sign, &store->nr_pages);
+	} else {
+		atomic_long_add(sign, &store->comp->nr_zobjs);
+		atomic_long_add(sign * (long)zobj->len, &store->comp->zbytes);
+	}
+}
+
+static void sblkdev_store_account(struct sblkdev_store *store, void *entry, long sign)
+{
+	if (!entry)
+		return;
+	if (xa_is_value(entry))
+		atomic_long_add(sign, &store->nr_filled);
+	else if (store->comp)
+		sblkdev_zobj_account(store, entry, sign);
+	else if (!page_private((struct page *)entry))
+		atomic_long_add(sign * (long)compound_nr(entry), &store->nr_pages);
+	/* Shared pages are counted by the dedup index */
+}
+
+static void sblkdev_zobj_free(struct sblkdev_zobj *zobj)
+{
+	if (zobj->page)
+		__free_page(zobj->page);
+	kfree(zobj);
+}
+
+static void sblkdev_zobj_free_rcu(struct rcu_head *head)
+{
+	sblkdev_zobj_free(container_of(head, struct sblkdev_zobj, rcu));
+}
+
+/*
+ * Pages are freed only after a grace period: readers look them up under RCU.
+ * put_page() frees a large folio whole.
+ */
+static void sblkdev_store_free_page_rcu(struct rcu_head *head)
+{
+	put_page(container_of(head, struct page, rcu_head));
+}
+
+/* Let go of an entry just taken out of the store */
+static void sblkdev_store_release(struct sblkdev_store *store, void *entry)
+{
+	struct page *page = entry;
+
+	sblkdev_store_account(store, entry, -1);
+	if (!entry || xa_is_value(entry))
+		return;
+
+	if (store->comp)
+		call_rcu(&((struct sblkdev_zobj *)entry)->rcu, sblkdev_zobj_free_rcu);
+	else if (page_private(page))
+		sblkdev_dedup_put(store->dedup, sblkdev_page_dpage(page));
+	else
+		call_rcu(&page->rcu_head, sblkdev_store_free_page_rcu);
+}
+
+/*
+ * Put @entry at @idx, whatever was there before; for whole page writes. On
+ * failure, the caller still owns @entry.
+ */
+static int sblkdev_store_replace(struct sblkdev_store *store, pgoff_t idx,
+				 void *entry, gfp_t gfp)
+{
+	void *old = xa_store(store->pages, idx, entry, gfp);
+
+	if (xa_is_err(old))
+		return xa_err(old);
+
+	sblkdev_store_account(store, entry, 1);
+	sblkdev_store_release(store, old);
+	return 0;
+}
+
+/*
+ * Compression
+ */
+
+static int sblkdev_zstrm_compress(struct sblkdev_zstrm *zs, const void *src,
+				  unsigned int *dlen)
+{
+	struct scatterlist sg_src, sg_dst;
+	u64 start_ns = ktime_get_ns();
+	int ret;
+
+	sg_init_one(&sg_src, src, PAGE_SIZE);
+	sg_init_one(&sg_dst, zs->buf, 2 * PAGE_SIZE);
+	acomp_request_set_params(zs->req, &sg_src, &sg_dst, PAGE_SIZE, 2 * PAGE_SIZE);
+	ret = crypto_acomp_compress(zs->req);
+	*dlen = zs->req->dlen;
+
+	zs->nr_comp++;
+	zs->comp_ns += ktime_get_ns() - start_ns;
+	return ret;
+}
+
+static int sblkdev_zstrm_decompress(struct sblkdev_zstrm *zs,
+				    const struct sblkdev_zobj *zobj, void *dst)
+{
+	struct scatterlist sg_src, sg_dst;
+	u64 start_ns = ktime_get_ns();
+	int ret;
+
+	sg_init_one(&sg_src, zobj->data, zobj->len);
+	sg_init_one(&sg_dst, dst, PAGE_SIZE);
+	acomp_request_set_params(zs->req, &sg_src, &sg_dst, zobj->len, PAGE_SIZE);
+	ret = crypto_acomp_decompress(zs->req);
+	if (!ret && zs->req->dlen != PAGE_SIZE)
+		ret = -EIO;
+
+	zs->nr_decomp++;
+	zs->decomp_ns += ktime_get_ns() - start_ns;
+	return ret;
+}
+
+/* The whole page content of @entry into @dst; under the stream lock */
+static int sblkdev_zobj_read(struct sblkdev_zstrm *zs, void *entry, void *dst)
+{
+	struct sblkdev_zobj *zobj = entry;
+
+	if (!entry) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+	if (xa_is_value(entry)) {
+		sblkdev_fill(dst, xa_to_value(entry), 0, PAGE_SIZE);
+		return 0;
+	}
+	if (zobj->page) {
+		memcpy_from_page(dst, zobj->page, 0, PAGE_SIZE);
+		return 0;
+	}
+	return sblkdev_zstrm_decompress(zs, zobj, dst);
+}
+
+/* An object for an incompressible page */
+static struct sblkdev_zobj *sblkdev_zobj_alloc_page(gfp_t gfp)
+{
+	struct sblkdev_zobj *zobj;
+
+	zobj = kmalloc(sizeof(*zobj), gfp);
+	if (!zobj)
+		return NULL;
+	zobj->page = alloc_page(gfp | __GFP_HIGHMEM);
+	if (!zobj->page) {
+		kfree(zobj);
+		return NULL;
+	}
+	zobj->len = PAGE_SIZE;
+	return zobj;
+}
+
+/*
+ * Compress the page at @idx after copying @chunk bytes of @buf into it at
+ * @offset, and swap the result in. Allocations are made with the locks held,
+ * so they can't sleep; if they fail and @gfp allows it, a page sized object
+ * (which always fits) and the xarray slot are allocated without the locks and
+ * the whole thing is done again.
+ */
+static int sblkdev_store_write_comp(struct sblkdev_store *store, const void *buf,
+				    pgoff_t idx, unsigned int offset, size_t chunk,
+				    gfp_t gfp)
+{
+	struct sblkdev_store_comp *comp = store->comp;
+	spinlock_t *lock = &comp->locks[hash_long(idx, SBLKDEV_STORE_LOCK_BITS)];
+	gfp_t gfp_atomic = (gfp & ~__GFP_DIRECT_RECLAIM) | __GFP_NOWARN;
+	struct sblkdev_zobj *zobj, *spare = NULL;
+	struct sblkdev_zstrm *zs;
+	bool retried = false;
+	unsigned long word;
+	const void *src;
+	void *old, *fill;
+	unsigned int dlen;
+	int ret;
+
+retry:
+	local_lock(&comp->strm->lock);
+	zs = this_cpu_ptr(comp->strm);
+	spin_lock(lock);
+	rcu_read_lock();
+	old = xa_load(store->pages, idx);
+
+	if (chunk == PAGE_SIZE) {
+		src = buf;
+	} else {
+		ret = sblkdev_zobj_read(zs, old, zs->scratch);
+		if (ret)
+			goto out_unlock;
+		memcpy(zs->scratch + offset, buf, chunk);
+		src = zs->scratch;
+	}
+
+	/* Same-filled: nothing to compress, nothing to allocate */
+	if (sblkdev_same_filled(src, &word) && sblkdev_fill_entry(store, word, &fill)) {
+		ret = sblkdev_store_replace(store, idx, fill, gfp_atomic);
+		goto out_unlock;
+	}
+
+	zobj = NULL;
+	if (!sblkdev_zstrm_compress(zs, src, &dlen) && dlen <= SBLKDEV_ZOBJ_MAX) {
+		zobj = kmalloc(struct_size(zobj, data, dlen), gfp_atomic);
+		if (zobj) {
+			zobj->page = NULL;
+			zobj->len = dlen;
+			memcpy(zobj->data, zs->buf, dlen);
+		}
+	}
+	if (!zobj) {
+		/* Incompressible, or no memory for the compressed object */
+		zobj = spare ? : sblkdev_zobj_alloc_page(gfp_atomic);
+		if (!zobj) {
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+		if (zobj == spare)
+			spare = NULL;
+		memcpy_to_page(zobj->page, 0, src, PAGE_SIZE);
+	}
+
+	ret = sblkdev_store_replace(store, idx, zobj, gfp_atomic);
+	if (ret) {
+		if (zobj->page && !spare)
+			spare = zobj;	/* still good for the next try */
+		else
+			sblkdev_zobj_free(zobj);
+	}
+
+out_unlock:
+	rcu_read_unlock();
+	spin_unlock(lock);
+	local_unlock(&comp->strm->lock);
+
+	if (ret == -ENOMEM && gfpflags_allow_blocking(gfp) && !retried) {
+		retried = true;
+		if (!spare)
+			spare = sblkdev_zobj_alloc_page(gfp);
+		if (spare && !xa_reserve(store->pages, idx, gfp))
+			goto retry;
+	}
+	if (spare)
+		sblkdev_zobj_free(spare);
+
+	return ret;
+}
+
+static int sblkdev_store_read_comp(struct sblkdev_store *store, void *buf,
+				   pgoff_t idx, unsigned int offset, size_t chunk)
+{
+	struct sblkdev_store_comp *comp = store->comp;
+	struct sblkdev_zobj *zobj;
+	struct sblkdev_zstrm *zs;
+	int ret = 0;
+
+	rcu_read_lock();
+	zobj = xa_load(store->pages, idx);
+	if (!zobj) {
+		memset(buf, 0, chunk);
+	} else if (xa_is_value(zobj)) {
+		sblkdev_fill(buf, xa_to_value(zobj), offset, chunk);
+	} else if (zobj->page) {
+		memcpy_from_page(buf, zobj->page, offset, chunk);
+	} else {
+		local_lock(&comp->strm->lock);
+		zs = this_cpu_ptr(comp->strm);
+		if (chunk == PAGE_SIZE) {
+			ret = sblkdev_zstrm_decompress(zs, zobj, buf);
+		} else {
+			ret = sblkdev_zstrm_decompress(zs, zobj, zs->scratch);
+			if (!ret)
+				memcpy(buf, zs->scratch + offset, chunk);
+		}
+		local_unlock(&comp->strm->lock);
+	}
+	rcu_read_unlock();
+
+	if (ret)
+		pr_err_ratelimited("Failed to decompress page %lu: %d\n", idx, ret);
+	return ret;
+}
+
+/*
+ * The copy engine. Writes of large I/Os are streamed with non-temporal stores
+ * (memcpy_flushcache(); a plain memcpy() where the arch has none), so data that
+ * nobody is going to read soon doesn't evict the submitter's working set from
+ * the caches. Small ones stay with memcpy(): the data may well be read back.
+ */
+static inline void sblkdev_copy(void *dst, const void *src, size_t len, bool nt)
+{
+	if (nt)
+		memcpy_flushcache(dst, src, len);
+	else
+		memcpy(dst, src, len);
+}
+
+static inline void sblkdev_copy_to_page(struct page *page, size_t offset,
+					const void *src, size_t len, bool nt)
+{
+	void *addr = kmap_local_page(page);
+
+	sblkdev_copy(addr + offset, src, len, nt);
+	kunmap_local(addr);
+}
+
+/*
+ * NUMA placement
+ */
+
+/* The node to put page @idx on; NUMA_NO_NODE: the local one */
+static int sblkdev_store_node(struct sblkdev_store *store, pgoff_t idx)
+{
+	struct sblkdev_store_numa *numa = store->numa;
+
+	if (!numa)
+		return NUMA_NO_NODE;
+	if (numa->policy == SBLKDEV_NUMA_BIND)
+		return numa->node;
+	if (numa->policy == SBLKDEV_NUMA_INTERLEAVE)
+		return numa->nodes[(idx >> numa->stripe_order) % numa->nr_nodes];
+	return NUMA_NO_NODE;
+}
+
+static inline struct folio *sblkdev_folio_alloc_node(gfp_t gfp, unsigned int order,
+						     int nid)
+{
+	if (nid == NUMA_NO_NODE)
+		return folio_alloc(gfp, order);
+	return __folio_alloc_node(gfp, order, nid);
+}
+
+/* Account @bytes copied to or from memory on node @nid */
+static inline void sblkdev_store_traffic(struct sblkdev_store *store, int nid,
+					 size_t bytes)
+{
+	u64 __percpu *counter;
+
+	if (!store->numa)
+		return;
+	counter = store->numa->traffic + 2 * nid + (nid != numa_node_id());
+	this_cpu_add(*counter, bytes);
+}
+
+/*
+ * Uncompressed pages
+ */
+
+/* The entry for @idx in the frozen layers under the top one; under RCU */
+static void *sblkdev_store_lookup_base(struct sblkdev_store *store, pgoff_t idx)
+{
+	struct sblkdev_store_layer *layer;
+	void *entry = NULL;
+
+	for (layer = store->base; layer && !entry; layer = layer->parent)
+		entry = xa_load(layer->pages, idx);
+	return entry;
+}
+
+/* The entry that holds the data of @idx, in whichever layer; under RCU */
+static inline void *sblkdev_store_lookup(struct sblkdev_store *store, pgoff_t idx)
+{
+	void *entry = xa_load(store->pages, idx);
+
+	if (!entry && store->base)
+		entry = sblkdev_store_lookup_base(store, idx);
+	return entry;
+}
+
+/* The page for @idx of @page, which may be the head of a large folio */
+static inline struct page *sblkdev_subpage(struct page *page, pgoff_t idx)
+{
+	return nth_page(page, idx & (compound_nr(page) - 1));
+}
+
+static inline bool sblkdev_entry_is_large(void *entry)
+{
+	return entry && !xa_is_value(entry) && PageHead((struct page *)entry);
+}
+
+/* The whole content of page @idx of @entry into @page; under RCU */
+static void sblkdev_store_copy_entry(void *entry, pgoff_t idx, struct page *page)
+{
+	void *addr;
+
+	if (!entry) {
+		clear_highpage(page);
+	} else if (xa_is_value(entry)) {
+		addr = kmap_local_page(page);
+		sblkdev_fill(addr, xa_to_value(entry), 0, PAGE_SIZE);
+		kunmap_local(addr);
+	} else {
+		copy_highpage(page, sblkdev_subpage(entry, idx));
+	}
+}
+
+/*
+ * Large chunk mode: copy the part of [@pos, @pos + @len) that's in one large
+ * folio at once, straight through its (direct map) address. Returns the number
+ * of bytes copied; 0 if @pos isn't in a large folio.
+ */
+static size_t sblkdev_store_copy_folio(struct sblkdev_store *store, void *buf,
+				       loff_t pos, size_t len, bool write, bool nt)
+{
+	struct folio *folio;
+	size_t offset, n = 0;
+	void *entry;
+
+	rcu_read_lock();
+	entry = xa_load(store->pages, pos >> PAGE_SHIFT);
+	if (sblkdev_entry_is_large(entry)) {
+		folio = page_folio(entry);
+		/* Folios are naturally aligned in the device too */
+		offset = pos & (folio_size(folio) - 1);
+		n = min(len, folio_size(folio) - offset);
+		sblkdev_store_traffic(store, folio_nid(folio), n);
+		if (write)
+			sblkdev_copy(folio_address(folio) + offset, buf, n, nt);
+		else
+			memcpy(buf, folio_address(folio) + offset, n);
+	}
+	rcu_read_unlock();
+
+	return n;
+}
+
+/*
+ * Large chunk mode: put a zeroed folio over the whole, empty, chunk that holds
+ * @idx. False if it can't be had right away, or part of the chunk already has
+ * pages; the caller then falls back to a single page.
+ */
+static bool sblkdev_store_insert_folio(struct sblkdev_store *store, pgoff_t idx,
+				       gfp_t gfp)
+{
+#ifdef CONFIG_XARRAY_MULTI
+	unsigned int order = store->chunk_order;
+	pgoff_t first = round_down(idx, 1UL << order);
+	XA_STATE_ORDER(xas, store->pages, first, order);
+	bool conflict = false;
+	struct folio *folio;
+	unsigned long start = first;
+	void *entry;
+
+	/* Cheap check first: a zeroed 2M folio isn't */
+	if (xa_find(store->pages, &start, first + (1UL << order) - 1, XA_PRESENT))
+		return false;
+
+	folio = sblkdev_folio_alloc_node(gfp | __GFP_ZERO | __GFP_NORETRY | __GFP_NOWARN,
+					 order, sblkdev_store_node(store, first));
+	if (!folio)
+		return false;
+
+	/* A snapshot copies the chunk up from the layers below */
+	if (store->base) {
+		pgoff_t i;
+
+		rcu_read_lock();
+		for (i = 0; i < folio_nr_pages(folio); i++) {
+			entry = sblkdev_store_lookup_base(store, first + i);
+			if (entry)
+				sblkdev_store_copy_entry(entry, first + i,
+							 folio_page(folio, i));
+		}
+		rcu_read_unlock();
+	}
+
+	do {
+		xas_lock(&xas);
+		xas_for_each_conflict(&xas, entry) {
+			conflict = true;
+			break;
+		}
+		if (!conflict)
+			xas_store(&xas, folio_page(folio, 0));
+		xas_unlock(&xas);
+	} while (!conflict && xas_nomem(&xas, gfp));
+
+	if (conflict || xas_error(&xas)) {
+		folio_put(folio);
+		return false;
+	}
+	atomic_long_add(folio_nr_pages(folio), &store->nr_pages);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Write within one page. A private page is written in place; anything else
+ * (hole, same-filled or shared) is first copied to a new private page, which
+ * then replaces it - unless someone else changed the slot meanwhile, in which
+ * case it's all done again.
+ */
+static int sblkdev_store_write_page(struct sblkdev_store *store, const void *buf,
+				    pgoff_t idx, unsigned int offset, size_t chunk,
+				    gfp_t gfp, bool nt)
+{
+	struct page *page = NULL;
+	bool retried = false;
+	void *entry, *cur;
+	int ret = 0;
+
+	for (;;) {
+		rcu_read_lock();
+		entry = xa_load(store->pages, idx);
+		if (entry && !xa_is_value(entry) && !page_private((struct page *)entry)) {
+			sblkdev_store_traffic(store, page_to_nid(entry), chunk);
+			sblkdev_copy_to_page(sblkdev_subpage(entry, idx), offset, buf, chunk, nt);
+			rcu_read_unlock();
+			break;
+		}
+		if (!page) {
+			rcu_read_unlock();
+			page = alloc_pages_node(sblkdev_store_node(store, idx),
+						gfp | __GFP_HIGHMEM, 0);
+			if (!page)
+				return -ENOMEM;
+			continue;
+		}
+
+		/* The data to copy up may be in a layer below */
+		sblkdev_store_copy_entry(entry ? : sblkdev_store_lookup_base(store, idx),
+					 idx, page);
+		sblkdev_copy_to_page(page, offset, buf, chunk, nt);
+		sblkdev_store_traffic(store, page_to_nid(page), chunk);
+		cur = xa_cmpxchg(store->pages, idx, entry, page, GFP_NOWAIT | __GFP_NOWARN);
+		rcu_read_unlock();
+
+		if (cur == entry) {
+			sblkdev_store_account(store, page, 1);
+			sblkdev_store_release(store, entry);
+			page = NULL;
+			break;
+		}
+		if (xa_is_err(cur)) {
+			/* No memory for a new xarray node: get the slot without the RCU lock */
+			ret = xa_err(cur);
+			if (retried || !gfpflags_allow_blocking(gfp))
+				break;
+			retried = true;
+			ret = xa_reserve(store->pages, idx, gfp);
+			if (ret)
+				break;
+		}
+	}
+
+	if (page)
+		__free_page(page);
+	return ret;
+}
+
+/* A whole page that is neither same-filled nor compressed */
+static int sblkdev_store_write_full(struct sblkdev_store *store, const void *buf,
+				    pgoff_t idx, gfp_t gfp, bool nt)
+{
+	struct sblkdev_dpage *dp;
+	int ret;
+
+	if (!store->dedup)
+		return sblkdev_store_write_page(store, buf, idx, 0, PAGE_SIZE, gfp, nt);
+
+	dp = sblkdev_dedup_get(store->dedup, buf, gfp);
+	if (!dp)
+		return -ENOMEM;
+	ret = sblkdev_store_replace(store, idx, dp->page, gfp);
+	if (ret)
+		sblkdev_dedup_put(store->dedup, dp);
+	return ret;
+}
+
+/*
+ * sblkdev_store_read() - Copy @len bytes at device offset @pos into @buf
+ * Holes (never written pages) read back as zeroes, without allocating. Fails
+ * only if a compressed page can't be decompressed.
+ */
+int sblkdev_store_read(struct sblkdev_store *store, void *buf, loff_t pos,
+		       size_t len)
+{
+	while (len) {
+		pgoff_t idx = pos >> PAGE_SHIFT;
+		unsigned int offset = offset_in_page(pos);
+		size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+		size_t done;
+		void *entry;
+
+		if (store->chunk_order) {
+			done = sblkdev_store_copy_folio(store, buf, pos, len, false, false);
+			if (done) {
+				chunk = done;
+				goto next;
+			}
+		}
+
+		if (store->comp) {
+			int ret = sblkdev_store_read_comp(store, buf, idx, offset, chunk);
+
+			if (ret)
+				return ret;
+			goto next;
+		}
+
+		rcu_read_lock();
+		entry = sblkdev_store_lookup(store, idx);
+		if (!entry)
+			memset(buf, 0, chunk);
+		else if (xa_is_value(entry))
+			sblkdev_fill(buf, xa_to_value(entry), offset, chunk);
+		else {
+			sblkdev_store_traffic(store, page_to_nid(entry), chunk);
+			memcpy_from_page(buf, sblkdev_subpage(entry, idx), offset, chunk);
+		}
+		rcu_read_unlock();
+next:
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * sblkdev_store_write() - Copy @len bytes from @buf to device offset @pos
+ * Missing pages are allocated with @gfp; returns -ENOMEM if that fails, in
+ * which case the write may have been partially done (writes are idempotent, so
+ * the caller can simply retry the whole I/O).
+ * @nt: copy with non-temporal stores, see sblkdev_store_nt(); the caller fences
+ * them with sblkdev_store_nt_fence() once the whole I/O is copied.
+ */
+int sblkdev_store_write(struct sblkdev_store *store, const void *buf,
+			loff_t pos, size_t len, gfp_t gfp, bool nt)
+{
+	int ret = 0;
+
+	while (len) {
+		pgoff_t idx = pos >> PAGE_SHIFT;
+		unsigned int offset = offset_in_page(pos);
+		size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+		unsigned long word;
+		size_t done;
+		void *fill;
+
+		if (store->chunk_order) {
+			done = sblkdev_store_copy_folio(store, (void *)buf, pos, len, true, nt);
+			if (done) {
+				chunk = done;
+				goto next;
+			}
+			if (sblkdev_store_insert_folio(store, idx, gfp))
+				continue;	/* and copy into it */
+		}
+
+		/*
+		 * Fallback pages of the large chunk mode are only ever written in
+		 * place or replaced through cmpxchg: a plain store into a slot
+		 * that has just become part of a folio would clobber the folio.
+		 * So are pinned pages, which are private and may be mapped.
+		 */
+		if (store->comp)
+			ret = sblkdev_store_write_comp(store, buf, idx, offset, chunk, gfp);
+		else if (chunk != PAGE_SIZE || store->chunk_order || store->pinned)
+			ret = sblkdev_store_write_page(store, buf, idx, offset, chunk, gfp, nt);
+		else if (sblkdev_same_filled(buf, &word) && sblkdev_fill_entry(store, word, &fill))
+			ret = sblkdev_store_replace(store, idx, fill, gfp);
+		else
+			ret = sblkdev_store_write_full(store, buf, idx, gfp, nt);
+		if (ret)
+			break;
+next:
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+
+	return ret;
+}
+
+/*
+ * Zero part of a page; a hole is already zero. Only a private page can be
+ * zeroed in place, anything else takes a write, which may need memory.
+ */
+static int sblkdev_store_zero(struct sblkdev_store *store, loff_t pos, size_t len)
+{
+	void *entry;
+
+	rcu_read_lock();
+	entry = sblkdev_store_lookup(store, pos >> PAGE_SHIFT);
+	rcu_read_unlock();
+
+	if (!entry)
+		return 0;
+	return sblkdev_store_write(store, page_address(ZERO_PAGE(0)), pos, len,
+				   GFP_NOWAIT | __GFP_NOWARN, false);
+}
+
+/*
+ * A snapshot: put zero value entries over the pages of [@first, @last] that
+ * the layers below have, where the top layer now has none.
+ */
+static int sblkdev_store_discard_base(struct sblkdev_store *store, pgoff_t first,
+				      pgoff_t last)
+{
+	struct sblkdev_store_layer *layer;
+	unsigned long idx;
+	void *entry, *cur;
+
+	for (layer = store->base; layer; layer = layer->parent) {
+		xa_for_each_range(layer->pages, idx, entry, first, last) {
+			pgoff_t i = idx, end = idx;
+
+			if (sblkdev_entry_is_large(entry)) {
+				pgoff_t start = round_down(idx, compound_nr(entry));
+
+				i = max(start, first);
+				end = min(start + compound_nr(entry) - 1, last);
+			}
+			for (; i <= end; i++) {
+				cur = xa_cmpxchg(store->pages, i, NULL, xa_mk_value(0),
+						 GFP_NOWAIT | __GFP_NOWARN);
+				if (xa_is_err(cur))
+					return xa_err(cur);
+				if (!cur)
+					atomic_long_inc(&store->nr_filled);
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * sblkdev_store_discard() - Release the backing memory of a range
+ * Pages fully inside the range go back to the page allocator (and so read back
+ * as zeroes); partially covered pages at either end are zeroed. This normally
+ * doesn't allocate, so it serves both discard and write-zeroes - except that
+ * zeroing part of a page that isn't private may, and fail with -ENOMEM.
+ */
+int sblkdev_store_discard(struct sblkdev_store *store, loff_t pos, size_t len)
+{
+	pgoff_t first, last;
+	unsigned long idx;
+	void *entry;
+	int ret;
+
+	if (offset_in_page(pos)) {
+		size_t head = min_t(size_t, len, PAGE_SIZE - offset_in_page(pos));
+
+		ret = sblkdev_store_zero(store, pos, head);
+		if (ret)
+			return ret;
+		pos += head;
+		len -= head;
+	}
+	if (offset_in_page(len)) {
+		ret = sblkdev_store_zero(store, pos + (len & PAGE_MASK),
+					 offset_in_page(len));
+		if (ret)
+			return ret;
+		len &= PAGE_MASK;
+	}
+	if (!len)
+		return 0;
+
+	/* Only visits the pages that actually exist */
+	first = pos >> PAGE_SHIFT;
+	last = ((pos + len) >> PAGE_SHIFT) - 1;
+	xa_for_each_range(store->pages, idx, entry, first, last) {
+		/* A pinned page may be mapped: it stays */
+		if (store->pinned) {
+			clear_highpage(entry);
+			continue;
+		}
+		if (sblkdev_entry_is_large(entry)) {
+			struct folio *folio = page_folio(entry);
+			pgoff_t start = round_down(idx, folio_nr_pages(folio));
+			pgoff_t end = start + folio_nr_pages(folio) - 1;
+
+			/* A folio only partly in the range is zeroed, not split */
+			if (start < first || end > last) {
+				start = max(start, first);
+				end = min(end, last);
+				memset(folio_address(folio) + offset_in_folio(folio,
+				       (loff_t)start << PAGE_SHIFT), 0,
+				       (end - start + 1) << PAGE_SHIFT);
+				continue;
+			}
+		}
+		sblkdev_store_release(store, xa_erase(store->pages, idx));
+	}
+
+	if (store->base)
+		return sblkdev_store_discard_base(store, first, last);
+	return 0;
+}
+
+static void sblkdev_store_comp_free(struct sblkdev_store_comp *comp)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct sblkdev_zstrm *zs = per_cpu_ptr(comp->strm, cpu);
+
+		kfree(zs->scratch);
+		kfree(zs->buf);
+		if (zs->req)
+			acomp_request_free(zs->req);
+		if (!IS_ERR_OR_NULL(zs->tfm))
+			crypto_free_acomp(zs->tfm);
+	}
+	free_percpu(comp->strm);
+	kfree(comp);
+}
+
+/*
+ * One transform per CPU: a software compressor keeps its working memory in the
+ * transform. Only synchronous implementations are asked for, as the I/O path
+ * can't wait.
+ */
+static int sblkdev_store_comp_init(struct sblkdev_store *store, const char *alg)
+{
+	struct sblkdev_store_comp *comp;
+	int cpu, i;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return -ENOMEM;
+	strscpy(comp->alg, alg, sizeof(comp->alg));
+	for (i = 0; i < ARRAY_SIZE(comp->locks); i++)
+		spin_lock_init(&comp->locks[i]);
+	atomic_long_set(&comp->nr_zobjs, 0);
+	atomic_long_set(&comp->zbytes, 0);
+
+	comp->strm = alloc_percpu(struct sblkdev_zstrm);
+	if (!comp->strm) {
+		kfree(comp);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct sblkdev_zstrm *zs = per_cpu_ptr(comp->strm, cpu);
+
+		local_lock_init(&zs->lock);
+		zs->tfm = crypto_alloc_acomp(alg, 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(zs->tfm)) {
+			int ret = PTR_ERR(zs->tfm);
+
+			pr_err("Compression algorithm '%s' not available: %d\n", alg, ret);
+			sblkdev_store_comp_free(comp);
+			return ret;
+		}
+		zs->req = acomp_request_alloc(zs->tfm);
+		zs->buf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+		zs->scratch = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!zs->req || !zs->buf || !zs->scratch) {
+			sblkdev_store_comp_free(comp);
+			return -ENOMEM;
+		}
+		acomp_request_set_callback(zs->req, 0, NULL, NULL);
+	}
+
+	store->comp = comp;
+	pr_info("compressing with %s\n", alg);
+	return 0;
+}
+
+/* The index gets about a bucket per 4 pages of capacity */
+static int sblkdev_store_dedup_init(struct sblkdev_store *store, loff_t size)
+{
+	struct sblkdev_store_dedup *dd;
+	unsigned long nr_buckets;
+	int i;
+
+	dd = kzalloc(sizeof(*dd), GFP_KERNEL);
+	if (!dd)
+		return -ENOMEM;
+
+	nr_buckets = clamp_t(unsigned long, size >> (PAGE_SHIFT + 2), 1UL << 10, 1UL << 22);
+	dd->hash_bits = ilog2(nr_buckets);
+	dd->buckets = kvcalloc(1UL << dd->hash_bits, sizeof(*dd->buckets), GFP_KERNEL);
+	if (!dd->buckets) {
+		kfree(dd);
+		return -ENOMEM;
+	}
+	for (i = 0; i < ARRAY_SIZE(dd->locks); i++)
+		spin_lock_init(&dd->locks[i]);
+	atomic_long_set(&dd->nr_pages, 0);
+	atomic_long_set(&dd->nr_refs, 0);
+
+	store->dedup = dd;
+	pr_info("deduplicating whole pages, %lu index buckets\n", 1UL << dd->hash_bits);
+	return 0;
+}
+
+/*
+ * sblkdev_store_get_page() - Page @idx of a pinned store, referenced
+ * A hole gets a zeroed page, allocated with @gfp, for good: the caller may
+ * map it, and data written to the device afterwards must show through.
+ * Returns NULL if there's no memory for it.
+ */
+struct page *sblkdev_store_get_page(struct sblkdev_store *store, pgoff_t idx, gfp_t gfp)
+{
+	struct page *page;
+
+	for (;;) {
+		rcu_read_lock();
+		page = xa_load(store->pages, idx);
+		/* Pinned pages are only freed with the store */
+		if (page)
+			get_page(page);
+		rcu_read_unlock();
+		if (page)
+			return page;
+
+		/* Racing writers of the slot all end up with the same page */
+		if (sblkdev_store_write_page(store, page_address(ZERO_PAGE(0)), idx, 0,
+					     PAGE_SIZE, gfp, false))
+			return NULL;
+	}
+}
+
+/*
+ * sblkdev_store_next() - The first page in [@idx, @end) with data in it if
+ * @data, or else the first hole; @end if there's none. For SEEK_DATA and
+ * SEEK_HOLE on a store with a single layer of single pages, e.g. a pinned one.
+ */
+pgoff_t sblkdev_store_next(struct sblkdev_store *store, pgoff_t idx, pgoff_t end,
+			   bool data)
+{
+	XA_STATE(xas, store->pages, idx);
+	void *entry;
+
+	if (idx >= end)
+		return end;
+
+	rcu_read_lock();
+	xas_for_each(&xas, entry, end - 1) {
+		if (xas_retry(&xas, entry))
+			continue;
+		if (data || xas.xa_index != idx)
+			break;
+		idx++;
+	}
+	rcu_read_unlock();
+
+	if (data)
+		return entry ? xas.xa_index : end;
+	return idx;
+}
+
+/*
+ * sblkdev_store_direct_access() - Where pages from @pgoff on are, for DAX
+ * Up to @nr_pages of them, as many as are physically contiguous.
+ */
+long sblkdev_store_direct_access(struct sblkdev_store *store, pgoff_t pgoff,
+				 long nr_pages, void **kaddr, unsigned long *pfn)
+{
+	XA_STATE(xas, store->pages, pgoff);
+	struct page *page;
+	long nr = 1;
+
+	/* The pages of a DAX store stay put: no need to hold the RCU lock after */
+	rcu_read_lock();
+	page = xas_load(&xas);
+	if (!page || xa_is_value(page)) {
+		rcu_read_unlock();
+		return -ERANGE;
+	}
+	while (nr < nr_pages && xas_next(&xas) == nth_page(page, nr))
+		nr++;
+	rcu_read_unlock();
+
+	if (kaddr)
+		*kaddr = page_address(page);
+	if (pfn)
+		*pfn = page_to_pfn(page);
+	return nr;
+}
+
+/*
+ * A DAX store: all the pages of the device, from the start. The blocks are
+ * split, but the pages of one stay contiguous and naturally aligned.
+ */
+static int sblkdev_store_populate(struct sblkdev_store *store, loff_t size)
+{
+	pgoff_t idx = 0, end = DIV_ROUND_UP(size, PAGE_SIZE);
+	unsigned int order = SBLKDEV_DAX_ORDER;
+	unsigned long i, nr;
+	struct page *page;
+	int ret = 0;
+
+	while (idx < end) {
+		/* Once smaller blocks are all there is, no point in trying again */
+		page = alloc_pages_node(sblkdev_store_node(store, idx),
+					GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, order);
+		if (!page) {
+			if (!order)
+				return -ENOMEM;
+			order--;
+			continue;
+		}
+		split_page(page, order);
+
+		nr = 1UL << order;
+		for (i = 0; i < nr && idx < end && !ret; i++, idx++) {
+			ret = xa_err(xa_store(store->pages, idx, nth_page(page, i),
+					      GFP_KERNEL));
+			if (!ret)
+				atomic_long_inc(&store->nr_pages);
+		}
+		/* Past the end of the device, or not stored */
+		for (i -= !!ret; i < nr; i++)
+			__free_page(nth_page(page, i));
+		if (ret)
+			return ret;
+		cond_resched();
+	}
+	if (order < SBLKDEV_DAX_ORDER)
+		pr_info("DAX: down to %lu KiB blocks\n", (PAGE_SIZE << order) / SZ_1K);
+	return 0;
+}
+
+static void sblkdev_store_numa_free(struct sblkdev_store_numa *numa)
+{
+	if (!numa)
+		return;
+	free_percpu(numa->traffic);
+	kfree(numa->nodes);
+	kfree(numa);
+}
+
+static int sblkdev_store_numa_init(struct sblkdev_store *store,
+				   const struct sblkdev_store_opts *opts)
+{
+	struct sblkdev_store_numa *numa;
+	int nid;
+
+	if (opts->numa_policy == SBLKDEV_NUMA_BIND &&
+	    (opts->numa_node < 0 || opts->numa_node >= nr_node_ids ||
+	     !node_state(opts->numa_node, N_MEMORY))) {
+		pr_err("Node %d has no memory\n", opts->numa_node);
+		return -EINVAL;
+	}
+
+	numa = kzalloc(sizeof(*numa), GFP_KERNEL);
+	if (!numa)
+		return -ENOMEM;
+	numa->policy = opts->numa_policy;
+	numa->node = opts->numa_node;
+	/* A chunk, or a DAX block, isn't split over nodes */
+	numa->stripe_order = max3(opts->numa_stripe_order, opts->chunk_order,
+				  opts->dax ? SBLKDEV_DAX_ORDER : 0U);
+	numa->nodes = kcalloc(num_node_state(N_MEMORY), sizeof(*numa->nodes),
+			      GFP_KERNEL);
+	numa->traffic = __alloc_percpu(2 * nr_node_ids * sizeof(u64), __alignof__(u64));
+	if (!numa->nodes || !numa->traffic) {
+		sblkdev_store_numa_free(numa);
+		return -ENOMEM;
+	}
+	for_each_node_state(nid, N_MEMORY)
+		numa->nodes[numa->nr_nodes++] = nid;
+
+	store->numa = numa;
+	if (numa->policy == SBLKDEV_NUMA_INTERLEAVE)
+		pr_info("interleaved over %u node(s) in %lu KiB stripes\n",
+			numa->nr_nodes, (PAGE_SIZE << numa->stripe_order) / SZ_1K);
+	return 0;
+}
+
+static struct xarray *sblkdev_store_xa_alloc(void)
+{
+	struct xarray *pages = kmalloc(sizeof(*pages), GFP_KERNEL);
+
+	if (pages)
+		xa_init(pages);
+	return pages;
+}
+
+/*
+ * sblkdev_store_init() - Set up an empty store
+ * The store options combine as: same-filled pages always; then compression,
+ * dedup, large chunks or DAX, one at most.
+ */
+int sblkdev_store_init(struct sblkdev_store *store, const struct sblkdev_store_opts *opts)
+{
+	int ret = 0;
+
+	store->pages = NULL;
+	store->base = NULL;
+	atomic_long_set(&store->nr_pages, 0);
+	atomic_long_set(&store->nr_filled, 0);
+	store->comp = NULL;
+	store->dedup = NULL;
+	store->chunk_order = opts->chunk_order;
+	store->dax = opts->dax;
+	store->pinned = opts->pinned || opts->dax;
+	store->numa = NULL;
+
+	if (!!opts->comp_alg + opts->dedup + !!opts->chunk_order + opts->dax > 1) {
+		pr_err("Compression, dedup, large chunks and DAX don't go together\n");
+		return -EINVAL;
+	}
+	/* Pinned pages are single, private pages */
+	if (opts->pinned && (opts->comp_alg || opts->dedup || opts->chunk_order)) {
+		pr_err("Pinned pages can't be compressed, shared or large\n");
+		return -EINVAL;
+	}
+	if (opts->chunk_order) {
+		if (!IS_ENABLED(CONFIG_XARRAY_MULTI)) {
+			pr_err("Large chunks need CONFIG_XARRAY_MULTI\n");
+			return -EOPNOTSUPP;
+		}
+		if (opts->chunk_order > SBLKDEV_MAX_PAGE_ORDER) {
+			pr_err("Chunks can't be larger than %lu KiB\n",
+			       (PAGE_SIZE << SBLKDEV_MAX_PAGE_ORDER) / SZ_1K);
+			return -EINVAL;
+		}
+		pr_info("allocating in %lu KiB chunks\n",
+			(PAGE_SIZE << opts->chunk_order) / SZ_1K);
+	}
+
+	store->pages = sblkdev_store_xa_alloc();
+	if (!store->pages)
+		return -ENOMEM;
+	/* Before any page gets allocated */
+	if (opts->numa_policy != SBLKDEV_NUMA_DEFAULT)
+		ret = sblkdev_store_numa_init(store, opts);
+	if (ret)
+		goto fail;
+
+	if (opts->dedup)
+		ret = sblkdev_store_dedup_init(store, opts->size);
+	else if (opts->comp_alg)
+		ret = sblkdev_store_comp_init(store, opts->comp_alg);
+	else if (opts->dax)
+		ret = sblkdev_store_populate(store, opts->size);
+	if (ret)
+		goto fail;
+	return 0;
+
+fail:
+	/* With the pages populated so far, if any */
+	sblkdev_store_free(store);
+	return ret;
+}
+
+/*
+ * sblkdev_store_snapshot() - Make @snap a copy-on-write snapshot of @store
+ * In constant time: the pages of @store are frozen into a read-only layer,
+ * which both stores then keep under a new, empty, top layer of their own.
+ * @store must be quiesced; @snap is set up, like by sblkdev_store_init().
+ */
+int sblkdev_store_snapshot(struct sblkdev_store *store, struct sblkdev_store *snap)
+{
+	struct sblkdev_store_layer *layer;
+	struct xarray *pages, *snap_pages;
+
+	if (store->comp || store->dedup || store->pinned) {
+		pr_err("Can't snapshot a compressed, deduplicated or pinned store\n");
+		return -EOPNOTSUPP;
+	}
+
+	layer = kzalloc(sizeof(*layer), GFP_KERNEL);
+	pages = sblkdev_store_xa_alloc();
+	snap_pages = sblkdev_store_xa_alloc();
+	if (!layer || !pages || !snap_pages) {
+		kfree(snap_pages);
+		kfree(pages);
+		kfree(layer);
+		return -ENOMEM;
+	}
+
+	/* The layer takes over the reference @store had on the one below */
+	layer->pages = store->pages;
+	layer->parent = store->base;
+	layer->nr_pages = atomic_long_read(&store->nr_pages);
+	refcount_set(&layer->ref, 2);
+
+	store->pages = pages;
+	store->base = layer;
+	atomic_long_set(&store->nr_pages, 0);
+	atomic_long_set(&store->nr_filled, 0);
+
+	snap->pages = snap_pages;
+	snap->base = layer;
+	atomic_long_set(&snap->nr_pages, 0);
+	atomic_long_set(&snap->nr_filled, 0);
+	snap->comp = NULL;
+	snap->dedup = NULL;
+	snap->chunk_order = store->chunk_order;
+	snap->dax = false;
+	snap->pinned = false;
+	snap->numa = NULL;
+	return 0;
+}
+
+/* Drop a reference to a frozen layer; the last one frees it, and so on down */
+static void sblkdev_store_layer_put(struct sblkdev_store_layer *layer)
+{
+	while (layer && refcount_dec_and_test(&layer->ref)) {
+		struct sblkdev_store_layer *parent = layer->parent;
+		unsigned long idx;
+		void *entry;
+
+		/* Private pages only: snapshots are of plain stores */
+		xa_for_each(layer->pages, idx, entry)
+			if (!xa_is_value(entry))
+				put_page(entry);
+		xa_destroy(layer->pages);
+		kfree(layer->pages);
+		kfree(layer);
+		layer = parent;
+	}
+}
+
+/*
+ * sblkdev_store_free() - Release all pages; the device must be quiesced
+ * The frozen layers go once no snapshot needs them anymore.
+ */
+void sblkdev_store_free(struct sblkdev_store *store)
+{
+	unsigned long idx;
+	void *entry;
+
+	if (!store->pages)
+		return;
+
+	xa_for_each(store->pages, idx, entry) {
+		if (xa_is_value(entry))
+			continue;
+		if (store->comp)
+			sblkdev_zobj_free(entry);
+		else if (page_private((struct page *)entry))
+			sblkdev_dedup_put(store->dedup, sblkdev_page_dpage(entry));
+		else
+			put_page(entry);
+	}
+	xa_destroy(store->pages);
+	kfree(store->pages);
+	store->pages = NULL;
+	atomic_long_set(&store->nr_pages, 0);
+	atomic_long_set(&store->nr_filled, 0);
+
+	/* Wait for pages still queued by sblkdev_store_discard() */
+	rcu_barrier();
+
+	sblkdev_store_layer_put(store->base);
+	store->base = NULL;
+
+	if (store->comp) {
+		sblkdev_store_comp_free(store->comp);
+		store->comp = NULL;
+	}
+	if (store->dedup) {
+		kvfree(store->dedup->buckets);
+		kfree(store->dedup);
+		store->dedup = NULL;
+	}
+	sblkdev_store_numa_free(store->numa);
+	store->numa = NULL;
+}
+
+/* Sum a compression stream counter over all CPUs */
+#define sblkdev_zstrm_sum(comp, field) ({				\
+	u64 __sum = 0;							\
+	int __cpu;							\
+	for_each_possible_cpu(__cpu)					\
+		__sum += per_cpu_ptr((comp)->strm, __cpu)->field;	\
+	__sum;								\
+})
+
+/*
+ * sblkdev_store_show() - Memory use of the store, for the debugfs stats file
+ * The compression ratio is of the data stored to the memory it takes.
+ */
+void sblkdev_store_show(struct sblkdev_store *store, struct seq_file *m)
+{
+	struct sblkdev_store_comp *comp = store->comp;
+	struct sblkdev_store_dedup *dd = store->dedup;
+	long nr_pages = atomic_long_read(&store->nr_pages);
+	u64 nr_comp, nr_decomp, data, used;
+	long nr_zobjs;
+
+	seq_printf(m, "pages    %16ld\n", nr_pages);
+	seq_printf(m, "filled   %16ld\n", atomic_long_read(&store->nr_filled));
+	if (store->base) {
+		struct sblkdev_store_layer *layer;
+		unsigned int nr_layers = 0;
+		long frozen = 0;
+
+		for (layer = store->base; layer; layer = layer->parent) {
+			frozen += layer->nr_pages;
+			nr_layers++;
+		}
+		seq_printf(m, "frozen   %16ld (%u snapshot layers)\n", frozen, nr_layers);
+	}
+	if (store->numa) {
+		int nid, cpu;
+
+		/* Only the nodes with memory; pages may only be on those */
+		for_each_node_state(nid, N_MEMORY) {
+			u64 bytes = 0, remote = 0;
+
+			for_each_possible_cpu(cpu) {
+				u64 *traffic = per_cpu_ptr(store->numa->traffic, cpu);
+
+				bytes += traffic[2 * nid] + traffic[2 * nid + 1];
+				remote += traffic[2 * nid + 1];
+			}
+			seq_printf(m, "node%-4d %16llu bytes (%llu remote)\n", nid,
+				   bytes, remote);
+		}
+	}
+	if (dd)
+		seq_printf(m, "shared   %16ld (%ld references)\n",
+			   atomic_long_read(&dd->nr_pages), atomic_long_read(&dd->nr_refs));
+	if (!comp)
+		return;
+
+	nr_zobjs = atomic_long_read(&comp->nr_zobjs);
+	data = ((u64)nr_pages + nr_zobjs) << PAGE_SHIFT;
+	used = ((u64)nr_pages << PAGE_SHIFT) + atomic_long_read(&comp->zbytes);
+	seq_printf(m, "compressed pages %8ld (%s), %llu bytes\n", nr_zobjs, comp->alg,
+		   (u64)atomic_long_read(&comp->zbytes));
+	if (used) {
+		u64 ratio = div64_u64(data * 100, used);
+
+		seq_printf(m, "compression ratio %llu.%02llu\n", ratio / 100, ratio % 100);
+	}
+
+	nr_comp = sblkdev_zstrm_sum(comp, nr_comp);
+	nr_decomp = sblkdev_zstrm_sum(comp, nr_decomp);
+	seq_printf(m, "compress   %16llu ops %20llu ns (%llu ns/op)\n", nr_comp,
+		   sblkdev_zstrm_sum(comp, comp_ns),
+		   nr_comp ? div64_u64(sblkdev_zstrm_sum(comp, comp_ns), nr_comp) : 0);
+	seq_printf(m, "decompress %16llu ops %20llu ns (%llu ns/op)\n", nr_decomp,
+		   sblkdev_zstrm_sum(comp, decomp_ns),
+		   nr_decomp ? div64_u64(sblkdev_zstrm_sum(comp, decomp_ns), nr_decomp) : 0);
+}
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __SBLKDEV_STORE_H__
+#define __SBLKDEV_STORE_H__
+
+#include <linux/types.h>
+#include <linux/xarray.h>
+#include <linux/compiler.h>
+#include <linux/sizes.h>
+#include <asm/barrier.h>
+
+struct seq_file;
+struct sblkdev_store_comp;
+struct sblkdev_store_dedup;
+struct sblkdev_store_layer;
+struct sblkdev_store_numa;
+
+/* Which NUMA nodes the pages of a store go to */
+enum sblkdev_numa_policy {
+	SBLKDEV_NUMA_DEFAULT,		/* The writer's node, unaccounted */
+	SBLKDEV_NUMA_LOCAL,		/* The writer's node */
+	SBLKDEV_NUMA_INTERLEAVE,	/* Stripes, round robin over the nodes */
+	SBLKDEV_NUMA_BIND,		/* One node */
+};
+
+/*
+ * The backing store of a device: a sparse set of pages indexed by the page
+ * offset within the device. A page is only allocated on its first write;
+ * ranges that were never written read back as zeroes.
+ *
+ * Pages filled with a repeated pattern take no memory. Optionally, pages with
+ * the same content are shared (dedup), each page is kept compressed instead
+ * (zram-style), or the memory comes in large folios, see store.c.
+ *
+ * A store may also be a copy-on-write snapshot of another: it then shares the
+ * other's pages, frozen in read-only layers under its own, until written.
+ *
+ * For DAX, a store is allocated in full up front instead, in physically
+ * contiguous runs of pages that then stay put: they may be mapped straight
+ * into user space. A pinned store keeps its pages put too, but is still
+ * allocated as it's written (or mapped).
+ */
+/* How a store keeps its pages */
+struct sblkdev_store_opts {
+	loff_t size;			/* Device size, in bytes */
+	const char *comp_alg;		/* Compress with this crypto algorithm */
+	bool dedup;			/* Share pages with the same content */
+	unsigned int chunk_order;	/* Allocate folios of this order */
+	bool dax;			/* All pages up front, for good */
+	bool pinned;			/* Pages, once there, stay put */
+	enum sblkdev_numa_policy numa_policy;
+	int numa_node;			/* SBLKDEV_NUMA_BIND */
+	unsigned int numa_stripe_order;	/* SBLKDEV_NUMA_INTERLEAVE */
+};
+
+struct sblkdev_store {
+	struct xarray *pages;		/* page index -> struct page (or sblkdev_zobj) */
+	struct sblkdev_store_layer *base; /* Snapshot layers below; NULL: none */
+	atomic_long_t nr_pages;		/* whole private pages currently allocated */
+	atomic_long_t nr_filled;	/* same-filled pages, kept as value entries */
+	struct sblkdev_store_comp *comp; /* NULL: no compression */
+	struct sblkdev_store_dedup *dedup; /* NULL: no dedup */
+	unsigned int chunk_order;	/* 0: a page at a time */
+	bool dax;			/* Fully allocated; pages never move */
+	bool pinned;			/* Pages never move (implied by dax) */
+	struct sblkdev_store_numa *numa; /* NULL: default placement */
+};
+
+/* Writes of at least this many KiB bypass the CPU caches; 0: never (main.c) */
+extern unsigned int sblkdev_nt_copy_kb;
+
+/* Is an I/O of @bytes written with non-temporal stores? */
+static inline bool sblkdev_store_nt(size_t bytes)
+{
+	unsigned int threshold_kb = READ_ONCE(sblkdev_nt_copy_kb);
+
+	return threshold_kb && bytes >= (size_t)threshold_kb * SZ_1K;
+}
+
+/* Non-temporal stores are weakly ordered: fence them before completing the I/O */
+static inline void sblkdev_store_nt_fence(bool nt)
+{
+	if (nt)
+		wmb();
+}
+
+int sblkdev_store_init(struct sblkdev_store *store, const struct sblkdev_store_opts *opts);
+int sblkdev_store_snapshot(struct sblkdev_store *store, struct sblkdev_store *snap);
+void sblkdev_store_free(struct sblkdev_store *store);
+int sblkdev_store_read(struct sblkdev_store *store, void *buf, loff_t pos,
+		       size_t len);
+int sblkdev_store_write(struct sblkdev_store *store, const void *buf,
+			loff_t pos, size_t len, gfp_t gfp, bool nt);
+int sblkdev_store_discard(struct sblkdev_store *store, loff_t pos, size_t len);
+struct page *sblkdev_store_get_page(struct sblkdev_store *store, pgoff_t idx, gfp_t gfp);
+pgoff_t sblkdev_store_next(struct sblkdev_store *store, pgoff_t idx, pgoff_t end,
+			   bool data);
+long sblkdev_store_direct_access(struct sblkdev_store *store, pgoff_t pgoff,
+				 long nr_pages, void **kaddr, unsigned long *pfn);
+void sblkdev_store_show(struct sblkdev_store *store, struct seq_file *m);
+
+#endif /* __SBLKDEV_STORE_H__ */
@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Host-managed zoned block device (ZBD) emulation, for the request-based
+ * scheme only.
+ *
+ * The device is split into equally sized sequential-write-required zones. Each
+ * zone has a write pointer (writes must land exactly on it), an optional
+ * capacity smaller than its size, and a condition (empty, implicitly or
+ * explicitly open, closed, full). The open and active zone limits are enforced
+ * like a ZNS drive would: at the open limit, an implicitly open zone is closed
+ * to make room for a write or an open; if there's none to close, or the active
+ * limit is reached, it fails with BLK_STS_ZONE_{OPEN,ACTIVE}_RESOURCE. Zone
+ * append, report zones and the reset/open/close/finish zone management
+ * operations are supported; a zone reset gives the zone's backing pages back.
+ */
+#define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include "device.h"
+
+#if defined(CONFIG_SBLKDEV_REQUESTS_BASED) && defined(CONFIG_BLK_DEV_ZONED) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+
+struct sblkdev_zone {
+	spinlock_t lock;		/* Serializes writes and zone management */
+	sector_t start;
+	sector_t wp;			/* Write pointer */
+	enum blk_zone_cond cond;
+};
+
+static inline struct sblkdev_zone *sblkdev_zone(struct sblkdev_device *dev,
+						sector_t sector)
+{
+	unsigned int idx = sector >> ilog2(dev->zone_sectors);
+
+	return idx < dev->nr_zones ? &dev->zones[idx] : NULL;
+}
+
+static inline bool sblkdev_zone_is_open(enum blk_zone_cond cond)
+{
+	return cond == BLK_ZONE_COND_IMP_OPEN || cond == BLK_ZONE_COND_EXP_OPEN;
+}
+
+static inline bool sblkdev_zone_is_active(enum blk_zone_cond cond)
+{
+	return sblkdev_zone_is_open(cond) || cond == BLK_ZONE_COND_CLOSED;
+}
+
+/*
+ * Move @zone to condition @cond, keeping the open/active zone counts in step.
+ * Fails, leaving the zone as it was, if that would exceed a zone limit.
+ * Called with the zone lock held.
+ */
+static blk_status_t sblkdev_zone_set_cond(struct sblkdev_device *dev,
+					  struct sblkdev_zone *zone,
+					  enum blk_zone_cond cond)
+{
+	int d_open = sblkdev_zone_is_open(cond) - sblkdev_zone_is_open(zone->cond);
+	int d_active = sblkdev_zone_is_active(cond) - sblkdev_zone_is_active(zone->cond);
+	blk_status_t status = BLK_STS_OK;
+
+	spin_lock(&dev->zone_res_lock);
+	if (d_active > 0 && dev->zone_max_active &&
+	    dev->zone_nr_active >= dev->zone_max_active)
+		status = BLK_STS_ZONE_ACTIVE_RESOURCE;
+	else if (d_open > 0 && dev->zone_max_open &&
+		 dev->zone_nr_open >= dev->zone_max_open)
+		status = BLK_STS_ZONE_OPEN_RESOURCE;
+	if (status == BLK_STS_OK) {
+		dev->zone_nr_open += d_open;
+		dev->zone_nr_active += d_active;
+		zone->cond = cond;
+	}
+	spin_unlock(&dev->zone_res_lock);
+
+	return status;
+}
+
+/*
+ * Close an implicitly open zone other than @zone, for room to open one more:
+ * the first one after @zone, zones busy with a write aside. Returns false if
+ * there was none. Called with @zone's lock held.
+ */
+static bool sblkdev_zone_close_imp_open(struct sblkdev_device *dev,
+					struct sblkdev_zone *zone)
+{
+	unsigned int first = zone - dev->zones;
+	unsigned int i;
+
+	for (i = 1; i < dev->nr_zones; i++) {
+		struct sblkdev_zone *other = &dev->zones[(first + i) % dev->nr_zones];
+		blk_status_t status = BLK_STS_IOERR;
+
+		if (READ_ONCE(other->cond) != BLK_ZONE_COND_IMP_OPEN)
+			continue;
+		/* Zone locks are never waited for while holding another one */
+		if (!spin_trylock(&other->lock))
+			continue;
+		if (other->cond == BLK_ZONE_COND_IMP_OPEN)
+			status = sblkdev_zone_set_cond(dev, other,
+						       other->wp == other->start ?
+						       BLK_ZONE_COND_EMPTY :
+						       BLK_ZONE_COND_CLOSED);
+		spin_unlock(&other->lock);
+		if (status == BLK_STS_OK)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Open @zone, implicitly or explicitly (@cond), closing an implicitly open
+ * zone first if the open limit is reached. Called with the zone lock held.
+ */
+static blk_status_t sblkdev_zone_open(struct sblkdev_device *dev,
+				      struct sblkdev_zone *zone,
+				      enum blk_zone_cond cond)
+{
+	blk_status_t status = sblkdev_zone_set_cond(dev, zone, cond);
+
+	if (status == BLK_STS_ZONE_OPEN_RESOURCE &&
+	    sblkdev_zone_close_imp_open(dev, zone))
+		status = sblkdev_zone_set_cond(dev, zone, cond);
+	return status;
+}
+
+/*
+ * A regular write must start right at the zone's write pointer; a zone append
+ * is placed there by us, and reports back where it went through the request's
+ * sector. Either implicitly opens an empty or closed zone.
+ */
+static blk_status_t sblkdev_zone_write(struct sblkdev_device *dev,
+				       struct request *rq, unsigned int *nr_bytes)
+{
+	bool append = req_op(rq) == REQ_OP_ZONE_APPEND;
+	sector_t sector = blk_rq_pos(rq);
+	struct sblkdev_zone *zone = sblkdev_zone(dev, sector);
+	blk_status_t status;
+
+	if (!zone)
+		return BLK_STS_IOERR;
+
+	spin_lock(&zone->lock);
+
+	if (append)
+		sector = zone->wp;
+	if (zone->cond == BLK_ZONE_COND_FULL || sector != zone->wp ||
+	    zone->wp + blk_rq_sectors(rq) > zone->start + dev->zone_capacity) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	if (zone->cond == BLK_ZONE_COND_EMPTY || zone->cond == BLK_ZONE_COND_CLOSED) {
+		status = sblkdev_zone_open(dev, zone, BLK_ZONE_COND_IMP_OPEN);
+		if (status != BLK_STS_OK)
+			goto out;
+	}
+
+	/* Copy under the zone lock: the write pointer only moves once the data is in */
+	status = sblkdev_transfer(dev, rq, sector << SECTOR_SHIFT, nr_bytes);
+	if (status != BLK_STS_OK)
+		goto out;
+
+	if (append)
+		rq->__sector = sector;
+	zone->wp += blk_rq_sectors(rq);
+	if (zone->wp == zone->start + dev->zone_capacity)
+		sblkdev_zone_set_cond(dev, zone, BLK_ZONE_COND_FULL);
+out:
+	spin_unlock(&zone->lock);
+	return status;
+}
+
+/*
+ * The written data is gone, and so is the memory it took. If it can't all be
+ * discarded, the zone is left as it was: nothing stale reads back below its
+ * write pointer. Called with the zone lock held.
+ */
+static blk_status_t sblkdev_zone_reset(struct sblkdev_device *dev,
+				       struct sblkdev_zone *zone)
+{
+	int ret;
+
+	if (zone->cond == BLK_ZONE_COND_EMPTY)
+		return BLK_STS_OK;
+
+	ret = sblkdev_store_discard(&dev->store, (loff_t)zone->start << SECTOR_SHIFT,
+				    (zone->wp - zone->start) << SECTOR_SHIFT);
+	if (ret)
+		return errno_to_blk_status(ret);
+
+	sblkdev_zone_set_cond(dev, zone, BLK_ZONE_COND_EMPTY);
+	zone->wp = zone->start;
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t sblkdev_zone_mgmt(struct sblkdev_device *dev,
+				      enum req_op op, sector_t sector)
+{
+	struct sblkdev_zone *zone = sblkdev_zone(dev, sector);
+	blk_status_t status = BLK_STS_OK;
+
+	if (!zone || sector != zone->start)
+		return BLK_STS_IOERR;
+
+	spin_lock(&zone->lock);
+	switch (op) {
+	case REQ_OP_ZONE_RESET:
+		status = sblkdev_zone_reset(dev, zone);
+		break;
+	case REQ_OP_ZONE_OPEN:
+		if (zone->cond == BLK_ZONE_COND_FULL)
+			status = BLK_STS_IOERR;
+		else if (zone->cond != BLK_ZONE_COND_EXP_OPEN)
+			status = sblkdev_zone_open(dev, zone, BLK_ZONE_COND_EXP_OPEN);
+		break;
+	case REQ_OP_ZONE_CLOSE:
+		if (sblkdev_zone_is_open(zone->cond))
+			status = sblkdev_zone_set_cond(dev, zone,
+						       zone->wp == zone->start ?
+						       BLK_ZONE_COND_EMPTY :
+						       BLK_ZONE_COND_CLOSED);
+		else if (zone->cond != BLK_ZONE_COND_CLOSED)
+			status = BLK_STS_IOERR;
+		break;
+	case REQ_OP_ZONE_FINISH:
+		status = sblkdev_zone_set_cond(dev, zone, BLK_ZONE_COND_FULL);
+		if (status == BLK_STS_OK)
+			zone->wp = zone->start + dev->zone_sectors;
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+	spin_unlock(&zone->lock);
+
+	return status;
+}
+
+/*
+ * sblkdev_zoned_process() - Execute a request on a zoned device
+ * Reads aren't restricted: above the write pointer they simply return zeroes.
+ */
+blk_status_t sblkdev_zoned_process(struct sblkdev_device *dev, struct request *rq,
+				   unsigned int *nr_bytes)
+{
+	blk_status_t status = BLK_STS_OK;
+	unsigned int i;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		return sblkdev_transfer(dev, rq, blk_rq_pos(rq) << SECTOR_SHIFT, nr_bytes);
+	case REQ_OP_WRITE:
+	case REQ_OP_ZONE_APPEND:
+		return sblkdev_zone_write(dev, rq, nr_bytes);
+	case REQ_OP_ZONE_RESET_ALL:
+		/* As many as can be; the first failure is reported */
+		for (i = 0; i < dev->nr_zones; i++) {
+			blk_status_t ret;
+
+			spin_lock(&dev->zones[i].lock);
+			ret = sblkdev_zone_reset(dev, &dev->zones[i]);
+			spin_unlock(&dev->zones[i].lock);
+			if (status == BLK_STS_OK)
+				status = ret;
+		}
+		return status;
+	case REQ_OP_ZONE_RESET:
+	case REQ_OP_ZONE_OPEN:
+	case REQ_OP_ZONE_CLOSE:
+	case REQ_OP_ZONE_FINISH:
+		return sblkdev_zone_mgmt(dev, req_op(rq), blk_rq_pos(rq));
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+}
+
+/*
+ * sblkdev_report_zones() - The block_device_operations report_zones method
+ */
+int sblkdev_report_zones(struct gendisk *disk, sector_t sector,
+			 unsigned int nr_zones, report_zones_cb cb, void *data)
+{
+	struct sblkdev_device *dev = disk->private_data;
+	struct sblkdev_zone *zone = sblkdev_zone(dev, sector);
+	unsigned int first, i;
+	int ret;
+
+	if (!zone)
+		return 0;
+
+	first = zone - dev->zones;
+	nr_zones = min(nr_zones, dev->nr_zones - first);
+	for (i = 0; i < nr_zones; i++, zone++) {
+		struct blk_zone blkz = {
+			.start = zone->start,
+			.len = dev->zone_sectors,
+			.capacity = dev->zone_capacity,
+			.type = BLK_ZONE_TYPE_SEQWRITE_REQ,
+		};
+
+		spin_lock(&zone->lock);
+		blkz.wp = zone->wp;
+		blkz.cond = zone->cond;
+		spin_unlock(&zone->lock);
+
+		ret = cb(&blkz, i, data);
+		if (ret)
+			return ret;
+	}
+
+	return nr_zones;
+}
+
+/*
+ * sblkdev_zoned_init() - Lay out the zones and set the zoned queue limits
+ * The device capacity is rounded down to a whole number of zones.
+ */
+int sblkdev_zoned_init(struct sblkdev_device *dev, const struct sblkdev_params *params,
+		       struct queue_limits *lim)
+{
+	unsigned int i;
+
+	if (!params->zoned)
+		return 0;
+
+	dev->zone_sectors = params->zone_sectors;
+	dev->zone_capacity = params->zone_capacity ? : params->zone_sectors;
+	if (!is_power_of_2(dev->zone_sectors) ||
+	    dev->zone_sectors < (PAGE_SIZE >> SECTOR_SHIFT) ||
+	    dev->zone_capacity > dev->zone_sectors) {
+		pr_err("Invalid zone size %llu / capacity %llu sectors\n",
+		       dev->zone_sectors, dev->zone_capacity);
+		return -EINVAL;
+	}
+
+	dev->nr_zones = dev->capacity >> ilog2(dev->zone_sectors);
+	if (!dev->nr_zones) {
+		pr_err("Capacity is less than one zone\n");
+		return -EINVAL;
+	}
+	dev->capacity = (sector_t)dev->nr_zones << ilog2(dev->zone_sectors);
+
+	dev->zones = kvcalloc(dev->nr_zones, sizeof(*dev->zones), GFP_KERNEL);
+	if (!dev->zones)
+		return -ENOMEM;
+	for (i = 0; i < dev->nr_zones; i++) {
+		struct sblkdev_zone *zone = &dev->zones[i];
+
+		spin_lock_init(&zone->lock);
+		zone->start = (sector_t)i << ilog2(dev->zone_sectors);
+		zone->wp = zone->start;
+		zone->cond = BLK_ZONE_COND_EMPTY;
+	}
+
+	dev->zone_max_active = min(params->zone_max_active, dev->nr_zones);
+	dev->zone_max_open = min(params->zone_max_open, dev->nr_zones);
+	if (dev->zone_max_active && dev->zone_max_open > dev->zone_max_active)
+		dev->zone_max_open = dev->zone_max_active;
+	spin_lock_init(&dev->zone_res_lock);
+	dev->zone_nr_open = 0;
+	dev->zone_nr_active = 0;
+	dev->zoned = true;
+
+	lim->features |= BLK_FEAT_ZONED;
+	lim->chunk_sectors = dev->zone_sectors;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	lim->max_hw_zone_append_sectors = dev->zone_sectors;
+#else
+	lim->max_zone_append_sectors = dev->zone_sectors;
+#endif
+	lim->max_open_zones = dev->zone_max_open;
+	lim->max_active_zones = dev->zone_max_active;
+	/* Discard and write-zeroes would bypass the write pointers */
+	lim->max_hw_discard_sectors = 0;
+	lim->max_write_zeroes_sectors = 0;
+
+	pr_info("zoned: %u zones of %llu sectors (capacity %llu), max open %u, max active %u\n",
+		dev->nr_zones, dev->zone_sectors, dev->zone_capacity,
+		dev->zone_max_open, dev->zone_max_active);
+
+	return 0;
+}
+
+/*
+ * sblkdev_zoned_register() - Have the block layer pick the zones up
+ * Must come after set_capacity() and before add_disk().
+ */
+int sblkdev_zoned_register(struct sblkdev_device *dev)
+{
+	if (!dev->zoned)
+		return 0;
+
+	dev->disk->nr_zones = dev->nr_zones;
+	return blk_revalidate_disk_zones(dev->disk);
+}
+
+void sblkdev_zoned_free(struct sblkdev_device *dev)
+{
+	kvfree(dev->zones);
+	dev->zones = NULL;
+}
+
+#endif /* CONFIG_SBLKDEV_REQUESTS_BASED && CONFIG_BLK_DEV_ZONED && >= 6.11 */